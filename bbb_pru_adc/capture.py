@@ -1,13 +1,667 @@
+import asyncio
+import collections
 import contextlib
-from ctypes import CDLL, c_uint, c_ushort, c_ubyte, byref
+import errno
+import math
+import os
+from ctypes import CDLL, get_errno, Structure, c_uint, c_int, c_ubyte, c_ushort, c_char_p, c_void_p, c_double, c_ulonglong, byref
 from bbb_pru_adc.driver import Driver, relative
 import array
 
 
-_dll = CDLL(relative('resources/libdriver.so'))
+_dll = CDLL(relative('resources/libdriver.so'), use_errno=True)
+_dll.driver_start.restype = c_void_p
+_dll.driver_open.restype = c_void_p
+_dll.driver_open.argtypes = [c_void_p]
+_dll.driver_max_records.argtypes = [c_uint, c_uint, c_uint]
+_dll.driver_max_pre_trigger.argtypes = [c_uint]
+_dll.driver_config_max_records.argtypes = [c_void_p]
+_dll.driver_read.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_read_raw.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_read_channels.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_read_channels_raw.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_scale.restype = c_double
+_dll.driver_set_calibration.argtypes = [c_void_p, c_uint, c_void_p]
+_dll.driver_set_calibration_linear.argtypes = [c_void_p, c_uint, c_double, c_double]
+_dll.driver_clear_calibration.argtypes = [c_void_p]
+_dll.driver_clear_calibration.restype = None
+_dll.driver_start_reader.argtypes = [c_void_p, c_uint, c_int]
+_dll.driver_reader_stats.argtypes = [c_void_p, c_void_p]
+_dll.driver_ring_stats.argtypes = [c_void_p, c_void_p]
+_dll.driver_stop.argtypes = [c_void_p]
+_dll.driver_close.argtypes = [c_void_p]
+_dll.driver_timing.argtypes = [c_void_p, c_void_p]
+_dll.driver_times.argtypes = [c_void_p, c_void_p, c_void_p]
+_dll.driver_stats.argtypes = [c_void_p, c_void_p]
+_dll.driver_fileno.argtypes = [c_void_p]
+_dll.driver_try_read.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_try_read_raw.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_try_read_channels.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_try_read_channels_raw.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
+_dll.driver_read_summary.argtypes = [c_void_p, c_void_p, c_void_p]
+_dll.driver_try_read_summary.argtypes = [c_void_p, c_void_p, c_void_p]
+_dll.driver_request_status.argtypes = [c_void_p]
+_dll.driver_status.argtypes = [c_void_p, c_void_p]
+_dll.driver_read_block.argtypes = [c_void_p, c_int, c_int, c_void_p, c_void_p, c_void_p, c_int, c_void_p]
+_dll.driver_read_block_raw.argtypes = [c_void_p, c_int, c_int, c_void_p, c_void_p, c_void_p, c_int, c_void_p]
+_dll.driver_record_start.argtypes = [c_void_p, c_void_p]
+_dll.driver_record_stop.argtypes = [c_void_p]
+_dll.driver_record_stats.argtypes = [c_void_p, c_void_p]
+_dll.driver_publish_start.argtypes = [c_void_p, c_void_p]
+_dll.driver_publish_stop.argtypes = [c_void_p]
+_dll.driver_publish_stats.argtypes = [c_void_p, c_void_p]
+_dll.driver_subscribe.restype = c_void_p
+_dll.driver_subscribe.argtypes = [c_char_p]
+_dll.driver_subscription_info.argtypes = [c_void_p, c_void_p]
+_dll.driver_subscription_next.argtypes = [c_void_p, c_int, c_int, c_void_p]
+_dll.driver_subscription_check.argtypes = [c_void_p, c_void_p]
+_dll.driver_unsubscribe.argtypes = [c_void_p]
+_dll.driver_unsubscribe.restype = None
+
+
+def _check(rc, what):
+    '''driver functions return negative errno value on error'''
+    if rc < 0:
+        raise OSError(-rc, '%s: %s' % (what, os.strerror(-rc)))
+    return rc
+
+
+def _timeout_ms(timeout):
+    '''seconds (None - no limit) to driver timeout_ms, rounded up: 0 would not wait at all'''
+    return -1 if timeout is None else int(math.ceil(timeout * 1000))
+
+
+# volts per ADC count, use to convert values captured with dtype='raw'
+SCALE = _dll.driver_scale()
+
+# how often async iteration looks at the PRU ring when there is no descriptor to wait on
+# (transport='shm' without reader_thread), same as the driver's SHM_POLL_NS
+_SHM_POLL_SECONDS = 200e-6
+
+
+# data transports, see src/shm.h
+TRANSPORTS = {
+    'rpmsg': 0,
+    'shm': 1,
+}
+
+
+# trigger modes, see src/trigger.h
+TRIGGER_MODES = {
+    None: 0,
+    'level': 1,
+    'edge': 2,
+}
+
+
+# wire formats, see src/wire.h
+WIRE_FORMATS = {
+    'plain': 0,
+    'packed': 1,
+    'fixed': 2,
+}
+
+
+class DriverConfig(Structure):
+    '''mirrors driver_config_t, see src/driver.h'''
+    _fields_ = [
+        ('device', c_char_p),
+        ('clk_div', c_uint),
+        ('step_avg', c_uint),
+        ('num_channels', c_uint),
+        ('channels', c_ubyte * 8),
+        ('max_num', c_uint),
+        ('target_delay', c_uint),
+        ('layout', c_uint),
+        ('format', c_uint),
+        ('ts_jitter', c_uint),
+        ('adc_mode', c_uint),
+        ('ring_depth', c_uint),
+        ('transport', c_uint),
+        ('shm_path', c_char_p),
+        ('decimate_factor', c_uint),
+        ('decimate_order', c_uint),
+        ('trigger_mode', c_uint),
+        ('trigger_channels', c_uint),
+        ('trigger_rising', c_uint),
+        ('trigger_threshold', c_ushort * 8),
+        ('pre_trigger', c_uint),
+        ('post_trigger', c_uint),
+        ('channel_avg', c_ubyte * 8),
+        ('channel_divisor', c_ushort * 8),
+        ('sample_rate', c_uint),
+        ('summary_window', c_uint),
+    ]
+
+
+class DriverSummary(Structure):
+    '''mirrors driver_summary_t, see src/driver.h'''
+    _fields_ = [
+        ('cycles', c_ulonglong),
+        ('count', c_uint),
+        ('min', c_ushort * 8),
+        ('max', c_ushort * 8),
+        ('sum', c_uint * 8),
+        ('sumsq', c_ulonglong * 8),
+    ]
+
+
+Summary = collections.namedtuple('Summary', 'cycles count min max mean rms')
+Summary.__doc__ = '''Statistics of one window of summary mode: PRU cycles since the previous window, readings
+in it, and min, max, mean, and RMS of each channel (tuples in `channels` order), in volts (ADC counts
+with dtype='raw').'''
+
+
+# what recordings store, see src/record.h
+RECORD_KINDS = {
+    'raw': 0,
+    'decoded': 1,
+}
+
+
+class RecordConfig(Structure):
+    '''mirrors driver_record_config_t, see src/driver.h'''
+    _fields_ = [
+        ('path', c_char_p),
+        ('kind', c_uint),
+        ('segment_size', c_ulonglong),
+        ('max_segments', c_uint),
+        ('block_size', c_uint),
+        ('reader_capacity', c_uint),
+    ]
+
+
+class RecordStats(Structure):
+    '''mirrors driver_record_stats_t, see src/driver.h'''
+    _fields_ = [
+        ('messages', c_ulonglong),
+        ('readings', c_ulonglong),
+        ('dropped', c_ulonglong),
+        ('bytes', c_ulonglong),
+        ('segments', c_uint),
+        ('recording', c_uint),
+        ('error', c_int),
+    ]
+
+
+class PublishConfig(Structure):
+    '''mirrors driver_publish_config_t, see src/driver.h'''
+    _fields_ = [
+        ('name', c_char_p),
+        ('capacity', c_uint),
+        ('reader_capacity', c_uint),
+    ]
+
+
+class PublishStats(Structure):
+    '''mirrors driver_publish_stats_t, see src/driver.h'''
+    _fields_ = [
+        ('messages', c_ulonglong),
+        ('readings', c_ulonglong),
+        ('dropped', c_ulonglong),
+        ('subscribers', c_uint),
+        ('max_lag', c_ulonglong),
+        ('lapped', c_ulonglong),
+        ('publishing', c_uint),
+        ('error', c_int),
+    ]
+
+
+class SubscriptionInfo(Structure):
+    '''mirrors driver_subscription_info_t, see src/driver.h'''
+    _fields_ = [
+        ('num_channels', c_uint),
+        ('channels', c_ubyte * 8),
+        ('capacity', c_uint),
+        ('scale', c_double),
+    ]
+
+
+class _View(Structure):
+    '''mirrors driver_view_t, see src/driver.h'''
+    _fields_ = [
+        ('position', c_ulonglong),
+        ('lapped', c_ulonglong),
+        ('count', c_uint),
+        ('timestamps', c_void_p),
+        ('samples', c_void_p),
+        ('times', c_void_p),
+        ('values', c_void_p),
+    ]
+
+
+View = collections.namedtuple('View', 'position lapped timestamps samples times values')
+View.__doc__ = '''Readings produced by a Subscription: position of the first one in the published stream,
+lapped - readings lost just before it, and memoryviews into shared memory of timestamps (PRU cycles),
+samples (sample index), times (CLOCK_MONOTONIC seconds), and values (ADC counts, interleaved).'''
+
+
+class ReaderStats(Structure):
+    '''mirrors driver_reader_stats_t, see src/driver.h'''
+    _fields_ = [
+        ('capacity', c_uint),
+        ('occupancy', c_uint),
+        ('high_water', c_uint),
+        ('realtime', c_uint),
+        ('messages', c_ulonglong),
+        ('overflows', c_ulonglong),
+    ]
+
+
+# see DRIVER_HISTOGRAM_BUCKETS in src/driver.h
+HISTOGRAM_BUCKETS = 24
+
+
+class Stats(Structure):
+    '''mirrors driver_stats_t, see src/driver.h. Histograms count times in microseconds: bucket 0
+    under 1us, bucket i in [2**(i-1), 2**i) us, the last one everything longer.'''
+    _fields_ = [
+        ('messages', c_ulonglong),
+        ('bytes', c_ulonglong),
+        ('samples', c_ulonglong),
+        ('dropped', c_ulonglong),
+        ('lost', c_ulonglong),
+        ('short_reads', c_ulonglong),
+        ('ack_failures', c_ulonglong),
+        ('wait_histogram', c_ulonglong * HISTOGRAM_BUCKETS),
+        ('arrival_histogram', c_ulonglong * HISTOGRAM_BUCKETS),
+    ]
+
+
+class CycleStat(Structure):
+    '''mirrors driver_cycle_stat_t, see src/driver.h. PRU cycles, 5ns each.'''
+    _fields_ = [
+        ('count', c_uint),
+        ('min', c_uint),
+        ('max', c_uint),
+        ('total', c_ulonglong),
+    ]
+
+    @property
+    def mean(self):
+        return self.total / self.count if self.count else 0.0
+
+
+class Status(Structure):
+    '''mirrors driver_status_t, see src/driver.h and src/telemetry.h'''
+    _fields_ = [
+        ('sequence', c_uint),
+        ('readings', c_uint),
+        ('buffers', c_uint),
+        ('send_failures', c_uint),
+        ('dropped', c_uint),
+        ('loop', CycleStat),
+        ('capture', CycleStat),
+        ('io_send', CycleStat),
+        ('latency', CycleStat),
+        ('missed', c_uint),
+        ('jitter', CycleStat),
+    ]
+
+
+class Gap(Structure):
+    '''mirrors driver_gap_t, see src/driver.h'''
+    _fields_ = [
+        ('offset', c_uint),
+        ('count', c_uint),
+    ]
+
+
+class BlockInfo(Structure):
+    '''mirrors driver_block_t, see src/driver.h'''
+    _fields_ = [
+        ('first_sample', c_ulonglong),
+        ('dropped', c_ulonglong),
+        ('num_gaps', c_uint),
+    ]
+
+
+Block = collections.namedtuple('Block', 'first_sample timestamps values gaps')
+Block.__doc__ = '''Readings returned by Capture.read: sample index of the first one, timestamps and values
+laid out as with iteration, and gaps - a list of (offset, count): count readings are missing just
+before reading offset.'''
+
+
+class RingStats(Structure):
+    '''mirrors driver_ring_stats_t, see src/driver.h'''
+    _fields_ = [
+        ('depth', c_uint),
+        ('used', c_uint),
+        ('high_water', c_uint),
+    ]
+
+
+class Timing(Structure):
+    '''mirrors driver_timing_t, see src/driver.h'''
+    _fields_ = [
+        ('first_sample', c_ulonglong),
+        ('first_tick', c_ulonglong),
+        ('num_records', c_uint),
+        ('tick_seconds', c_double),
+        ('period', c_double),
+        ('first_time', c_double),
+    ]
+
+
+@contextlib.contextmanager
+def _no_pru():
+    yield
+
+
+class Capture:
+    '''Iterator over the captured buffers. Created by `capture`, see there.'''
+
+    def __init__(self, driver, driver_read, driver_try_read, timestamps, values, values_addr, num_channels, dtype,
+                 layout):
+        self._driver = driver
+        self._num_channels = num_channels
+        self._dtype = dtype
+        self._layout = layout
+        self._count = len(timestamps)
+        self._driver_read = driver_read
+        self._driver_try_read = driver_try_read
+        self._num_dropped = c_int()
+        self._timestamps_addr, _ = timestamps.buffer_info()
+        self._values_addr = values_addr
+        self.timestamps = timestamps
+        self.values = values
+        self._times = array.array('d', [0.0] * len(timestamps))
+        self._times_addr, _ = self._times.buffer_info()
+        self._gaps = None
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        count = _check(self._driver_read(self._driver, byref(self._num_dropped), self._timestamps_addr,
+                                         self._values_addr), 'driver_read')
+        return self._buffer(count)
+
+    def try_read(self):
+        '''Same as next(), but returns None instead of blocking when no buffer is there yet'''
+        count = self._driver_try_read(self._driver, byref(self._num_dropped), self._timestamps_addr,
+                                      self._values_addr)
+        if count == -errno.EAGAIN:
+            return None
+        return self._buffer(_check(count, 'driver_try_read'))
+
+    def fileno(self):
+        '''Descriptor that polls readable when a buffer may be waiting (see driver_fileno in
+        src/driver.h). Changes when the reader thread starts. Raises OSError (EOPNOTSUPP) with
+        transport='shm' and no reader_thread: there is nothing to wait on then.'''
+        return _check(_dll.driver_fileno(self._driver), 'driver_fileno')
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        '''async for: waits for buffers in the running event loop (loop.add_reader on fileno()),
+        so capture shares one thread with sockets and timers. Produces the same tuples as
+        iteration, with the same buffer re-use.'''
+        while True:
+            buffer = self.try_read()
+            if buffer is not None:
+                return buffer
+            await self._readable()
+
+    async def _readable(self):
+        try:
+            fd = self.fileno()
+        except OSError as e:
+            if e.errno != errno.EOPNOTSUPP:
+                raise
+            await asyncio.sleep(_SHM_POLL_SECONDS)
+            return
+        loop = asyncio.get_event_loop()  # the running loop; get_running_loop() needs 3.7
+        ready = loop.create_future()
+        loop.add_reader(fd, lambda: ready.done() or ready.set_result(None))
+        try:
+            await ready
+        finally:
+            loop.remove_reader(fd)
+
+    def _buffer(self, count):
+        self._count = count
+        if count == len(self.timestamps):
+            return self._num_dropped.value, self.timestamps, self.values
+
+        # packed wire formats: this buffer was sent early, with fewer readings
+        if isinstance(self.values, list):
+            values = [v[:count] for v in self.values]
+        else:
+            values = self.values[:count * (len(self.values) // len(self.timestamps))]
+        return self._num_dropped.value, self.timestamps[:count], values
+
+    def read(self, n, timeout=None):
+        '''Reads n readings in one call, however many buffers that takes, and returns them as a Block
+        of fresh arrays (timestamps, and values as configured by dtype and layout). Loop runs in C
+        without the GIL, so this costs one Python call per n readings instead of one per buffer.
+        With timeout (seconds), returns fewer readings if they do not arrive in time.
+        A buffer that does not fit whole is split, its rest comes first in the next read(n).'''
+        typecode, zero = ('H', 0) if self._dtype == 'raw' else ('f', 0.)
+        timestamps = array.array('I', [0]) * n
+        values = array.array(typecode, [zero]) * (n * self._num_channels)
+        # a buffer may hold a single reading (trigger windows, sparse formats), so there can be a gap
+        # before every reading; gaps is only read back up to num_gaps, keep it for the next read(n)
+        if self._gaps is None or len(self._gaps) < n + 1:
+            self._gaps = (Gap * (n + 1))()
+        gaps = self._gaps
+        info = BlockInfo()
+        read_block = _dll.driver_read_block_raw if self._dtype == 'raw' else _dll.driver_read_block
+        count = _check(read_block(self._driver, n, _timeout_ms(timeout),
+                                  timestamps.buffer_info()[0], values.buffer_info()[0], gaps, len(gaps),
+                                  byref(info)), 'driver_read_block')
+        if self._layout == 'planar':
+            values = [values[j * n:j * n + count] for j in range(self._num_channels)]
+        elif count < n:
+            values = values[:count * self._num_channels]
+        if count < n:
+            timestamps = timestamps[:count]
+        gaps = [(gaps[k].offset, gaps[k].count) for k in range(info.num_gaps)]
+        return Block(info.first_sample, timestamps, values, gaps)
+
+    def set_calibration(self, channel, table=None, gain=1.0, offset=0.0):
+        '''Calibrates float values of one channel (its index in `channels`, not the AIN number). The
+        driver converts through a table of 4096 values, one per ADC count, as it unpacks buffers, so
+        there is no second pass over the values. table - those 4096 values, e.g. a sensor
+        linearization, in any unit; without it the channel reads count * SCALE * gain + offset.
+        Other channels keep SCALE. dtype='raw' is not affected.'''
+        if not (0 <= channel < self._num_channels):
+            raise ValueError('channel must be in 0..%d' % (self._num_channels - 1))
+        if table is not None:
+            table = array.array('f', table)
+            if len(table) != 4096:
+                raise ValueError('table needs 4096 values, one per ADC count')
+            _check(_dll.driver_set_calibration(self._driver, channel, table.buffer_info()[0]),
+                   'driver_set_calibration')
+        else:
+            _check(_dll.driver_set_calibration_linear(self._driver, channel, gain, offset),
+                   'driver_set_calibration_linear')
+
+    def clear_calibration(self):
+        '''Back to SCALE for every channel'''
+        _dll.driver_clear_calibration(self._driver)
+
+    def timing(self):
+        '''Returns Timing of the last buffer: index of its first sample (counting dropped ones),
+        its CLOCK_MONOTONIC time (`first_time`), and sampling `period` in seconds'''
+        timing = Timing()
+        _check(_dll.driver_timing(self._driver, byref(timing)), 'driver_timing')
+        return timing
+
+    def times(self):
+        '''Returns CLOCK_MONOTONIC time (seconds, array.array('d')) of each sample in the last buffer.
+        Same as time.monotonic(). The array is re-used on next call.'''
+        _check(_dll.driver_times(self._driver, self._timestamps_addr, self._times_addr), 'driver_times')
+        if self._count < len(self._times):
+            return self._times[:self._count]
+        return self._times
+
+    @property
+    def stats(self):
+        '''Stats of the capture so far: messages, bytes, samples, where readings went missing
+        (dropped by PRU, lost on the host, short_reads), ack_failures, and histograms of time spent
+        waiting in reads and between message arrivals'''
+        stats = Stats()
+        _check(_dll.driver_stats(self._driver, byref(stats)), 'driver_stats')
+        return stats
+
+    def request_status(self):
+        '''Asks PRU for its telemetry (Status). The answer comes in between data buffers and is
+        set aside by whatever reads them: the reader thread, or iteration. Fetch it with status().'''
+        _check(_dll.driver_request_status(self._driver), 'driver_request_status')
+
+    def status(self):
+        '''Returns the latest Status PRU sent (counters and cycle stats since start: main loop,
+        capture of a reading, send, and buffer latency; with sample_rate, deadlines missed and how
+        late triggers came), or None if none came yet. status().sequence goes up with every answer.'''
+        status = Status()
+        if _dll.driver_status(self._driver, byref(status)) != 0:
+            return None
+        return status
+
+    def reader_stats(self):
+        '''Returns ReaderStats of the background reader thread, or None if it was not started'''
+        stats = ReaderStats()
+        if _dll.driver_reader_stats(self._driver, byref(stats)) != 0:
+            return None
+        return stats
+
+    def ring_stats(self):
+        '''Returns RingStats of the PRU ring, as reported by the last buffer'''
+        stats = RingStats()
+        _check(_dll.driver_ring_stats(self._driver, byref(stats)), 'driver_ring_stats')
+        return stats
+
+    def start_recording(self, path, kind='raw', segment_size=0, max_segments=0, block_size=0, reader_capacity=0):
+        '''Starts writing everything PRU sends to segment files path.000000, path.000001, ...
+        from a native thread, so Python does not touch the data at all. Starts the background
+        reader (with reader_capacity buffers, default 4096) if reader_thread was not given.
+        Iterating is not possible until stop_recording().
+
+            kind - 'raw' keeps buffers as PRU sent them (smallest), 'decoded' keeps plain
+                [ts32, v0, ..., vN-1] records whatever the wire format
+            segment_size - bytes per segment file, 0 for 64MB
+            max_segments - keep only the latest that many segments (a ring on disk), 0 keeps all
+            block_size - bytes per disk write, multiple of 4096, 0 for 1MB
+
+        Read the files back with bbb_pru_adc.record.Recording. See src/record.h for the layout.
+        '''
+        if kind not in RECORD_KINDS:
+            raise ValueError('kind must be one of %s' % ', '.join(RECORD_KINDS))
+        config = RecordConfig(
+            path=os.fsencode(path),
+            kind=RECORD_KINDS[kind],
+            segment_size=segment_size,
+            max_segments=max_segments,
+            block_size=block_size,
+            reader_capacity=reader_capacity,
+        )
+        _check(_dll.driver_record_start(self._driver, byref(config)), 'driver_record_start')
+
+    def stop_recording(self):
+        '''Writes out what is left and closes the last segment. Raises OSError if recording
+        stopped on an error (e.g. disk full).'''
+        _check(_dll.driver_record_stop(self._driver), 'driver_record_stop')
+
+    def recording_stats(self):
+        '''Returns RecordStats of the current (or last) recording, or None if there was none'''
+        stats = RecordStats()
+        if _dll.driver_record_stats(self._driver, byref(stats)) != 0:
+            return None
+        return stats
+
+    def start_publishing(self, name=None, capacity=0, reader_capacity=0):
+        '''Shares the capture with other processes: a native thread decodes everything PRU sends
+        into a shared memory ring, which any number of them read with `subscribe(name)`. Starts the
+        background reader (with reader_capacity buffers, default 4096) if reader_thread was not
+        given. Iterating is not possible until stop_publishing().
+
+            name - shm_open name, starting with '/'; None for '/bbb_adc'
+            capacity - readings the ring holds, rounded up to a power of 2; 0 for 262144.
+                Subscribers that fall further behind than that lose readings.
+
+        Raises OSError (EADDRINUSE) if another live process publishes under the name.
+        See src/fanout.h for the layout.
+        '''
+        config = PublishConfig(
+            name=None if name is None else os.fsencode(name),
+            capacity=capacity,
+            reader_capacity=reader_capacity,
+        )
+        _check(_dll.driver_publish_start(self._driver, byref(config)), 'driver_publish_start')
+
+    def stop_publishing(self):
+        '''Marks the ring stopped (subscribers finish what is in it) and removes its name'''
+        _check(_dll.driver_publish_stop(self._driver), 'driver_publish_stop')
+
+    def publishing_stats(self):
+        '''Returns PublishStats of the current (or last) publisher, or None if there was none:
+        what was published, and subscribers attached now, how far behind the slowest one is,
+        and readings they lost to the ring'''
+        stats = PublishStats()
+        if _dll.driver_publish_stats(self._driver, byref(stats)) != 0:
+            return None
+        return stats
+
+
+class SummaryCapture(Capture):
+    '''Iterator over the summaries PRU sends in summary mode. Created by `capture` with
+    summary_window, see there. What works on readings (read, times, timing, set_calibration)
+    raises OSError with errno.EOPNOTSUPP, as the driver does.'''
+
+    def __init__(self, driver, num_channels, num_records, dtype):
+        self._driver = driver
+        self._num_channels = num_channels
+        self._dtype = dtype
+        self._scale = 1.0 if dtype == 'raw' else SCALE
+        self._num_dropped = c_int()
+        self._summaries = (DriverSummary * num_records)()
+
+    def __next__(self):
+        count = _check(_dll.driver_read_summary(self._driver, byref(self._num_dropped), self._summaries),
+                       'driver_read_summary')
+        return self._buffer(count)
+
+    def try_read(self):
+        '''Same as next(), but returns None instead of blocking when no buffer is there yet'''
+        count = _dll.driver_try_read_summary(self._driver, byref(self._num_dropped), self._summaries)
+        if count == -errno.EAGAIN:
+            return None
+        return self._buffer(_check(count, 'driver_try_read_summary'))
+
+    def _buffer(self, count):
+        scale, n = self._scale, self._num_channels
+        summaries = []
+        for s in self._summaries[:count]:
+            summaries.append(Summary(
+                s.cycles, s.count,
+                tuple(s.min[j] * scale for j in range(n)),
+                tuple(s.max[j] * scale for j in range(n)),
+                tuple(s.sum[j] / s.count * scale for j in range(n)),
+                tuple(math.sqrt(s.sumsq[j] / s.count) * scale for j in range(n)),
+            ))
+        return self._num_dropped.value, summaries
+
+    def read(self, n, timeout=None):
+        _check(-errno.EOPNOTSUPP, 'driver_read_block')
+
+    def timing(self):
+        _check(-errno.EOPNOTSUPP, 'driver_timing')
+
+    def times(self):
+        _check(-errno.EOPNOTSUPP, 'driver_times')
+
+    def set_calibration(self, channel, table=None, gain=1.0, offset=0.0):
+        _check(-errno.EOPNOTSUPP, 'driver_set_calibration')
+
 
 @contextlib.contextmanager
-def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, target_delay=0):
+def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, target_delay=0, device=None,
+        dtype='float', layout='interleaved', reader_thread=0, reader_priority=0, wire_format='plain', ts_jitter=0,
+        continuous=False, ring_depth=0, transport='rpmsg', shm_path=None, decimate=1, decimate_order=1,
+        trigger=None, trigger_threshold=None, trigger_rising=True, pre_trigger=0, post_trigger=0,
+        rate_divisor=None, sample_rate=0, summary_window=0):
     '''
     ADC capture.
 
@@ -30,6 +684,7 @@ def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, targ
             2 -> average over 4 samples
             3 -> average over 8 samples
             4 -> average over 16 samples (smoothest, recommended)
+            Can also be a list with a value per channel, in `channels` order.
 
         max_num - put a limit on the number of readings per buffer. This makes it
             possible to lower the latency. Default is 0, that disables the limit.
@@ -37,6 +692,114 @@ def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, targ
 
         target_delay - number of PRU cycles between ADC captures. One cycle is 5ns.
             This allows one to lower the capture frequency and target a specific value.
+            The wait starts after a reading is taken, so the actual period is longer;
+            use sample_rate for an exact one.
+
+        sample_rate - readings per second (up to 200000), triggered by the PRU timer on a fixed
+            schedule: the long-run rate is exact without calibration, and timestamps add up to
+            true time. Deadlines the ADC is too slow for (see clk_div, step_avg) are skipped.
+            Capture.status() reports those, and the jitter of triggers. Overrides target_delay.
+            Default is 0: target_delay paces readings.
+
+        device - path to the PRU device. Default is None, meaning that we install/start
+            PRU firmware and talk to /dev/rpmsg_pru30. If set, PRU is not touched and
+            driver connects to the given path instead. Use this to capture from
+            PRU emulator (see src/emulator.c), e.g. device='/tmp/pru_emulator'.
+
+        dtype - type of values to produce:
+            'float' -> voltages, array.array('f') (default)
+            'raw'   -> 12-bit ADC counts (0..4095), array.array('H'). Cheaper, as
+                       driver just copies the counts. Multiply by SCALE to get volts.
+
+        layout - how values are returned:
+            'interleaved' -> one array, channel-first order (see below). Default.
+            'planar'      -> a list of arrays, one per channel, in the order of `channels`.
+                             Driver splits channels in C, no need to stride through
+                             the values in Python.
+
+        reader_thread - if non-zero, driver starts a background thread that reads and acknowledges
+            PRU buffers as soon as they arrive, and keeps up to that many of them until we
+            iterate. This protects against data loss when Python stalls (e.g. GC pause or
+            slow processing of one buffer). See also Capture.reader_stats().
+
+        reader_priority - SCHED_FIFO priority of the reader thread (1..99), 0 to keep normal
+            priority. Needs root (or rtprio limit), silently ignored otherwise.
+
+        wire_format - how PRU packs the readings into buffers (see src/wire.h):
+            'plain'  -> 16-bit values and 32-bit timestamps (default)
+            'packed' -> 12-bit values, timestamps as one 32-bit base plus 8-bit deltas.
+                        About twice as many readings per buffer (fewer buffers, interrupts,
+                        and syscalls per second).
+            'fixed'  -> 12-bit values, one timestamp per buffer. PRU checks that every
+                        timestamp is within ts_jitter cycles of it, and all readings are
+                        reported with that timestamp. Use with target_delay.
+            With packed formats, PRU sends a buffer early if a timestamp does not fit,
+            so some buffers hold fewer readings.
+
+        ts_jitter - for wire_format='fixed', max deviation of a timestamp from the first one
+            in the buffer, in PRU cycles
+
+        continuous - run ADC sequencer in continuous mode: it converts the requested channels
+            back to back, and PRU just drains them from the FIFO. Gives the highest rate
+            (which then grows as fewer channels are captured). Rate is set by clk_div and
+            step_avg only, target_delay and sample_rate are ignored. Default is False: PRU triggers every reading.
+
+        ring_depth - number of buffers PRU fills in turn (1..24), 0 for the default of 8. Deeper
+            ring rides out longer host stalls before readings are dropped. Every buffer reports
+            how many of them were in use, see Capture.ring_stats().
+
+        transport - how buffers get from PRU to the driver:
+            'rpmsg' -> PRU sends them over rpmsg, driver reads them from the device (default)
+            'shm'   -> driver maps PRU shared RAM and reads buffers in place: no syscalls or
+                       copies per buffer, rpmsg only carries commands. Needs access to
+                       /dev/mem (root). Without an interrupt, waiting means polling every 200us.
+
+        shm_path - for transport='shm', what to map: None for /dev/mem, or a regular file
+            (e.g. the one given to the emulator with -m)
+
+        decimate - PRU filters readings and keeps one of every `decimate` of them, so ADC can run
+            fast (less noise) while buffers, interrupts, and host work drop by that factor.
+            Values stay 12-bit counts; timestamps are cycles since the previous kept reading.
+            Default is 1 (off).
+
+        decimate_order - 1 for a boxcar (mean of `decimate` readings, default), 2 or 3 for a CIC
+            filter of that order (better alias rejection, longer response). decimate**decimate_order
+            must not exceed 2**20. See src/decimate.h.
+
+        trigger - None (default) streams every reading. 'level' or 'edge' makes PRU hold readings
+            back until a watched channel meets its threshold, and then send only a window around
+            that reading: pre_trigger readings before it, the reading itself, and post_trigger
+            readings after it. Firing again within the window extends it. Host load and traffic
+            then follow the event rate. 'level' fires on every reading at or beyond the threshold,
+            'edge' only on readings that cross it. Gaps between windows are not counted as
+            dropped; Capture.timing() gives the sample index of each buffer, and a buffer never
+            spans two windows. See src/trigger.h.
+
+        trigger_threshold - threshold in volts: one value for all channels, or a list with a value
+            (or None, not watched) per channel in `channels` order
+
+        trigger_rising - True (default) fires on rising values, False on falling ones. One value
+            for all channels, or a list per channel.
+
+        pre_trigger, post_trigger - window around the reading that fired, in readings. pre_trigger
+            is limited by PRU memory to 4096 // (2 + len(channels)), post_trigger to 65534.
+
+        rate_divisor - None (default) converts every channel on every reading. Otherwise a list
+            with a divisor per channel, in `channels` order: a channel is converted on every
+            divisor-th reading only (counting from 0), e.g. [1, 64, 64] samples the first channel
+            on every reading and the other two on every 64th. At least one divisor must be 1.
+            Slow channels cost no conversion time and no buffer space on the other readings,
+            so buffers hold more readings. Values are still returned for every channel: one
+            that was not converted repeats its last value. Channel i is fresh on reading
+            `timing().first_sample + k` if that is a multiple of rate_divisor[i]. Does not go
+            with decimate or trigger. See src/schedule.h.
+
+        summary_window - 0 (default) sends readings. Otherwise PRU keeps min, max, mean, and RMS
+            of every channel over that many readings (up to 2**20, after decimate), and sends just
+            those: the ADC runs at full speed, while traffic and host work drop by the window.
+            Iteration then produces (num_dropped, summaries), a list of Summary tuples, and
+            num_dropped counts lost windows. Does not go with trigger or rate_divisor.
+            See src/summary.h.
 
     To capture just one value per read, pass a channels list of size 1.
 
@@ -50,11 +813,14 @@ def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, targ
             ...  # do something with the buffer
     ```
 
-    Context that `capture` creates is an iterator. This iterator produces tuples:
+    In asyncio code, use `async for buffer in c:` instead, it does not block the event loop.
+
+    Context that `capture` creates is an iterator (a Capture object). This iterator produces tuples:
 
         num_dropped: int - number of datapoints dropped because of buffer overflow (hopefully zero)
         timestamps: array.array of unsigned int values - PRU timestamps of the captured datapoints
-        values: array.array of float values - voltages
+        values: array.array of float values - voltages (or of unsigned short values - ADC
+            counts, if dtype='raw')
 
     Length of timestamps array is constant for the capture session, and depends on the number of
     ADC channels we capture. Size of one data point in exchange buffer is (4 + 2*num_channels).
@@ -74,8 +840,17 @@ def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, targ
         channel0_1 and channel1_1 are values of channel 0 and 1 at time step 1
         channel0_2 and channel1_2 are values of channel 0 and 1 at time step 2
 
+    With layout='planar', values is a list of num_channels arrays, each of length num_datapoints:
+
+        [[channel0_0, channel0_1, channel0_2], [channel1_0, channel1_1, channel1_2]]
+
     Driver re-uses timestamps and values buffers and will re-write their contents on next iteration.
     Therefore, you need to copy values out if you are not processing them immediately.
+
+    Timestamps are PRU cycles since the previous datapoint. For absolute time, call `c.times()`
+    after each iteration (CLOCK_MONOTONIC seconds of every datapoint, same clock as time.monotonic()),
+    or `c.timing()` for the index and time of the first datapoint plus the sampling period.
+    Dropped datapoints are accounted for in both.
     ```
 
     Context that `capture` creates is an iterator. This iterator produces tuples
@@ -93,38 +868,196 @@ def capture(channels, auto_install=False, clk_div=0, step_avg=4, max_num=0, targ
         raise ValueError('Do not repeat channels!')
     if not (0 <= clk_div <= 0xffff):
         raise ValueError('clk_div must be in 0..0xffff')
-    if not (0 <= step_avg <= 4):
-        raise ValueError('step_avg must be in 0..4')
+    channel_avg = step_avg if isinstance(step_avg, (list, tuple)) else [step_avg] * num_channels
+    if len(channel_avg) != num_channels or not all(0 <= x <= 4 for x in channel_avg):
+        raise ValueError('step_avg must be in 0..4, or a list of such values per channel')
+    if rate_divisor is None:
+        rate_divisor = [1] * num_channels
+    if len(rate_divisor) != num_channels or not all(1 <= x <= 0xffff for x in rate_divisor) \
+            or 1 not in rate_divisor:
+        raise ValueError('rate_divisor must be a list of values in 1..65535 per channel, with at least one 1')
+    if max(rate_divisor) > 1 and (decimate > 1 or trigger is not None):
+        raise ValueError('rate_divisor does not go with decimate or trigger')
+    if dtype not in ('float', 'raw'):
+        raise ValueError('dtype must be "float" or "raw"')
+    if layout not in ('interleaved', 'planar'):
+        raise ValueError('layout must be "interleaved" or "planar"')
+    if not (0 <= ring_depth <= 24):
+        raise ValueError('ring_depth must be in 0..24')
+    if not (1 <= decimate_order <= 3) or decimate < 1 or decimate ** decimate_order > 1 << 20:
+        raise ValueError('decimate_order must be in 1..3, and decimate**decimate_order in 1..2**20')
+    if trigger not in TRIGGER_MODES:
+        raise ValueError('trigger must be None, "level", or "edge"')
+    trigger_channels, trigger_rising_mask = 0, 0
+    thresholds = [0] * 8
+    if trigger is not None:
+        if not isinstance(trigger_threshold, (list, tuple)):
+            trigger_threshold = [trigger_threshold] * num_channels
+        if not isinstance(trigger_rising, (list, tuple)):
+            trigger_rising = [trigger_rising] * num_channels
+        if len(trigger_threshold) != num_channels or len(trigger_rising) != num_channels:
+            raise ValueError('trigger_threshold and trigger_rising need one value per channel')
+        for i, (volts, rising) in enumerate(zip(trigger_threshold, trigger_rising)):
+            if volts is None:
+                continue
+            trigger_channels |= 1 << i
+            trigger_rising_mask |= (1 << i) if rising else 0
+            thresholds[i] = min(4095, max(0, int(round(volts / SCALE))))
+        if trigger_channels == 0:
+            raise ValueError('trigger needs a threshold for at least one channel')
+        if not (0 <= pre_trigger <= _dll.driver_max_pre_trigger(num_channels)):
+            raise ValueError('pre_trigger must be in 0..%d' % _dll.driver_max_pre_trigger(num_channels))
+        if not (0 <= post_trigger < 0xffff):
+            raise ValueError('post_trigger must be in 0..65534')
+    if transport not in TRANSPORTS:
+        raise ValueError('transport must be one of %s' % ', '.join(TRANSPORTS))
+    if not (0 <= sample_rate <= 200000):
+        raise ValueError('sample_rate must be in 0..200000')
+    if wire_format not in WIRE_FORMATS:
+        raise ValueError('wire_format must be one of %s' % ', '.join(WIRE_FORMATS))
+    if not (0 <= summary_window <= 1 << 20):
+        raise ValueError('summary_window must be in 0..2**20')
+    if summary_window > 0 and (trigger is not None or max(rate_divisor) > 1):
+        raise ValueError('summary_window does not go with trigger or rate_divisor')
+
+    config = DriverConfig(
+        device=device.encode() if device is not None else None,
+        clk_div=clk_div,
+        step_avg=min(channel_avg),
+        num_channels=num_channels,
+        channels=(c_ubyte * 8)(*channels),
+        max_num=max_num,
+        target_delay=target_delay,
+        layout=1 if layout == 'planar' else 0,  # for driver_read_block, driver_read_channels is planar anyway
+        format=WIRE_FORMATS[wire_format],
+        ts_jitter=ts_jitter,
+        adc_mode=1 if continuous else 0,  # DRIVER_ADC_CONTINUOUS or DRIVER_ADC_ONESHOT
+        ring_depth=ring_depth,
+        transport=TRANSPORTS[transport],
+        shm_path=shm_path.encode() if shm_path is not None else None,
+        decimate_factor=decimate,
+        decimate_order=decimate_order,
+        trigger_mode=TRIGGER_MODES[trigger],
+        trigger_channels=trigger_channels,
+        trigger_rising=trigger_rising_mask,
+        trigger_threshold=(c_ushort * 8)(*thresholds),
+        pre_trigger=pre_trigger,
+        post_trigger=post_trigger,
+        channel_avg=(c_ubyte * 8)(*channel_avg),
+        channel_divisor=(c_ushort * 8)(*rate_divisor),
+        sample_rate=sample_rate,
+        summary_window=summary_window,
+    )
 
-    num_records = (512-16-4) // (4 + 2 * num_channels)
-    if max_num > 0 and max_num < num_records:
-        num_records = max_num
+    num_records = _check(_dll.driver_config_max_records(byref(config)), 'driver_config_max_records')
     timestamps = array.array('I', [0] * num_records)
-    values = array.array('f', [0.] * (num_records * num_channels))
-    num_dropped = c_ushort()
-
-    pru = Driver(fw0=relative('resources/am335x-pru0.fw'))
-    with pru(auto_install=auto_install):
-        c_channels = c_ubyte*num_channels
-        driver = _dll.driver_start(
-            c_uint(clk_div),
-            c_uint(step_avg),
-            c_uint(num_channels),
-            c_channels(*channels),
-            c_uint(max_num),
-            c_uint(target_delay)
-        )
-        def reader():
-            tms_addr, _ = timestamps.buffer_info()
-            val_addr, _ = values.buffer_info()
-            while True:
-                rc = _dll.driver_read(driver, byref(num_dropped), tms_addr, val_addr)
-                if rc != 0:
-                    raise RuntimeError('io error in driver')
-                yield num_dropped.value, timestamps, values
+    typecode, zero = ('H', 0) if dtype == 'raw' else ('f', 0.)
+    if layout == 'planar':
+        values = [array.array(typecode, [zero] * num_records) for _ in channels]
+        values_addr = (c_void_p * num_channels)(*(v.buffer_info()[0] for v in values))
+        driver_read = _dll.driver_read_channels_raw if dtype == 'raw' else _dll.driver_read_channels
+        driver_try_read = _dll.driver_try_read_channels_raw if dtype == 'raw' else _dll.driver_try_read_channels
+    else:
+        values = array.array(typecode, [zero] * (num_records * num_channels))
+        values_addr = values.buffer_info()[0]
+        driver_read = _dll.driver_read_raw if dtype == 'raw' else _dll.driver_read
+        driver_try_read = _dll.driver_try_read_raw if dtype == 'raw' else _dll.driver_try_read
+
+    if device is None:
+        pru = Driver(fw0=relative('resources/am335x-pru0.fw'))(auto_install=auto_install)
+    else:
+        pru = _no_pru()
+    with pru:
+        driver = _dll.driver_open(byref(config))
+        if not driver:
+            err = get_errno()
+            raise OSError(err, 'driver_open: %s' % os.strerror(err))
 
         try:
-            yield reader()
+            if reader_thread > 0:
+                _check(_dll.driver_start_reader(driver, reader_thread, reader_priority), 'driver_start_reader')
+            if summary_window > 0:
+                yield SummaryCapture(driver, num_channels, num_records, dtype)
+            else:
+                yield Capture(driver, driver_read, driver_try_read, timestamps, values, values_addr, num_channels,
+                              dtype, layout)
         finally:
-            _dll.driver_stop(driver)
+            _dll.driver_close(driver)
+
+
+class Subscription:
+    '''Iterator over the readings a Capture publishes (see Capture.start_publishing), from any process.
+    Created by `subscribe`, see there.'''
+
+    def __init__(self, subscription, max_readings):
+        self._subscription = subscription
+        self._max_readings = max_readings
+        self._view = _View()
+        info = SubscriptionInfo()
+        _check(_dll.driver_subscription_info(subscription, byref(info)), 'driver_subscription_info')
+        self.num_channels = info.num_channels
+        self.channels = list(info.channels[:info.num_channels])
+        self.capacity = info.capacity
+        self.scale = info.scale
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        view = self.next()
+        if view is None:
+            raise StopIteration
+        return view
+
+    def next(self, max_readings=None, timeout=None):
+        '''Next View of up to max_readings readings (default as given to `subscribe`), waiting up
+        to timeout seconds (None - forever) for them. Returns None once the publisher has stopped and
+        every reading was taken; raises OSError (ETIMEDOUT) on timeout.'''
+        count = _dll.driver_subscription_next(self._subscription, max_readings or self._max_readings,
+                                              _timeout_ms(timeout),
+                                              byref(self._view))
+        if count == -errno.EPIPE:
+            return None
+        _check(count, 'driver_subscription_next')
+        view = self._view
+        return View(view.position, view.lapped,
+                    memoryview((c_uint * count).from_address(view.timestamps)).cast('B').cast('I'),
+                    memoryview((c_ulonglong * count).from_address(view.samples)).cast('B').cast('Q'),
+                    memoryview((c_double * count).from_address(view.times)).cast('B').cast('d'),
+                    memoryview((c_ushort * (count * self.num_channels)).from_address(view.values)).cast('B').cast('H'))
+
+    def check(self, view):
+        '''True if the ring did not overwrite any of view while it was in use. Views point into shared
+        memory: process (or copy) first, then check.'''
+        checked = _View(position=view.position, count=len(view.timestamps))
+        return _dll.driver_subscription_check(self._subscription, byref(checked)) == 0
 
+
+@contextlib.contextmanager
+def subscribe(name=None, max_readings=4096):
+    '''
+    Reads what another process publishes with Capture.start_publishing(name), or the bbb-adc-fanout
+    daemon. Any number of processes can subscribe; each one starts with the readings published from
+    then on, and none of them slows the capture down. Memory is read in place, nothing is copied.
+
+        name - shm_open name the capture is published under, None for '/bbb_adc'
+        max_readings - most readings per View
+
+    Produces View tuples (see there) until the publisher stops. A subscriber that falls more than
+    `capacity` readings behind loses the oldest ones: View.lapped tells how many. Values are ADC
+    counts, multiply by `scale` for volts.
+
+    ```
+    with subscribe() as s:
+        for view in s:
+            ...  # do something with view.values
+    ```
+    '''
+    subscription = _dll.driver_subscribe(None if name is None else os.fsencode(name))
+    if not subscription:
+        err = get_errno()
+        raise OSError(err, 'driver_subscribe: %s' % os.strerror(err))
+    try:
+        yield Subscription(subscription, max_readings)
+    finally:
+        _dll.driver_unsubscribe(subscription)
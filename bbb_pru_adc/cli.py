@@ -0,0 +1,51 @@
+'''
+What the command line tools (bbb-adc-record, bbb-adc-fanout) have in common: capture options,
+and running until interrupted (or for --seconds) with a line of stats every second.
+'''
+import signal
+import time
+from bbb_pru_adc.capture import capture, WIRE_FORMATS
+
+
+def add_capture_arguments(parser):
+    '''Adds the options open_capture() takes, and --seconds'''
+    parser.add_argument('-c', '--channels', type=int, nargs='+', default=list(range(8)),
+                        help='channels to capture, 0 (AIN1) .. 7 (AIN8); default all eight')
+    parser.add_argument('--clk-div', type=int, default=0)
+    parser.add_argument('--step-avg', type=int, default=0)
+    parser.add_argument('--target-delay', type=int, default=0, help='PRU cycles between readings')
+    parser.add_argument('--sample-rate', type=int, default=0, help='readings per second, on the PRU timer')
+    parser.add_argument('--continuous', action='store_true', help='ADC continuous mode (highest rate)')
+    parser.add_argument('--format', choices=list(WIRE_FORMATS), default='packed', help='wire format')
+    parser.add_argument('--device', help='PRU device, e.g. the emulator socket; default installs and starts PRU')
+    parser.add_argument('--transport', choices=['rpmsg', 'shm'], default='rpmsg')
+    parser.add_argument('--shm-path')
+    parser.add_argument('--seconds', type=float, default=0, help='stop after that long; default runs until Ctrl-C')
+    parser.add_argument('--buffers', type=int, default=4096, help='capacity of the reader ring, in PRU buffers')
+    parser.add_argument('--priority', type=int, default=0, help='SCHED_FIFO priority of the reader thread')
+
+
+def open_capture(args):
+    '''capture() as configured by add_capture_arguments() options, with the reader thread'''
+    return capture(args.channels, auto_install=args.device is None, clk_div=args.clk_div, step_avg=args.step_avg,
+                   target_delay=args.target_delay, sample_rate=args.sample_rate, continuous=args.continuous,
+                   wire_format=args.format, device=args.device, transport=args.transport, shm_path=args.shm_path,
+                   reader_thread=args.buffers, reader_priority=args.priority)
+
+
+def run(seconds, report):
+    '''Calls report(elapsed) every second until SIGINT or SIGTERM, seconds (if > 0) have passed, or
+    report returns False. The last call may come sooner, at the deadline.'''
+    stop = []
+    signal.signal(signal.SIGINT, lambda *av: stop.append(True))
+    signal.signal(signal.SIGTERM, lambda *av: stop.append(True))
+
+    start = time.monotonic()
+    deadline = start + seconds if seconds > 0 else None
+    while not stop:
+        left = 1.0 if deadline is None else min(1.0, deadline - time.monotonic())
+        if left <= 0:
+            break
+        time.sleep(left)
+        if not report(time.monotonic() - start):
+            break
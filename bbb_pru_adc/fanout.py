@@ -0,0 +1,45 @@
+'''
+The bbb-adc-fanout daemon: owns the PRU capture and publishes it to shared memory, so that
+any number of processes read it with bbb_pru_adc.capture.subscribe (layout in src/fanout.h).
+'''
+import argparse
+import sys
+from bbb_pru_adc.cli import add_capture_arguments, open_capture, run
+
+
+def main(argv=None):
+    '''bbb-adc-fanout: publishes a capture until interrupted (or for --seconds)'''
+    parser = argparse.ArgumentParser(prog='bbb-adc-fanout', description='Shares ADC capture with other processes.')
+    parser.add_argument('-n', '--name', default='/bbb_adc', help='shared memory name subscribers open')
+    add_capture_arguments(parser)
+    parser.add_argument('--capacity', type=int, default=1 << 18,
+                        help='readings the shared ring holds; slower subscribers lose the oldest')
+    args = parser.parse_args(argv)
+
+    with open_capture(args) as cap:
+        try:
+            cap.start_publishing(args.name, capacity=args.capacity)
+        except OSError as e:
+            print('bbb-adc-fanout:', e, file=sys.stderr)
+            return 1
+
+        def report(elapsed):
+            stats = cap.publishing_stats()
+            print('%8.1fs %12d readings %10.1f kHz %8d dropped %3d subscribers %10d behind %10d lapped' % (
+                elapsed, stats.readings, stats.readings / elapsed / 1000, stats.dropped, stats.subscribers,
+                stats.max_lag, stats.lapped), file=sys.stderr)
+            return stats.publishing
+
+        run(args.seconds, report)
+        try:
+            cap.stop_publishing()
+        except OSError as e:
+            print('bbb-adc-fanout:', e, file=sys.stderr)
+            return 1
+        stats = cap.publishing_stats()
+        print('published %d readings in %d buffers, %d dropped' % (stats.readings, stats.messages, stats.dropped))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
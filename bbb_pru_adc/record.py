@@ -0,0 +1,243 @@
+'''
+Recordings: segment files written by Capture.start_recording (layout in src/record.h),
+and the bbb-adc-record command line tool that makes them.
+'''
+import argparse
+import array
+import bisect
+import collections
+import glob
+import mmap
+import re
+import struct
+import sys
+from ctypes import CFUNCTYPE, c_int, c_uint, c_void_p
+from bbb_pru_adc.capture import _dll, RECORD_KINDS, WIRE_FORMATS
+from bbb_pru_adc.cli import add_capture_arguments, open_capture, run
+
+
+# see src/record.h
+RECORD_MAGIC = b'bbbadc01'
+RECORD_VERSION = 1
+RECORD_INDEXED = 1
+RECORD_SPARSE = 2
+
+_HEADER = struct.Struct('<8sIIIIIIQQI8BIIIIIIIII8B8HQQddd')
+_INDEX = struct.Struct('<QQdII')
+_BLOCK = struct.Struct('<IIIIQQd')
+_ENTRY = struct.Struct('<IIiIQQ')
+_WIRE_HEADER_SIZE = 4
+
+_UNPACK_RAW = CFUNCTYPE(None, c_void_p, c_int, c_void_p, c_void_p)
+_dll.unpack_raw_select.argtypes = [c_int]
+_dll.unpack_raw_select.restype = _UNPACK_RAW
+_dll.unpack_wire.argtypes = [c_void_p, c_uint, c_int, c_void_p]
+_dll.unpack_sparse.argtypes = [c_void_p, c_uint, c_int, c_void_p, c_void_p]
+
+
+Header = collections.namedtuple('Header', [
+    'magic', 'version', 'kind', 'segment', 'block_size', 'max_blocks', 'num_blocks', 'index_offset',
+    'data_offset', 'num_channels', 'channels', 'clk_div', 'step_avg', 'target_delay', 'format', 'adc_mode',
+    'decimate_factor', 'decimate_order', 'trigger_mode', 'flags', 'channel_avg', 'channel_divisor',
+    'first_sample', 'first_tick', 'first_time', 'tick_seconds', 'scale'])
+
+
+Message = collections.namedtuple('Message', 'first_sample first_tick first_time dropped timestamps values')
+Message.__doc__ = '''One PRU buffer of a recording. timestamps (array.array('I'), PRU cycles since the
+previous reading) and values (array.array('H'), ADC counts interleaved as in capture()) are fresh
+arrays. first_time is CLOCK_MONOTONIC seconds of the first reading.'''
+
+
+def _parse_header(data):
+    fields = list(_HEADER.unpack_from(data, 0))
+    # regroup array fields: channels (8B), channel_avg (8B), channel_divisor (8H)
+    head, fields = fields[:10], fields[10:]
+    channels, fields = tuple(fields[:8]), fields[8:]
+    middle, fields = fields[:9], fields[9:]
+    channel_avg, fields = tuple(fields[:8]), fields[8:]
+    channel_divisor, fields = tuple(fields[:8]), fields[8:]
+    return Header(*head, channels, *middle, channel_avg, channel_divisor, *fields)
+
+
+class _Segment:
+    def __init__(self, path):
+        self.path = path
+        with open(path, 'rb') as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        self.header = _parse_header(self.map)
+        if self.header.magic != RECORD_MAGIC or self.header.version != RECORD_VERSION:
+            self.map.close()
+            raise ValueError('%s is not a recording segment' % path)
+        # blocks that made it to disk, even if the header was not updated after the last one
+        num_blocks = min(self.header.max_blocks, (len(self.map) - self.header.data_offset) // self.header.block_size)
+        self.index = [_INDEX.unpack_from(self.map, self.header.index_offset + i * _INDEX.size)
+                      for i in range(min(self.header.num_blocks, num_blocks))]
+
+    def block(self, i):
+        '''yields (entry, payload bytes) of the i-th block'''
+        offset = self.header.data_offset + i * self.header.block_size
+        _, num_messages, _, _, _, _, _ = _BLOCK.unpack_from(self.map, offset)
+        pos = offset + _BLOCK.size
+        for _ in range(num_messages):
+            entry = _ENTRY.unpack_from(self.map, pos)
+            pos += _ENTRY.size
+            yield entry, self.map[pos:pos + entry[0]]
+            pos += (entry[0] + 7) // 8 * 8
+
+    def close(self):
+        self.map.close()
+
+
+class Recording:
+    '''
+    Reads a recording back. Segments are mapped into memory, and an index of blocks
+    lets messages() start anywhere without reading what comes before.
+
+        rec = Recording('/data/run1')  # finds /data/run1.000000, /data/run1.000001, ...
+        for msg in rec.messages(first_sample=1000000):
+            ...  # msg.timestamps, msg.values as with capture(dtype='raw')
+
+    header describes the capture (channels, clk_div, step_avg, ...), see src/record.h.
+    In sparse recordings (rate_divisor) read from the middle, channels that were not
+    converted yet since the starting point read 0.
+    '''
+
+    def __init__(self, path):
+        names = [p for p in glob.glob(glob.escape(path) + '.*') if re.fullmatch(r'\d{6}', p[len(path) + 1:])]
+        if not names:
+            raise FileNotFoundError('no segments of recording %s' % path)
+        self.segments = []
+        for name in sorted(names):
+            self.segments.append(_Segment(name))
+        self.header = self.segments[0].header
+        self.num_channels = self.header.num_channels
+        self.channels = list(self.header.channels[:self.num_channels])
+        self.scale = self.header.scale
+        self._unpack_raw = _dll.unpack_raw_select(self.num_channels)
+        max_records = self.header.block_size // (4 + 2 * self.num_channels)
+        self._decoded = array.array('H', [0] * ((2 + self.num_channels) * max_records))
+        self._held = array.array('H', [0] * 8)
+        # (first_sample, segment, block) of every block, for bisect
+        self._blocks = [(index[0], s, b) for s, segment in enumerate(self.segments)
+                        for b, index in enumerate(segment.index)]
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *av):
+        self.close()
+
+    def close(self):
+        for segment in self.segments:
+            segment.close()
+        self.segments = []
+
+    def __iter__(self):
+        return self.messages()
+
+    @property
+    def num_readings(self):
+        '''readings in the recording, dropped ones not counted'''
+        return sum(index[3] for segment in self.segments for index in segment.index)
+
+    def messages(self, first_sample=0):
+        '''Yields Message for every buffer, starting with the one that holds reading first_sample'''
+        start = max(0, bisect.bisect_right(self._blocks, (first_sample, len(self.segments), 0)) - 1)
+        self._held = array.array('H', [0] * 8)
+        for _, s, b in self._blocks[start:]:
+            segment = self.segments[s]
+            _, block_tick, block_time, _, _ = segment.index[b]
+            tick_seconds = segment.header.tick_seconds
+            for entry, payload in segment.block(b):
+                _, num, dropped, _, sample, tick = entry
+                if sample + num <= first_sample and num > 0:
+                    continue
+                timestamps, values = self._unpack(segment.header, payload, num)
+                yield Message(sample, tick, block_time + (tick - block_tick) * tick_seconds, dropped,
+                              timestamps, values)
+
+    def _unpack(self, header, payload, num):
+        timestamps = array.array('I', [0] * num)
+        values = array.array('H', [0] * (num * self.num_channels))
+        if num == 0:
+            return timestamps, values
+        buf = array.array('B', payload)  # kernels need an address
+        addr, _ = buf.buffer_info()
+        decoded, _ = self._decoded.buffer_info()
+        if header.kind == RECORD_KINDS['decoded']:
+            records = addr
+        elif header.flags & RECORD_SPARSE:
+            _dll.unpack_sparse(addr, header.format, self.num_channels, self._held.buffer_info()[0], decoded)
+            records = decoded
+        elif header.format != WIRE_FORMATS['plain']:
+            _dll.unpack_wire(addr, header.format, self.num_channels, decoded)
+            records = decoded
+        else:
+            records = addr + _WIRE_HEADER_SIZE
+        self._unpack_raw(records, num, timestamps.buffer_info()[0], values.buffer_info()[0])
+        return timestamps, values
+
+
+def _info(path):
+    with Recording(path) as rec:
+        h = rec.header
+        print('channels:', rec.channels)
+        print('kind: %s, wire format: %s' % (
+            [k for k, v in RECORD_KINDS.items() if v == h.kind][0],
+            [k for k, v in WIRE_FORMATS.items() if v == h.format][0]))
+        print('clk_div: %d, step_avg: %d, target_delay: %d' % (h.clk_div, h.step_avg, h.target_delay))
+        print('segments: %d (%s ... %s)' % (len(rec.segments), rec.segments[0].path, rec.segments[-1].path))
+        print('readings: %d' % rec.num_readings)
+        dropped = 0
+        last = None
+        for msg in rec:
+            dropped += max(msg.dropped, 0)
+            last = msg
+        if last is not None:
+            print('samples: %d .. %d, dropped: %d' % (h.first_sample, last.first_sample + len(last.timestamps),
+                                                      dropped))
+            print('duration: %.3f s' % (last.first_time - h.first_time))
+
+
+def main(argv=None):
+    '''bbb-adc-record: records a capture to segment files until interrupted (or for --seconds)'''
+    parser = argparse.ArgumentParser(prog='bbb-adc-record', description='Records ADC capture to disk.')
+    parser.add_argument('path', help='recording goes to PATH.000000, PATH.000001, ...')
+    add_capture_arguments(parser)
+    parser.add_argument('--decoded', action='store_true', help='store decoded records instead of raw buffers')
+    parser.add_argument('--segment-mb', type=int, default=64, help='size of a segment file')
+    parser.add_argument('--max-segments', type=int, default=0, help='keep only the latest that many segments')
+    parser.add_argument('--block-kb', type=int, default=1024, help='bytes per disk write')
+    parser.add_argument('--info', action='store_true', help='describe an existing recording and exit')
+    args = parser.parse_args(argv)
+
+    if args.info:
+        _info(args.path)
+        return 0
+
+    with open_capture(args) as cap:
+        cap.start_recording(args.path, kind='decoded' if args.decoded else 'raw',
+                            segment_size=args.segment_mb << 20, max_segments=args.max_segments,
+                            block_size=args.block_kb << 10)
+
+        def report(elapsed):
+            stats = cap.recording_stats()
+            print('%8.1fs %12d readings %10.1f kHz %8d dropped %10.1f MB %4d segments' % (
+                elapsed, stats.readings, stats.readings / elapsed / 1000, stats.dropped, stats.bytes / 1e6,
+                stats.segments), file=sys.stderr)
+            return stats.recording
+
+        run(args.seconds, report)
+        try:
+            cap.stop_recording()
+        except OSError as e:
+            print('bbb-adc-record:', e, file=sys.stderr)
+            return 1
+        stats = cap.recording_stats()
+        print('recorded %d readings in %d buffers, %d dropped, %d bytes' % (
+            stats.readings, stats.messages, stats.dropped, stats.bytes))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,155 @@
+/*
+ * Decimation filter (src/decimate.h) against a reference implementation.
+ *
+ * For every order and a few factors, feeds random readings of 8 channels through
+ * decimate_push() and checks each output against a direct FIR computation (the
+ * CIC impulse response is a boxcar convolved with itself order times), and each
+ * output timestamp against the sum of input deltas. Then reports ns per input
+ * reading, as a rough idea of what the filter adds per ADC reading.
+ *
+ * Usage:
+ *     bench_decimate [-n readings]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "decimate.h"
+
+#define NUM_CHANNELS 8
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* impulse response of CIC filter: boxcar of factor taps convolved order times */
+static int cic_taps(uint32_t factor, uint32_t order, uint64_t *taps) {
+	int length = 1;
+
+	taps[0] = 1;
+	for (uint32_t m = 0; m < order; m++) {
+		int next_length = length + factor - 1;
+		for (int i = next_length - 1; i >= 0; i--) {
+			uint64_t sum = 0;
+			for (uint32_t k = 0; k < factor; k++) {
+				if (i - (int) k >= 0 && i - (int) k < length) sum += taps[i - k];
+			}
+			taps[i] = sum;
+		}
+		length = next_length;
+	}
+	return length;
+}
+
+static int check(uint32_t factor, uint32_t order, uint16_t const *input, uint32_t const *cycles, int num_readings) {
+	static uint64_t taps[DECIMATE_MAX_ORDER * 1024];
+	uint64_t gain = decimate_gain(factor, order);
+	int length = cic_taps(factor, order, taps);
+	decimator_t d;
+	uint32_t elapsed = 0;
+	int outputs = 0;
+
+	decimate_open(&d, factor, order, NUM_CHANNELS);
+	for (int n = 0; n < num_readings; n++) {
+		uint16_t out[NUM_CHANNELS];
+		uint32_t out_cycles;
+
+		elapsed += cycles[n];
+		if (!decimate_push(&d, cycles[n], input + n * NUM_CHANNELS, &out_cycles, out)) {
+			continue;
+		}
+		if ((n + 1) % factor != 0 || (n + 1) / factor < order) {
+			fprintf(stderr, "factor %u order %u: unexpected output after reading %d\n", factor, order, n);
+			return 1;
+		}
+		if (out_cycles != elapsed) {
+			fprintf(stderr, "factor %u order %u: output %d has %u cycles, expected %u\n",
+					factor, order, outputs, out_cycles, elapsed);
+			return 1;
+		}
+		elapsed = 0;
+		for (int j = 0; j < NUM_CHANNELS; j++) {
+			uint64_t sum = 0;
+			for (int i = 0; i < length && i <= n; i++) {
+				sum += taps[i] * input[(n - i) * NUM_CHANNELS + j];
+			}
+			if (out[j] != (sum + gain / 2) / gain) {
+				fprintf(stderr, "factor %u order %u: output %d channel %d is %u, expected %u\n",
+						factor, order, outputs, j, out[j], (unsigned) ((sum + gain / 2) / gain));
+				return 1;
+			}
+		}
+		outputs += 1;
+	}
+	if (outputs != num_readings / factor - (order - 1)) {
+		fprintf(stderr, "factor %u order %u: %d outputs\n", factor, order, outputs);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static uint32_t const factors[] = { 2, 3, 4, 10, 16, 64, 100, 1024 };
+	uint16_t *input;
+	uint32_t *cycles;
+	int num_readings = 200000;
+	volatile uint32_t sink = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n': num_readings = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: bench_decimate [-n readings]\n");
+			return 2;
+		}
+	}
+
+	input = malloc(num_readings * NUM_CHANNELS * sizeof(uint16_t));
+	cycles = malloc(num_readings * sizeof(uint32_t));
+	if (input == NULL || cycles == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	srand(1);
+	for (int i = 0; i < num_readings * NUM_CHANNELS; i++) {
+		input[i] = rand() & 0xfff;
+	}
+	for (int i = 0; i < num_readings; i++) {
+		cycles[i] = 13000 + rand() % 200;
+	}
+
+	printf("%6s %6s %8s %10s\n", "order", "factor", "gain", "ns/input");
+	for (uint32_t order = 1; order <= DECIMATE_MAX_ORDER; order++) {
+		for (int f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+			uint32_t factor = factors[f];
+			uint32_t gain = decimate_gain(factor, order);
+			decimator_t d;
+			double start;
+
+			if (gain == 0) continue;  // out of range for this order
+			if (check(factor, order, input, cycles, num_readings < 20000 ? num_readings : 20000) != 0) {
+				return 1;
+			}
+
+			decimate_open(&d, factor, order, NUM_CHANNELS);
+			start = now();
+			for (int n = 0; n < num_readings; n++) {
+				uint16_t out[NUM_CHANNELS];
+				uint32_t out_cycles;
+				if (decimate_push(&d, cycles[n], input + n * NUM_CHANNELS, &out_cycles, out)) {
+					sink += out[0];
+				}
+			}
+			printf("%6u %6u %8u %10.2f\n", order, factor, gain, (now() - start) * 1e9 / num_readings);
+		}
+	}
+
+	free(input);
+	free(cycles);
+	return 0;
+}
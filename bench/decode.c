@@ -0,0 +1,172 @@
+/*
+ * Micro-benchmark of the unpack kernels (src/unpack.c, src/unpack_neon.c).
+ *
+ * For every channel count, fills a full-size PRU buffer with synthetic records
+ * and reports ns per reading for:
+ *   - reference - the scalar loop driver_read() used before the kernels
+ *   - portable  - portable kernel
+ *   - selected  - kernel picked at runtime (NEON when available)
+ *   - planar    - planar kernel picked at runtime
+ *   - packed    - FORMAT_PACKED buffer (src/wire.h): unpack_wire() followed by
+ *                 the selected kernel, as driver does it
+ *
+ * Usage:
+ *     bench_decode [-n iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "driver.h"
+#include "unpack.h"
+#include "common.h"
+#include "wire.h"
+
+#define SCALE (1.8 / 4095.0)
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* unpack loop of driver_read() before vectorized kernels were introduced */
+static void reference(uint16_t const *src, int num_records, int num_channels,
+		uint32_t *timestamps, float *values) {
+	unsigned short const *p = src;
+	for (int i = 0; i < num_records; i++) {
+		*timestamps = * (unsigned int *) p; p += 2; timestamps += 1;
+		for (int j = 0; j < num_channels; j++) {
+			*values = (*p) * 1.8 / 4095.0; p += 1; values += 1;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	static uint16_t buffer[256] __attribute__((aligned(4)));
+	static uint32_t timestamps[256];
+	static uint32_t check_timestamps[256];
+	static float values[256];
+	static float check_values[256];
+	static uint8_t packed[WIRE_MAX_SIZE] __attribute__((aligned(4)));
+	static uint16_t decoded[WIRE_MAX_RECORDS * 10];
+	static float packed_values[WIRE_MAX_RECORDS * 8];
+	static uint32_t packed_timestamps[WIRE_MAX_RECORDS];
+	volatile float sink = 0;
+	int iterations = 200000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n': iterations = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: bench_decode [-n iterations]\n");
+			return 2;
+		}
+	}
+
+	srand(1);
+	for (int i = 0; i < 256; i++) {
+		buffer[i] = rand() & 0xfff;
+	}
+
+	printf("%8s %8s %14s %14s %14s %14s %8s %14s\n", "channels", "records",
+			"reference ns", "portable ns", "selected ns", "planar ns", "packed", "packed ns");
+	for (int n = 1; n <= 8; n++) {
+		int num_records = driver_num_records(n, 0);
+		int num_readings = num_records;
+		unpack_fn kernels[2] = { unpack_portable[n], unpack_select(n) };
+		unpack_planar_fn planar = unpack_planar_select(n);
+		float *channels[8];
+		int num_packed = wire_capacity(FORMAT_PACKED, n);
+		uint16_t header[2] = { num_packed, 0 };
+		uint32_t base = 13333;
+		double ns[5];
+		double start;
+
+		start = now();
+		for (int k = 0; k < iterations; k++) {
+			reference(buffer, num_records, n, timestamps, values);
+			sink += values[k % num_records];
+		}
+		ns[0] = (now() - start) * 1e9 / iterations / num_readings;
+		memcpy(check_timestamps, timestamps, sizeof(timestamps));
+		memcpy(check_values, values, sizeof(values));
+
+		for (int m = 0; m < 2; m++) {
+			memset(timestamps, '\0', sizeof(timestamps));
+			memset(values, '\0', sizeof(values));
+			start = now();
+			for (int k = 0; k < iterations; k++) {
+				kernels[m](buffer, num_records, timestamps, values, (float) SCALE);
+				sink += values[k % num_records];
+			}
+			ns[m + 1] = (now() - start) * 1e9 / iterations / num_readings;
+
+			if (memcmp(timestamps, check_timestamps, num_records * sizeof(uint32_t)) != 0) {
+				fprintf(stderr, "timestamps mismatch, %d channels\n", n);
+				return 1;
+			}
+			for (int i = 0; i < num_records * n; i++) {
+				if (fabsf(values[i] - check_values[i]) > 1e-6) {
+					fprintf(stderr, "values mismatch, %d channels, index %d\n", n, i);
+					return 1;
+				}
+			}
+		}
+
+		for (int j = 0; j < n; j++) {
+			channels[j] = values + j * num_records;
+		}
+		start = now();
+		for (int k = 0; k < iterations; k++) {
+			planar(buffer, num_records, timestamps, channels, (float) SCALE);
+			sink += values[k % num_records];
+		}
+		ns[3] = (now() - start) * 1e9 / iterations / num_readings;
+		for (int i = 0; i < num_records; i++) {
+			for (int j = 0; j < n; j++) {
+				if (fabsf(channels[j][i] - check_values[i * n + j]) > 1e-6) {
+					fprintf(stderr, "planar values mismatch, %d channels, record %d\n", n, i);
+					return 1;
+				}
+			}
+		}
+
+		memset(packed, '\0', sizeof(packed));
+		memcpy(packed, header, sizeof(header));
+		memcpy(packed + WIRE_HEADER_SIZE, &base, sizeof(base));
+		for (int k = 0; k < num_packed * n; k++) {
+			wire_put12(packed + WIRE_HEADER_SIZE + WIRE_BASE_SIZE, k, buffer[k % 256]);
+		}
+		for (int i = 0; i < num_packed; i++) {
+			packed[wire_size(FORMAT_PACKED, n, num_packed) - num_packed + i] = (uint8_t) (i - 64);
+		}
+		start = now();
+		for (int k = 0; k < iterations; k++) {
+			unpack_wire(packed, FORMAT_PACKED, n, decoded);
+			kernels[1](decoded, num_packed, packed_timestamps, packed_values, (float) SCALE);
+			sink += packed_values[k % num_packed];
+		}
+		ns[4] = (now() - start) * 1e9 / iterations / num_packed;
+		for (int i = 0; i < num_packed; i++) {
+			if (packed_timestamps[i] != base + (int8_t) (i - 64)) {
+				fprintf(stderr, "packed timestamps mismatch, %d channels, record %d\n", n, i);
+				return 1;
+			}
+		}
+		for (int k = 0; k < num_packed * n; k++) {
+			if (fabsf(packed_values[k] - buffer[k % 256] * (float) SCALE) > 1e-6) {
+				fprintf(stderr, "packed values mismatch, %d channels, index %d\n", n, k);
+				return 1;
+			}
+		}
+
+		printf("%8d %8d %14.2f %14.2f %14.2f %14.2f %8d %14.2f\n",
+				n, num_records, ns[0], ns[1], ns[2], ns[3], num_packed, ns[4]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Micro-benchmark of the driver read path, with synthetic buffers instead of PRU.
+ *
+ * Driver is linked in statically, and read()/write()/poll() of the device are
+ * wrapped (see Makefile): the device is /dev/null, writes to it (START, ACK, STOP)
+ * are swallowed, and every read returns the next of a few prebuilt buffer_t
+ * payloads at once, as if PRU were always ahead. What is measured is then the
+ * host-side cost of taking a message: read, checks, sample clock, unpacking.
+ *
+ * For every wire format, channel count 1 to 8, and max_num (0 - full buffers,
+ * 1, 8, 32; settings that do not shrink the buffer are skipped), each read
+ * variant runs until it has taken the given number of readings. Results go to
+ * stdout as CSV, one row per run:
+ *
+ *   variant,format,channels,max_num,records,calls,samples,ns_per_sample,cycles_per_sample,allocs
+ *
+ * records is readings per buffer, cycles_per_sample comes from the CPU cycle
+ * counter (perf_event_open, empty if not permitted), and allocs counts
+ * malloc/calloc/realloc/posix_memalign calls made while timing, which should be 0.
+ * Before timing, one buffer is read back and checked against what was sent.
+ *
+ * Variants:
+ *   read           - driver_read
+ *   read_raw       - driver_read_raw
+ *   channels       - driver_read_channels
+ *   channels_raw   - driver_read_channels_raw
+ *   many           - driver_read_many, 16 messages per call
+ *   block          - driver_read_block, 4096 readings per call
+ *   block_raw      - driver_read_block_raw, 4096 readings per call
+ *   try_read       - driver_try_read
+ *   read_cal       - driver_read, every channel calibrated (driver_set_calibration_linear)
+ *   channels_cal   - driver_read_channels, same
+ *
+ * Usage:
+ *     bench_read [-n samples] [-f plain|packed|fixed]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "driver.h"
+#include "common.h"
+#include "wire.h"
+
+#define DEVICE "/dev/null"
+#define NUM_PAYLOADS 16
+#define BATCH 16
+#define BLOCK 4096
+
+/* fake device: fd driver_open got for DEVICE, learned from its START command */
+static int device_fd = -1;
+static uint8_t payloads[NUM_PAYLOADS][WIRE_MAX_SIZE] __attribute__((aligned(4)));
+static uint16_t payload_size;
+static unsigned int next_payload;
+static unsigned long num_allocs;
+
+extern ssize_t __real_read(int fd, void *buf, size_t count);
+extern ssize_t __real_write(int fd, void const *buf, size_t count);
+extern int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t num, size_t size);
+extern void *__real_realloc(void *p, size_t size);
+extern int __real_posix_memalign(void **p, size_t alignment, size_t size);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+	uint8_t const *payload;
+
+	if (fd != device_fd) {
+		return __real_read(fd, buf, count);
+	}
+	payload = payloads[next_payload++ % NUM_PAYLOADS];
+	if (count > payload_size) count = payload_size;
+	memcpy(buf, payload, count);
+	return count;
+}
+
+ssize_t __wrap_write(int fd, void const *buf, size_t count) {
+	command_t command;
+
+	if (count >= sizeof(command)) {
+		memcpy(&command, buf, sizeof(command));
+		if (command.magic == COMMAND_MAGIC && command.command == COMMAND_START) {
+			device_fd = fd;
+		}
+	}
+	if (fd != device_fd) {
+		return __real_write(fd, buf, count);
+	}
+	return count;
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	for (nfds_t i = 0; i < nfds; i++) {
+		if (fds[i].fd == device_fd) {
+			fds[i].revents = fds[i].events & POLLIN;
+			return 1;
+		}
+	}
+	return __real_poll(fds, nfds, timeout);
+}
+
+void *__wrap_malloc(size_t size) {
+	num_allocs += 1;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+	num_allocs += 1;
+	return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+	num_allocs += 1;
+	return __real_realloc(p, size);
+}
+
+int __wrap_posix_memalign(void **p, size_t alignment, size_t size) {
+	num_allocs += 1;
+	return __real_posix_memalign(p, alignment, size);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* user-space CPU cycles of this thread, -1 if the kernel does not let us count them */
+static int open_cycle_counter(void) {
+	struct perf_event_attr attr;
+
+	memset(&attr, '\0', sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_cycles(int fd) {
+	long long value;
+
+	if (fd < 0 || __real_read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+	return value;
+}
+
+/* timestamps and raw values of the readings in payloads, as driver should return them */
+static uint32_t sent_timestamps[NUM_PAYLOADS][WIRE_MAX_RECORDS];
+static uint16_t sent_values[NUM_PAYLOADS][WIRE_MAX_RECORDS * 8];
+
+/*
+ * Fills payloads with num records each: timestamps around a 15kHz period, within
+ * what FORMAT_PACKED deltas (and ts_jitter of FORMAT_PACKED_FIXED) can carry
+ */
+static void make_payloads(unsigned int format, int num_channels, int num) {
+	for (int m = 0; m < NUM_PAYLOADS; m++) {
+		uint8_t *b = payloads[m];
+		uint16_t header[2] = { num, 0 };
+		uint32_t base = 13333 + rand() % 61 - 30;
+
+		memset(b, '\0', WIRE_MAX_SIZE);
+		memcpy(b, header, sizeof(header));
+		for (int i = 0; i < num; i++) {
+			sent_timestamps[m][i] = i == 0 ? base : base + rand() % 121 - 60;
+			for (int j = 0; j < num_channels; j++) {
+				sent_values[m][i * num_channels + j] = rand() & 0xfff;
+			}
+		}
+		if (format == FORMAT_PLAIN) {
+			uint8_t *p = b + WIRE_HEADER_SIZE;
+			for (int i = 0; i < num; i++) {
+				memcpy(p, &sent_timestamps[m][i], sizeof(uint32_t)); p += sizeof(uint32_t);
+				memcpy(p, &sent_values[m][i * num_channels], num_channels * sizeof(uint16_t));
+				p += num_channels * sizeof(uint16_t);
+			}
+		} else {
+			uint8_t *packed = b + WIRE_HEADER_SIZE + WIRE_BASE_SIZE;
+			memcpy(b + WIRE_HEADER_SIZE, &base, sizeof(base));
+			for (int k = 0; k < num * num_channels; k++) {
+				wire_put12(packed, k, sent_values[m][k]);
+			}
+			for (int i = 0; i < num; i++) {
+				if (format == FORMAT_PACKED) {
+					b[wire_size(format, num_channels, num) - num + i] = (uint8_t) (sent_timestamps[m][i] - base);
+				} else {
+					sent_timestamps[m][i] = base;  // fixed: every record is reported at base
+				}
+			}
+		}
+	}
+	payload_size = wire_size(format, num_channels, num);
+}
+
+static driver_t *open_driver(unsigned int format, int num_channels, int max_num) {
+	driver_config_t config = { .device = DEVICE, .num_channels = num_channels, .max_num = max_num,
+			.format = format, .ts_jitter = 60 };
+
+	for (int j = 0; j < 8; j++) {
+		config.channels[j] = j;
+	}
+	next_payload = 0;
+	return driver_open(&config);
+}
+
+/* reads the first payload back, 0 if driver returned what was sent */
+static int check(driver_t *drv, int num_channels, int num) {
+	int dropped;
+	static unsigned int timestamps[WIRE_MAX_RECORDS];
+	static unsigned short values[WIRE_MAX_RECORDS * 8];
+
+	if (driver_read_raw(drv, &dropped, timestamps, values) != num) return -1;
+	if (memcmp(timestamps, sent_timestamps[0], num * sizeof(uint32_t)) != 0) return -1;
+	if (memcmp(values, sent_values[0], num * num_channels * sizeof(uint16_t)) != 0) return -1;
+	return 0;
+}
+
+enum {
+	READ, READ_RAW, CHANNELS, CHANNELS_RAW, MANY, BLOCK_FLOAT, BLOCK_RAW, TRY_READ, READ_CAL, CHANNELS_CAL,
+	NUM_VARIANTS
+};
+
+static char const *variant_names[NUM_VARIANTS] = {
+	"read", "read_raw", "channels", "channels_raw", "many", "block", "block_raw", "try_read",
+	"read_cal", "channels_cal",
+};
+
+static unsigned int timestamps[BATCH * WIRE_MAX_RECORDS > BLOCK ? BATCH * WIRE_MAX_RECORDS : BLOCK];
+static float values[BATCH * WIRE_MAX_RECORDS * 8];
+static unsigned short raw_values[BATCH * WIRE_MAX_RECORDS * 8];
+
+/* one call of the variant, returns readings taken */
+static int call(driver_t *drv, int variant, int num_channels, int num) {
+	static int dropped[BATCH];
+	static int counts[BATCH];
+	driver_gap_t gaps[8];
+	driver_block_t block;
+	float *channels[8];
+	unsigned short *raw_channels[8];
+	int result, total;
+
+	switch (variant) {
+	case READ:
+	case READ_CAL:
+		return driver_read(drv, dropped, timestamps, values);
+	case READ_RAW:
+		return driver_read_raw(drv, dropped, timestamps, raw_values);
+	case CHANNELS:
+	case CHANNELS_CAL:
+		for (int j = 0; j < num_channels; j++) channels[j] = values + j * num;
+		return driver_read_channels(drv, dropped, timestamps, channels);
+	case CHANNELS_RAW:
+		for (int j = 0; j < num_channels; j++) raw_channels[j] = raw_values + j * num;
+		return driver_read_channels_raw(drv, dropped, timestamps, raw_channels);
+	case MANY:
+		result = driver_read_many(drv, BATCH, dropped, counts, timestamps, values);
+		if (result < 0) return result;
+		total = 0;
+		for (int i = 0; i < result; i++) total += counts[i];
+		return total;
+	case BLOCK_FLOAT:
+		return driver_read_block(drv, BLOCK, -1, timestamps, values, gaps, 8, &block);
+	case BLOCK_RAW:
+		return driver_read_block_raw(drv, BLOCK, -1, timestamps, raw_values, gaps, 8, &block);
+	case TRY_READ:
+		return driver_try_read(drv, dropped, timestamps, values);
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	static char const *format_names[3] = { "plain", "packed", "fixed" };
+	static unsigned int const max_nums[] = { 0, 1, 8, 32 };
+	long samples = 1000000;
+	int only_format = -1;
+	int cycle_fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+		switch (opt) {
+		case 'n': samples = atol(optarg); break;
+		case 'f':
+			for (int f = 0; f < 3; f++) {
+				if (strcmp(optarg, format_names[f]) == 0) only_format = f;
+			}
+			if (only_format < 0) goto usage;
+			break;
+		default:
+		usage:
+			fprintf(stderr, "usage: bench_read [-n samples] [-f plain|packed|fixed]\n");
+			return 2;
+		}
+	}
+
+	cycle_fd = open_cycle_counter();
+	if (cycle_fd < 0) {
+		fprintf(stderr, "bench_read: no access to CPU cycle counter, cycles_per_sample left empty\n");
+	}
+
+	srand(1);
+	printf("variant,format,channels,max_num,records,calls,samples,ns_per_sample,cycles_per_sample,allocs\n");
+	for (unsigned int format = 0; format < 3; format++) {
+		if (only_format >= 0 && format != only_format) continue;
+		for (int n = 1; n <= 8; n++) {
+			for (int k = 0; k < sizeof(max_nums) / sizeof(max_nums[0]); k++) {
+				int num = driver_max_records(format, n, max_nums[k]);
+
+				if (max_nums[k] > 0 && num == wire_capacity(format, n)) continue;  // same as full buffers
+				make_payloads(format, n, num);
+				for (int variant = 0; variant < NUM_VARIANTS; variant++) {
+					driver_t *drv = open_driver(format, n, max_nums[k]);
+					long taken = 0, calls = 0;
+					long long cycles_start, cycles_end;
+					unsigned long allocs;
+					double start, elapsed;
+
+					if (drv == NULL) {
+						perror("driver_open");
+						return 1;
+					}
+					if (check(drv, n, num) != 0) {
+						fprintf(stderr, "bench_read: %s format, %d channels, max_num %u: readings differ from what was sent\n",
+								format_names[format], n, max_nums[k]);
+						return 1;
+					}
+					for (int j = 0; j < n && (variant == READ_CAL || variant == CHANNELS_CAL); j++) {
+						driver_set_calibration_linear(drv, j, 1.0 + j * 0.01, -0.001 * j);
+					}
+					for (int i = 0; i < 100; i++) {
+						call(drv, variant, n, num);  // warm up
+					}
+
+					allocs = num_allocs;
+					if (cycle_fd >= 0) {
+						ioctl(cycle_fd, PERF_EVENT_IOC_RESET, 0);
+						ioctl(cycle_fd, PERF_EVENT_IOC_ENABLE, 0);
+					}
+					cycles_start = read_cycles(cycle_fd);
+					start = now();
+					while (taken < samples) {
+						int result = call(drv, variant, n, num);
+						if (result < 0) {
+							fprintf(stderr, "bench_read: %s failed: %s\n", variant_names[variant], strerror(-result));
+							return 1;
+						}
+						taken += result;
+						calls += 1;
+					}
+					elapsed = now() - start;
+					cycles_end = read_cycles(cycle_fd);
+					if (cycle_fd >= 0) {
+						ioctl(cycle_fd, PERF_EVENT_IOC_DISABLE, 0);
+					}
+					allocs = num_allocs - allocs;
+					driver_close(drv);
+
+					printf("%s,%s,%d,%u,%d,%ld,%ld,%.3f,", variant_names[variant], format_names[format],
+							n, max_nums[k], num, calls, taken, elapsed * 1e9 / taken);
+					if (cycles_start >= 0 && cycles_end >= 0) {
+						printf("%.2f", (double) (cycles_end - cycles_start) / taken);
+					}
+					printf(",%lu\n", allocs);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * End-to-end throughput benchmark: driver against PRU emulator.
+ *
+ * Starts src/emulator.c as a child process, then captures from it with 1 to 8
+ * channels for a few seconds each and reports:
+ *   - readings per second received by the driver
+ *   - syscalls (read, write, and poll) made by the driver per reading
+ *   - drop rate, i.e. dropped / (received + dropped)
+ *
+ * Driver is linked in statically and read()/write()/poll() are wrapped (see Makefile)
+ * to count syscalls.
+ *
+ * Usage:
+ *     bench_throughput [-e emulator] [-r rate] [-t seconds] [-b batch] [-T capacity] [-p ms] [-f format] [-s]
+ *
+ * With -b, driver_read_many() is used to read up to that many messages per call.
+ * With -T, background reader thread is started with a ring of that many messages.
+ * With -p, consumer stalls for that many milliseconds every 100ms (think GC pause).
+ * With -f, PRU is asked for a wire format: plain (default), packed, or fixed.
+ * With -s, data comes through shared memory (DRIVER_TRANSPORT_SHM), emulator maps a
+ * file next to its socket. Driver then sleeps (not counted as a syscall) while waiting.
+ *
+ * Use rate 0 to make emulator produce readings as fast as it can: the number of
+ * readings per second received is then the host-side ceiling.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "driver.h"
+
+static unsigned long num_syscalls = 0;
+
+extern ssize_t __real_read(int fd, void *buf, size_t count);
+extern ssize_t __real_write(int fd, void const *buf, size_t count);
+extern int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+	num_syscalls += 1;
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, void const *buf, size_t count) {
+	num_syscalls += 1;
+	return __real_write(fd, buf, count);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	num_syscalls += 1;
+	return __real_poll(fds, nfds, timeout);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static pid_t spawn_emulator(char const *emulator, char const *rate, char const *path, char const *shm_path) {
+	struct stat st;
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		if (shm_path != NULL) {
+			execl(emulator, emulator, "-r", rate, "-m", shm_path, path, (char *) NULL);
+		} else {
+			execl(emulator, emulator, "-r", rate, path, (char *) NULL);
+		}
+		perror(emulator);
+		_exit(1);
+	}
+
+	for (int i = 0; i < 100; i++) {
+		if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			return pid;
+		}
+		usleep(10000);
+	}
+	kill(pid, SIGTERM);
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	char const *emulator = "gen/pru_emulator";
+	char const *rate = "0";
+	double duration = 2.0;
+	unsigned char channels[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	int batch = 0;
+	int capacity = 0;
+	int pause_ms = 0;
+	char const *format_name = "plain";
+	unsigned int format = DRIVER_FORMAT_PLAIN;
+	int dropped[64];
+	int counts[64];
+	static unsigned int timestamps[64 * 336];
+	static float values[64 * 336];
+	char path[64];
+	char shm_path[64];
+	int shm = 0;
+	int opt;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "e:r:t:b:T:p:f:s")) != -1) {
+		switch (opt) {
+		case 'e': emulator = optarg; break;
+		case 'r': rate = optarg; break;
+		case 't': duration = atof(optarg); break;
+		case 'b': batch = atoi(optarg); break;
+		case 'T': capacity = atoi(optarg); break;
+		case 'p': pause_ms = atoi(optarg); break;
+		case 'f':
+			format_name = optarg;
+			if (strcmp(optarg, "plain") == 0) format = DRIVER_FORMAT_PLAIN;
+			else if (strcmp(optarg, "packed") == 0) format = DRIVER_FORMAT_PACKED;
+			else if (strcmp(optarg, "fixed") == 0) format = DRIVER_FORMAT_PACKED_FIXED;
+			else goto usage;
+			break;
+		case 's': shm = 1; break;
+		default:
+		usage:
+			fprintf(stderr, "usage: bench_throughput [-e emulator] [-r rate] [-t seconds] [-b batch] [-T capacity] [-p ms] [-f format] [-s]\n");
+			return 2;
+		}
+	}
+
+	if (batch > 64) {
+		batch = 64;
+	}
+
+	snprintf(path, sizeof(path), "/tmp/pru_emulator.%d", (int) getpid());
+	snprintf(shm_path, sizeof(shm_path), "/tmp/pru_emulator.%d.shm", (int) getpid());
+	pid = spawn_emulator(emulator, rate, path, shm ? shm_path : NULL);
+	if (pid < 0) {
+		fprintf(stderr, "emulator did not start\n");
+		return 1;
+	}
+
+	printf("rate=%s duration=%.1fs %s reader=%d pause=%dms format=%s transport=%s\n", rate, duration,
+			batch > 0 ? "driver_read_many" : "driver_read", capacity, pause_ms, format_name,
+			shm ? "shm" : "rpmsg");
+	printf("%8s %14s %16s %10s %10s\n", "channels", "readings/s", "syscalls/reading", "drop rate", "high water");
+	for (int num_channels = 1; num_channels <= 8; num_channels++) {
+		driver_config_t config = { .device = path, .num_channels = num_channels, .format = format,
+				.transport = shm ? DRIVER_TRANSPORT_SHM : DRIVER_TRANSPORT_RPMSG, .shm_path = shm_path };
+		unsigned long received = 0;
+		unsigned long total_dropped = 0;
+		double start, elapsed, next_pause;
+		driver_reader_stats_t stats = { 0 };
+		driver_t *drv;
+
+		memcpy(config.channels, channels, sizeof(config.channels));
+		drv = driver_open(&config);
+		if (drv == NULL) {
+			perror("driver_open");
+			kill(pid, SIGTERM);
+			return 1;
+		}
+		if (capacity > 0 && driver_start_reader(drv, capacity, 0) != 0) {
+			driver_close(drv);
+			kill(pid, SIGTERM);
+			return 1;
+		}
+
+		num_syscalls = 0;
+		start = now();
+		next_pause = start + 0.1;
+		while ((elapsed = now() - start) < duration) {
+			if (pause_ms > 0 && now() > next_pause) {
+				usleep(pause_ms * 1000);
+				next_pause += 0.1;
+			}
+			int num_messages = 1;
+			if (batch > 0) {
+				num_messages = driver_read_many(drv, batch, dropped, counts, timestamps, values);
+				if (num_messages < 0) {
+					break;
+				}
+			} else if ((counts[0] = driver_read(drv, dropped, timestamps, values)) < 0) {
+				break;
+			}
+			for (int i = 0; i < num_messages; i++) {
+				received += counts[i];
+				total_dropped += dropped[i];
+			}
+		}
+		driver_reader_stats(drv, &stats);
+		driver_close(drv);
+
+		printf("%8d %14.0f %16.4f %10.4f %10u\n",
+				num_channels,
+				received / elapsed,
+				received > 0 ? (double) num_syscalls / received : 0.0,
+				received + total_dropped > 0 ? (double) total_dropped / (received + total_dropped) : 0.0,
+				stats.high_water);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	if (shm) {
+		unlink(shm_path);
+	}
+	return 0;
+}
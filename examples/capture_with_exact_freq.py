@@ -3,31 +3,35 @@ capture_with_exact_frequency.py
 
 Demonstrates how to capture AIN1 with exact frequency of 3KHz
 
-Here we use `speed` and `target_delay` to get exactly 3kHz capture frequency.
+Here we use `sample_rate` to get exactly 3kHz capture frequency. PRU triggers
+every reading on a fixed schedule of its timer, deadline after deadline
+200000000 / 3000 cycles apart, so nothing needs tuning: the time a reading takes
+does not add to the period, as it does with `target_delay`.
 
-`target_delay` is computed by dividing PRU clock 200MHz by target frequency of 3kHz:
-
-    200000000 / 3000 = 66667
-
-Then, adjusting a bit to the lower side to get the target frequency.
+Timestamps are PRU cycles between triggers, they add up to the time elapsed.
 
 You should expect to get the following result:
 
-    Measured frequency:  3000.031593701992
+    Measured frequency:  3000.0...
+    Trigger jitter: ... cycles mean, ... max, 0 deadlines missed
 '''
 import itertools
-import time
 from bbb_pru_adc import capture
 
 
-with capture.capture([1], clk_div=1, target_delay=66642, auto_install=True) as c:    
+with capture.capture([1], clk_div=1, sample_rate=3000, auto_install=True) as c:
     num_values = 0
-    start = time.time()
-    for num_dropped, _, values in itertools.islice(c, 0, 100):
-        print(num_dropped, _[0])
+    cycles = 0
+    for num_dropped, timestamps, values in itertools.islice(c, 0, 100):
         num_values += num_dropped + len(values)
-    end = time.time()
+        cycles += sum(timestamps)
+    c.request_status()
+    for _ in itertools.islice(c, 0, 1):
+        pass  # status comes among data buffers
+    status = c.status()
 
-freq = num_values / (end - start)
+freq = num_values / (cycles / 200e6)
 print('Measured frequency: ', freq)
-
+if status is not None:
+    print('Trigger jitter: %.0f cycles mean, %d max, %d deadlines missed' % (
+        status.jitter.mean, status.jitter.max, status.missed))
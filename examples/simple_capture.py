@@ -3,6 +3,8 @@ simple_capture.py
 
 Demonstrates code to capture 100_000 values from ADC channels 3 and 5 at the
 highest possible capture speed.
+
+Uses layout='planar', so that driver hands us one array per channel.
 '''
 import array
 import math
@@ -15,22 +17,19 @@ AIN7_buffer = array.array('f', [0] * size)
 
 print('Capturing %s samples will take approximately %s seconds' % (size, size / 7000))
 
-with capture.capture(channels=[3, 5], auto_install=True) as c:
+with capture.capture(channels=[3, 5], auto_install=True, layout='planar') as c:
     offset = 0
-    for num_dropped, _, values in c:
-        for _ in range(num_dropped):
-            AIN3_buffer[offset] = float('NaN')
-            AIN7_buffer[offset] = float('NaN')
-            offset += 1
-            if offset >= size:
-                break
-        for i in range(0, len(values), 2):
-            AIN3_buffer[offset] = values[i]
-            AIN3_buffer[offset] = values[i]
-            offset += 1
-            if offset >= size:
-                break
-            
+    for num_dropped, _, (ain3, ain7) in c:
+        num_dropped = min(num_dropped, size - offset)
+        AIN3_buffer[offset:offset + num_dropped] = array.array('f', [float('NaN')] * num_dropped)
+        AIN7_buffer[offset:offset + num_dropped] = array.array('f', [float('NaN')] * num_dropped)
+        offset += num_dropped
+
+        count = min(len(ain3), size - offset)
+        AIN3_buffer[offset:offset + count] = ain3[:count]
+        AIN7_buffer[offset:offset + count] = ain7[:count]
+        offset += count
+
         if offset >= size:
             break
 
@@ -30,6 +30,12 @@ setup(
     packages=['bbb_pru_adc'],
     python_requires='>=3.5, <4',
     package_data={'bbb_pru_adc': ['resources/*']},
+    entry_points={
+        'console_scripts': [
+            'bbb-adc-record=bbb_pru_adc.record:main',
+            'bbb-adc-fanout=bbb_pru_adc.fanout:main',
+        ],
+    },
     data_files=[
         ('src', glob.glob('src/*')),
     ],
@@ -11,8 +11,18 @@ typedef struct {
 #define COMMAND_STOP (2)
 #define COMMAND_ACK (3)
 #define COMMAND_START (1)
+#define COMMAND_ACK_N (4)
+#define COMMAND_STATUS (5)  // asks for firmware telemetry, see src/telemetry.h
 } command_t;
 
+/*
+ * Acknowledges receipt of several data buffers at once
+ */
+typedef struct {
+    command_t header;
+    uint32_t  count;          // number of buffers to release
+} command_ack_n_t;
+
 /*
  * CPU sends which channels to capture, by specifying:
  * 1. num_channels - how many channels to capture
@@ -29,11 +39,46 @@ typedef struct {
     uint8_t   channels[8];
     uint32_t  step_avg;       // 0 - no averaging, 4 - average over 16 samples
     uint32_t  max_num;        // if non-zero, limits the number of captures per buffer
-    uint32_t  target_delay;   // target dealy between captures
+    uint32_t  target_delay;   // target dealy between captures, ignored with sample_rate
+    uint32_t  format;         // layout of data buffers, see src/wire.h
+#define FORMAT_PLAIN (0)
+#define FORMAT_PACKED (1)
+#define FORMAT_PACKED_FIXED (2)
+    uint32_t  ts_jitter;      // FORMAT_PACKED_FIXED: max deviation of timestamp from the base
+    uint32_t  adc_mode;       // how ADC sequencer runs, target_delay is ignored in continuous mode
+#define ADC_MODE_ONESHOT (0)
+#define ADC_MODE_CONTINUOUS (1)
+    uint32_t  ring_depth;     // number of PRU ring buffers, 0 - RING_DEFAULT_DEPTH
+#define RING_DEFAULT_DEPTH (8)
+#define RING_MAX_DEPTH (24)
+    uint32_t  transport;      // how data buffers reach the CPU, see src/shm.h
+#define TRANSPORT_RPMSG (0)
+#define TRANSPORT_SHM (1)
+    uint32_t  shm_id;         // TRANSPORT_SHM: PRU stores it in the header once ring is ready
+    uint32_t  decimate_factor; // ADC readings per buffered record, 0 or 1 - no decimation
+    uint32_t  decimate_order;  // 1 - boxcar, 2..3 - CIC, see src/decimate.h
+    uint32_t  trigger_mode;   // send only windows around trigger events, see src/trigger.h
+#define TRIGGER_NONE (0)
+#define TRIGGER_LEVEL (1)
+#define TRIGGER_EDGE (2)
+    uint16_t  trigger_channels;     // bit i - channels[i] is watched
+    uint16_t  trigger_rising;       // bit i - channels[i] fires rising, falling otherwise
+    uint16_t  trigger_threshold[8]; // ADC counts, per channel in channels order
+    uint32_t  pre_trigger;    // readings sent before the one that fired
+    uint32_t  post_trigger;   // readings sent after it
+    uint8_t   channel_avg[8];     // per channel in channels order, averaging is the larger of this and step_avg
+    uint16_t  channel_divisor[8]; // channels[i] is converted on every divisor-th reading, 0 or 1 - on every one, see src/schedule.h
+    uint32_t  sample_rate;    // one-shot mode: readings per second on a timer schedule, 0 - target_delay paces them, see src/pacer.h
+    uint32_t  summary_window; // readings per summary record, 0 - send readings, see src/summary.h
 } command_start_t;
 
 /*
  * structure of reply buffer
+ *
+ * num holds two values: number of records (low 10 bits, use BUFFER_NUM), and the
+ * number of PRU ring buffers in use when this one was sent, itself included
+ * (high 6 bits, use BUFFER_RING_USED). The latter tells how close PRU is to
+ * dropping data.
  */
 typedef struct {
 	uint16_t num;
@@ -41,4 +86,7 @@ typedef struct {
 	uint16_t data[1];
 } buffer_t;
 
+#define BUFFER_NUM(num) ((num) & 0x3ff)
+#define BUFFER_RING_USED(num) ((num) >> 10)
+
 #endif
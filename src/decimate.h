@@ -0,0 +1,118 @@
+#ifndef __DECIMATE_H
+#define __DECIMATE_H
+
+/*
+ * Decimation filter between ADC and buffers. Shared by firmware and emulator,
+ * checked against a reference implementation by bench/decimate.c.
+ *
+ * CIC filter of the given order: order integrators running at the input rate,
+ * then order combs running at the output rate (one output per factor inputs).
+ * Order 1 is a boxcar: output is the mean of the last factor inputs. Higher
+ * orders cut aliasing better, at the cost of a longer response (order * factor
+ * inputs). Outputs are divided by the gain (factor^order) with rounding, so
+ * they stay 12-bit ADC counts. The first order - 1 outputs, which see the filter
+ * still filling up, are skipped.
+ *
+ * Arithmetic is modulo 2^32, which CIC tolerates as long as the output itself
+ * fits: gain must not exceed DECIMATE_MAX_GAIN.
+ *
+ * Timestamp of an output is the sum of the deltas of its inputs, i.e. PRU cycles
+ * since the previous output.
+ */
+#define DECIMATE_MAX_ORDER 3
+#define DECIMATE_MAX_GAIN (1ul << 20)
+
+typedef struct {
+	uint16_t factor;       // inputs per output, 1 - no decimation
+	uint16_t order;        // 1 - boxcar, 2..DECIMATE_MAX_ORDER - CIC
+	uint16_t num_channels;
+	uint16_t count;        // inputs since the last output
+	uint16_t warmup;       // outputs still to be skipped
+	int16_t shift;         // log2(gain) if gain is a power of two, -1 otherwise
+	uint32_t gain;
+	uint32_t cycles;       // PRU cycles since the last output
+	uint32_t integrator[DECIMATE_MAX_ORDER][8];
+	uint32_t comb[DECIMATE_MAX_ORDER][8];  // previous input of each comb stage
+} decimator_t;
+
+/* gain of the filter, 0 if factor and order are out of range */
+static inline uint32_t decimate_gain(uint32_t factor, uint32_t order) {
+	uint32_t gain = 1;
+
+	if (factor == 0 || order == 0 || order > DECIMATE_MAX_ORDER) return 0;
+	while (order-- > 0) {
+		if (gain > DECIMATE_MAX_GAIN / factor) return 0;
+		gain *= factor;
+	}
+	return gain;
+}
+
+/* factor 0 means 1, order 0 means 1. Falls back to no decimation if gain is out of range */
+static inline void decimate_open(decimator_t *d, uint32_t factor, uint32_t order, uint16_t num_channels) {
+	int i, j;
+
+	if (factor == 0) factor = 1;
+	if (order == 0) order = 1;
+	d->gain = decimate_gain(factor, order);
+	if (d->gain == 0) {
+		factor = 1;
+		order = 1;
+		d->gain = 1;
+	}
+	d->factor = factor;
+	d->order = order;
+	d->num_channels = num_channels;
+	d->count = 0;
+	d->warmup = order - 1;
+	d->cycles = 0;
+	d->shift = -1;
+	for (i = 0; i < 32; i++) {
+		if (d->gain == (1ul << i)) d->shift = i;
+	}
+	for (i = 0; i < DECIMATE_MAX_ORDER; i++) {
+		for (j = 0; j < 8; j++) {
+			d->integrator[i][j] = 0;
+			d->comb[i][j] = 0;
+		}
+	}
+}
+
+/*
+ * Feeds one reading (cycles since the previous one, num_channels values). Returns 1
+ * and fills out_cycles and out when an output is ready, 0 otherwise.
+ */
+static inline int decimate_push(decimator_t *d, uint32_t cycles, uint16_t const *values,
+		uint32_t *out_cycles, uint16_t *out) {
+	int i, j;
+
+	d->cycles += cycles;
+	for (j = 0; j < d->num_channels; j++) {
+		uint32_t x = values[j];
+		for (i = 0; i < d->order; i++) {
+			d->integrator[i][j] += x;
+			x = d->integrator[i][j];
+		}
+	}
+	if (++d->count < d->factor) return 0;
+	d->count = 0;
+
+	for (j = 0; j < d->num_channels; j++) {
+		uint32_t y = d->integrator[d->order - 1][j];
+		for (i = 0; i < d->order; i++) {
+			uint32_t previous = d->comb[i][j];
+			d->comb[i][j] = y;
+			y -= previous;
+		}
+		y += d->gain >> 1;
+		out[j] = d->shift >= 0 ? y >> d->shift : y / d->gain;
+	}
+	if (d->warmup > 0) {
+		d->warmup -= 1;
+		return 0;  // keeps counting cycles, so that the first output is timed from start
+	}
+	*out_cycles = d->cycles;
+	d->cycles = 0;
+	return 1;
+}
+
+#endif
@@ -37,15 +37,33 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <poll.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <signal.h>
 #include "common.h"
+#include "wire.h"
+#include "shm.h"
+#include "decimate.h"
+#include "trigger.h"
+#include "unpack.h"
+#include "record.h"
+#include "telemetry.h"
+#include "pacer.h"
+#include "fanout.h"
+#include "summary.h"
 
 
 #define RPMSG_BUF_HEADER_SIZE           16
@@ -55,120 +73,2687 @@
 
 #define MAX_BUFFER_SIZE			512
 
-int driver_num_records(unsigned int num_channels, unsigned int max_num) {
-        int num_records = (512 - 16 - 4) / (4 + 2 * num_channels);
+/* volts per ADC count: 12-bit ADC with 1.8V reference */
+#define ADC_SCALE (1.8 / 4095.0)
+
+/* PRU runs at 200MHz, timestamps count its cycles */
+#define PRU_TICK_SECONDS (1.0 / 200000000.0)
+
+/* number of messages the PRU-to-host clock fit effectively averages over */
+#define CLOCK_FIT_WINDOW 4096
+
+/* TRANSPORT_SHM: how often to check for new messages when waiting, and for how long PRU may set up the ring */
+#define SHM_POLL_NS 200000
+#define SHM_READY_TIMEOUT_NS 1000000000
+
+/* driver_read_many: a blocking read() that took longer than this waited for PRU */
+#define BLOCKED_READ_SECONDS 50e-6
+
+/* recorder defaults, see driver_record_config_t */
+#define RECORD_DEFAULT_SEGMENT_SIZE (64ull << 20)
+#define RECORD_DEFAULT_BLOCK_SIZE (1u << 20)
+#define RECORD_DEFAULT_READER_CAPACITY 4096
+#define RECORD_ALIGN 4096
+
+/* publisher defaults and limits, see driver_publish_config_t */
+#define FANOUT_DEFAULT_CAPACITY (1u << 18)
+#define FANOUT_MIN_CAPACITY 4096
+#define FANOUT_MAX_CAPACITY (1u << 26)
+#define FANOUT_DEFAULT_READER_CAPACITY 4096
+
+int driver_max_records(unsigned int format, unsigned int num_channels, unsigned int max_num) {
+        int num_records = wire_capacity(format, num_channels);
         if (max_num > 0 && num_records > max_num) {
                 num_records = max_num;
         }
         return num_records;
 }
 
+int driver_num_records(unsigned int num_channels, unsigned int max_num) {
+        return driver_max_records(FORMAT_PLAIN, num_channels, max_num);
+}
+
+/* channel_divisor leaves some channels out of some readings, making buffers sparse (see src/wire.h) */
+static bool config_sparse(driver_config_t const *config) {
+	for (int i = 0; i < config->num_channels && i < 8; i++) {
+		if (config->channel_divisor[i] > 1) return true;
+	}
+	return false;
+}
+
+/* number of channels converted on every reading */
+static int config_min_values(driver_config_t const *config) {
+	int count = 0;
+	for (int i = 0; i < config->num_channels && i < 8; i++) {
+		if (config->channel_divisor[i] <= 1) count += 1;
+	}
+	return count;
+}
+
+int driver_config_max_records(driver_config_t const *config) {
+	int num_records;
+
+	if (config->num_channels < 1 || config->num_channels > 8) return -EINVAL;
+	if (config->summary_window > 0) {
+		num_records = summary_capacity(config->num_channels);
+		return config->max_num > 0 && num_records > config->max_num ? config->max_num : num_records;
+	}
+	if (!config_sparse(config)) {
+		return driver_max_records(config->format, config->num_channels, config->max_num);
+	}
+	num_records = wire_sparse_capacity(config->format, config_min_values(config));
+	if (config->max_num > 0 && num_records > config->max_num) {
+		num_records = config->max_num;
+	}
+	return num_records;
+}
+
+int driver_max_pre_trigger(unsigned int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return -EINVAL;
+	return trigger_max_pre(num_channels);
+}
+
+
+/*
+ * Opens the transport. Normally this is the rpmsg character device, but if the
+ * path points to a unix socket we connect to it instead. This is how PRU emulator
+ * (see src/emulator.c) is plugged in. SOCK_SEQPACKET preserves message boundaries,
+ * so the rest of the driver can not tell the difference.
+ */
+static int open_device(char const *device) {
+	struct stat st;
+	struct sockaddr_un addr;
+	int fd;
+
+	if (stat(device, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+		return open(device, O_RDWR); // | O_NONBLOCK);
+	}
+
+	if (strlen(device) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, device);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+
+/*
+ * Maps PRU ring for TRANSPORT_SHM: PRU shared RAM through /dev/mem, or a regular
+ * file holding shm_t (emulator). Returns NULL with errno set on failure.
+ */
+static shm_t *open_shm(char const *path) {
+	struct stat st;
+	off_t offset = SHM_PHYS_ADDR;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDWR | O_SYNC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		goto fail;
+	}
+	if (S_ISREG(st.st_mode)) {
+		if (st.st_size < sizeof(shm_t)) {
+			errno = EINVAL;
+			goto fail;
+		}
+		offset = 0;
+	}
+	p = mmap(NULL, sizeof(shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	if (p == MAP_FAILED) {
+		goto fail;
+	}
+	close(fd);
+	return (shm_t *) p;
+
+fail:
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return NULL;
+}
+
+static void sleep_ns(long ns) {
+	struct timespec ts = { 0, ns };
+	nanosleep(&ts, NULL);
+}
+
+/* unique enough to tell our START from the previous one */
+static uint32_t next_shm_id(void) {
+	static uint32_t counter = 0;
+	uint32_t id = ((uint32_t) getpid() << 8) + __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+	return id != 0 ? id : 1;
+}
+
+/*
+ * Sample clock: integrates timestamp deltas into absolute PRU time, and fits
+ * host time of message arrival against PRU time of the last reading in it.
+ * Fit is an exponentially weighted least squares line, weights grow as 1/n
+ * until CLOCK_FIT_WINDOW messages have been seen.
+ */
+typedef struct {
+	uint64_t next_sample;    // index of the reading after the last one received
+	uint64_t tick;           // PRU time of the last reading received
+	uint64_t first_sample;   // index of the first reading of the last message
+	uint64_t first_tick;     // PRU time of the first reading of the last message
+	uint64_t measured_ticks; // sum of deltas received (dropped readings have none)
+	uint64_t measured;       // number of deltas received
+	uint64_t fit_count;
+	int num;                 // number of readings in the last message
+	double mean_tick;        // weighted means and (co)variances of the fit
+	double mean_time;
+	double var_tick;
+	double cov;
+} sample_clock_t;
 
 typedef struct {
 	driver_t pub;
 	int dev;
-	unsigned short buffer[MAX_BUFFER_SIZE/sizeof(unsigned short)];
+	unsigned short *buffer;  // one message, msg_size bytes
+	size_t msg_size;         // largest message in the wire format
+	unsigned short *decoded; // packed formats: current message converted to FORMAT_PLAIN
+	unsigned short *msg;     // current message in FORMAT_PLAIN, set by receive()
+	int msg_num;             // number of readings in it
+	int msg_dropped;
+	uint64_t msg_skipped;    // readings between the previous message and this one
+	double msg_time;         // CLOCK_MONOTONIC when message was read from device
+	sample_clock_t clock;
+	bool nonblock;
+	bool drained;  // last driver_read_many() stopped on EAGAIN, or had to wait
 	int num_channels;
-	int num_records;
+	int num_records;         // max readings per message
+	unsigned int layout;
+	unsigned int format;
+	bool indexed;            // trigger capture, messages carry index of their first reading
+	bool sparse;             // channel_divisor: records hold some channels only, see src/wire.h
+	unsigned int summary_window;  // summary mode: messages hold window statistics, see src/summary.h
+	uint16_t held[8];        // sparse: last value of each channel
+	unsigned short *carry;   // plain records of the message driver_read_block split
+	int carry_pos;           // first record not returned yet
+	int carry_left;          // records not returned yet
+	uint64_t carry_sample;   // sample index of carry[carry_pos]
+	unsigned int *carry_timestamps;  // scratch: timestamps of the split message, for the sample clock
+	unpack_fn unpack;
+	unpack_raw_fn unpack_raw;
+	unpack_planar_fn unpack_planar;
+	unpack_raw_planar_fn unpack_raw_planar;
+	unpack_lut_fn unpack_lut;
+	unpack_lut_planar_fn unpack_lut_planar;
+	float *calibration;      // UNPACK_LUT_SIZE values per channel, NULL - all channels ADC_SCALE
+
+	/*
+	 * Background reader. Reader thread is the only writer of head and stats,
+	 * consumer is the only writer of tail. Slot i of the ring is the message at
+	 * ring + i * msg_size bytes, with its drop count in ring_dropped[i].
+	 */
+	bool reader;
+	pthread_t thread;
+	int stop_fd;       // eventfd, tells reader thread to exit
+	int data_fd;       // eventfd, reader thread signals it after publishing messages
+	int reader_error;  // errno value, set by reader thread if device read failed
+	unsigned short *ring;
+	int *ring_dropped;
+	double *ring_time;
+	unsigned int ring_mask;
+	unsigned int head;
+	unsigned int tail;
+	driver_reader_stats_t reader_stats;
+
+	driver_ring_stats_t pru_ring;  // as reported by the current message
+
+	/*
+	 * driver_stats. Counters are written by whichever thread reads the device (and
+	 * lost by the consumer too), with atomic adds, so driver_stats can run anywhere.
+	 */
+	driver_stats_t stats;
+	double arrival;                // CLOCK_MONOTONIC when the last message was taken from device
+	double wait_start;             // set by wait_message, so that receive counts the whole wait
+
+	/*
+	 * Latest COMMAND_STATUS reply, written by whichever thread reads the device.
+	 * status_seq is odd while it is being written, and counts replies by twos.
+	 */
+	status_t status;
+	unsigned int status_seq;
+
+	driver_config_t config;        // as given to driver_open, for recording headers (pointers not kept)
+	bool recording;                // between driver_record_start and driver_record_stop
+	struct recorder *recorder;     // kept after driver_record_stop for its stats
+	bool publishing;               // between driver_publish_start and driver_publish_stop
+	struct publisher *publisher;   // kept after driver_publish_stop for its stats
+
+	/*
+	 * TRANSPORT_SHM: mapped PRU ring. Messages before shm_next have been taken,
+	 * messages before shm_tail have been released back to PRU.
+	 */
+	shm_t *shm;
+	uint32_t shm_next;
+	uint32_t shm_tail;
 } driver_impl_t;
 
 
-driver_t *driver_start(
-		unsigned int clk_div,
-		unsigned int step_avg,
-		unsigned int num_channels,
-		unsigned char const *channels,
-		unsigned int max_num,
-		unsigned int target_delay
-) {
-	static driver_impl_t driver;
+driver_t *driver_open(driver_config_t const *config) {
+	driver_impl_t *pdriver;
 	command_start_t command;
+	char const *device = config->device;
+	unsigned int num_channels = config->num_channels;
+	int err;
+
+	if (num_channels < 1 || num_channels > 8
+			|| config->layout > DRIVER_LAYOUT_PLANAR
+			|| config->transport > DRIVER_TRANSPORT_SHM
+			|| decimate_gain(config->decimate_factor ? config->decimate_factor : 1,
+					config->decimate_order ? config->decimate_order : 1) == 0
+			|| config->trigger_mode > DRIVER_TRIGGER_EDGE
+			|| (config->trigger_mode != DRIVER_TRIGGER_NONE
+				&& ((config->trigger_channels & ((1u << num_channels) - 1)) == 0
+					|| config->pre_trigger > trigger_max_pre(num_channels)
+					|| config->post_trigger >= 0xffff))
+			|| (config_sparse(config)
+				&& (config_min_values(config) == 0
+					|| config->decimate_factor > 1
+					|| config->trigger_mode != DRIVER_TRIGGER_NONE))
+			|| config->format > DRIVER_FORMAT_PACKED_FIXED
+			|| config->adc_mode > DRIVER_ADC_CONTINUOUS
+			|| config->sample_rate > PACER_MAX_RATE
+			|| config->summary_window > SUMMARY_MAX_WINDOW
+			|| (config->summary_window > 0
+				&& (config->trigger_mode != DRIVER_TRIGGER_NONE || config_sparse(config)))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pdriver = calloc(1, sizeof(driver_impl_t));
+	if (pdriver == NULL) {
+		return NULL;  // errno is ENOMEM
+	}
+	pdriver->config = *config;
+	pdriver->config.device = NULL;
+	pdriver->config.shm_path = NULL;
+	pdriver->num_channels = num_channels;
+	pdriver->unpack = unpack_select(num_channels);
+	pdriver->unpack_raw = unpack_raw_select(num_channels);
+	pdriver->unpack_planar = unpack_planar_select(num_channels);
+	pdriver->unpack_raw_planar = unpack_raw_planar_select(num_channels);
+	pdriver->unpack_lut = unpack_lut_select(num_channels);
+	pdriver->unpack_lut_planar = unpack_lut_planar_select(num_channels);
+	pdriver->layout = config->layout;
+	pdriver->format = config->summary_window > 0 ? DRIVER_FORMAT_PLAIN : config->format;  // PRU ignores it then
+	pdriver->summary_window = config->summary_window;
+	pdriver->num_records = driver_config_max_records(config);
+	pdriver->pru_ring.depth = config->ring_depth == 0 ? RING_DEFAULT_DEPTH
+			: config->ring_depth > RING_MAX_DEPTH ? RING_MAX_DEPTH : config->ring_depth;
+	pdriver->msg_size = wire_size(pdriver->format, num_channels, pdriver->num_records);
+	pdriver->indexed = config->trigger_mode != DRIVER_TRIGGER_NONE;
+	if (pdriver->indexed) {
+		pdriver->msg_size += WIRE_INDEX_SIZE;
+		if (pdriver->msg_size > WIRE_MAX_SIZE) pdriver->msg_size = WIRE_MAX_SIZE;
+	}
+	pdriver->sparse = config_sparse(config);
+	if (pdriver->sparse) {
+		pdriver->msg_size = WIRE_MAX_SIZE;
+	}
+	if (pdriver->summary_window > 0) {
+		pdriver->msg_size = summary_size(num_channels, pdriver->num_records);
+	}
+	if (pdriver->msg_size < sizeof(status_t)) {
+		pdriver->msg_size = sizeof(status_t);  // status reply comes through the same reads
+	}
+	pdriver->buffer = malloc(pdriver->msg_size);
+	if (pdriver->format != DRIVER_FORMAT_PLAIN || pdriver->sparse) {
+		pdriver->decoded = malloc(wire_size(FORMAT_PLAIN, num_channels, pdriver->num_records));
+	}
+	if (pdriver->buffer == NULL || ((pdriver->format != DRIVER_FORMAT_PLAIN || pdriver->sparse)
+			&& pdriver->decoded == NULL)) {
+		err = ENOMEM;
+		goto fail;
+	}
 
-	memset(&driver, '\0', sizeof(driver));
-	driver.num_channels = num_channels;
-	driver.num_records = driver_num_records(num_channels, max_num);
-	driver.dev = open("/dev/rpmsg_pru30", O_RDWR); // | O_NONBLOCK);
-	if (driver.dev < 0) {
-		fprintf(stderr, "could not open /dev/rpmsg_pru30\n");
-		return NULL;  // error
+	if (device == NULL) {
+		device = DRIVER_DEFAULT_DEVICE;
+	}
+	pdriver->dev = open_device(device);
+	if (pdriver->dev < 0) {
+		err = errno;
+		goto fail;
+	}
+	if (config->transport == DRIVER_TRANSPORT_SHM) {
+		pdriver->shm = open_shm(config->shm_path != NULL ? config->shm_path : DRIVER_DEFAULT_SHM);
+		if (pdriver->shm == NULL) {
+			err = errno;
+			close(pdriver->dev);
+			goto fail;
+		}
 	}
 
-	memset(&command, '\0', sizeof(command_t));
+	memset(&command, '\0', sizeof(command));
 	command.header.magic = COMMAND_MAGIC;
 	command.header.command = COMMAND_START;
-	command.clk_div = clk_div;
-	command.step_avg = step_avg;
+	command.clk_div = config->clk_div;
+	command.step_avg = config->step_avg;
 	command.num_channels = num_channels;
 	for (int i = 0; i < num_channels; i++) {
-		command.channels[i] = channels[i];
+		command.channels[i] = config->channels[i];
+	}
+	command.max_num = config->max_num;
+	command.target_delay = config->target_delay;
+	command.format = config->format;
+	command.ts_jitter = config->ts_jitter;
+	command.adc_mode = config->adc_mode;
+	command.ring_depth = pdriver->pru_ring.depth;
+	command.transport = config->transport;
+	command.shm_id = config->transport == DRIVER_TRANSPORT_SHM ? next_shm_id() : 0;
+	command.decimate_factor = config->decimate_factor;
+	command.decimate_order = config->decimate_order;
+	command.trigger_mode = config->trigger_mode;
+	command.trigger_channels = config->trigger_channels;
+	command.trigger_rising = config->trigger_rising;
+	for (int i = 0; i < 8; i++) {
+		command.trigger_threshold[i] = config->trigger_threshold[i];
+	}
+	command.pre_trigger = config->pre_trigger;
+	command.post_trigger = config->post_trigger;
+	for (int i = 0; i < num_channels; i++) {
+		command.channel_avg[i] = config->channel_avg[i];
+		command.channel_divisor[i] = config->channel_divisor[i];
 	}
-	command.max_num = max_num;
-	command.target_delay = target_delay;
+	command.sample_rate = config->sample_rate;
+	command.summary_window = config->summary_window;
 
 	/* write data to the payload[] buffer in the PRU firmware. */
-	size_t result = write(driver.dev, &command, sizeof(command));
+	ssize_t result = write(pdriver->dev, &command, sizeof(command));
 	if (result != sizeof(command)) {
-		fprintf(stderr, "write failed\n");
-		close(driver.dev);
+		err = result < 0 ? errno : EIO;
+		close(pdriver->dev);
+		goto fail;
+	}
+
+	if (pdriver->shm != NULL) {
+		/* wait until PRU resets the ring, it tells so by storing our shm_id */
+		long waited = 0;
+		while (__atomic_load_n(&pdriver->shm->header.id, __ATOMIC_ACQUIRE) != command.shm_id) {
+			if (waited >= SHM_READY_TIMEOUT_NS) {
+				command_t stop = { COMMAND_MAGIC, COMMAND_STOP };
+				write(pdriver->dev, &stop, sizeof(stop));
+				err = ETIMEDOUT;
+				close(pdriver->dev);
+				goto fail;
+			}
+			sleep_ns(SHM_POLL_NS);
+			waited += SHM_POLL_NS;
+		}
+	}
+
+	return &pdriver->pub;
+
+fail:
+	if (pdriver->shm != NULL) munmap(pdriver->shm, sizeof(shm_t));
+	free(pdriver->buffer);
+	free(pdriver->decoded);
+	free(pdriver);
+	errno = err;
+	return NULL;
+}
+
+driver_t *driver_start(
+		char const *device,
+		unsigned int clk_div,
+		unsigned int step_avg,
+		unsigned int num_channels,
+		unsigned char const *channels,
+		unsigned int max_num,
+		unsigned int target_delay,
+		unsigned int layout
+) {
+	driver_config_t config;
+
+	if (num_channels < 1 || num_channels > 8 || channels == NULL) {
+		errno = EINVAL;
 		return NULL;
 	}
 
-	return &driver.pub;
+	memset(&config, '\0', sizeof(config));
+	config.device = device;
+	config.clk_div = clk_div;
+	config.step_avg = step_avg;
+	config.num_channels = num_channels;
+	memcpy(config.channels, channels, num_channels);
+	config.max_num = max_num;
+	config.target_delay = target_delay;
+	config.layout = layout;
+	config.format = DRIVER_FORMAT_PLAIN;
+
+	return driver_open(&config);
 }
 
-int driver_read(driver_t *drv, int *dropped, unsigned int *timestamps, float *values) {
-	driver_impl_t *pdriver = (driver_impl_t *) drv;
-	int result;
-	command_t command;
-	unsigned short *p;
+static double monotonic_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-	command.magic = COMMAND_MAGIC;
-	command.command = COMMAND_ACK;
+static void stat_add(unsigned long long *counter, unsigned long long value) {
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
 
-	if (pdriver->dev < 0) {
-		fprintf(stderr, "attempt to read from closed device\n");
-		return -1;
+/* counts seconds in a histogram of driver_stats_t, see DRIVER_HISTOGRAM_BUCKETS */
+static void histogram_add(unsigned long long *histogram, double seconds) {
+	uint64_t us = seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+	int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+	stat_add(&histogram[bucket < DRIVER_HISTOGRAM_BUCKETS ? bucket : DRIVER_HISTOGRAM_BUCKETS - 1], 1);
+}
+
+/*
+ * Switches device between blocking (used by driver_read, and driver_read_many
+ * when waiting) and non-blocking (used by driver_read_many to drain) mode. Remembers current mode, so that fcntl() is
+ * only called when caller alternates between the two.
+ */
+static int set_nonblock(driver_impl_t *pdriver, bool nonblock) {
+	int flags;
+
+	if (pdriver->nonblock == nonblock) return 0;
+
+	flags = fcntl(pdriver->dev, F_GETFL);
+	if (flags < 0) return -errno;
+	flags = nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if (fcntl(pdriver->dev, F_SETFL, flags) < 0) return -errno;
+
+	pdriver->nonblock = nonblock;
+	return 0;
+}
+
+static int write_ack(driver_impl_t *pdriver, unsigned int count) {
+	command_ack_n_t command;
+	size_t size;
+	ssize_t result;
+
+	if (pdriver->shm != NULL) {
+		/* moving tail is the acknowledgement, PRU picks it up on its own */
+		pdriver->shm_tail += count;
+		__atomic_store_n(&pdriver->shm->header.tail, pdriver->shm_tail, __ATOMIC_RELEASE);
+		return 0;
 	}
 
-	result = read(pdriver->dev, pdriver->buffer, MAX_BUFFER_SIZE);
-	if (result < 0) {
-		fprintf(stderr, "read failed\n");
-		return -1;
+	command.header.magic = COMMAND_MAGIC;
+	if (count == 1) {
+		command.header.command = COMMAND_ACK;
+		size = sizeof(command_t);
+	} else {
+		command.header.command = COMMAND_ACK_N;
+		command.count = count;
+		size = sizeof(command);
 	}
 
-	result = write(pdriver->dev, &command, sizeof(command_t));
-	if (result != sizeof(command_t)) {
-		fprintf(stderr, "ack write failed\n");
-		return -1;
+	result = write(pdriver->dev, &command, size);
+	if (result < 0) return -errno;
+	if (result != size) return -EIO;
+	return 0;
+}
+
+static int send_ack(driver_impl_t *pdriver, unsigned int count) {
+	int result = write_ack(pdriver, count);
+	if (result < 0) stat_add(&pdriver->stats.ack_failures, 1);
+	return result;
+}
+
+/*
+ * check_message() for sparse messages: masks of the records have to add up to
+ * num_values of the message, which has to fit into size bytes
+ */
+static int check_sparse(driver_impl_t *pdriver, uint8_t const *buf, ssize_t size) {
+	uint16_t header[2], num, num_values, mask;
+	uint8_t const *records = buf + WIRE_HEADER_SIZE + WIRE_COUNT_SIZE;
+	int count = 0;
+
+	if (size < WIRE_HEADER_SIZE + WIRE_COUNT_SIZE) {
+		return -EPROTO;
+	}
+	memcpy(header, buf, sizeof(header));
+	memcpy(&num_values, buf + WIRE_HEADER_SIZE, sizeof(num_values));
+	num = BUFFER_NUM(header[0]);
+	if (num > pdriver->num_records || size < wire_sparse_size(pdriver->format, num, num_values)) {
+		return -EPROTO;
+	}
+	for (int i = 0; i < num; i++) {
+		if (pdriver->format == DRIVER_FORMAT_PLAIN) {
+			memcpy(&mask, records + 6 * i + 2 * count + 4, sizeof(mask));
+		} else {
+			mask = records[WIRE_BASE_SIZE + (3 * num_values + 1) / 2 + i];
+		}
+		count += __builtin_popcount(mask & ((1u << pdriver->num_channels) - 1));
+		if (count > num_values) {
+			return -EPROTO;
+		}
+	}
+	return count == num_values ? num : -EPROTO;
+}
+
+/*
+ * Checks a message of size bytes, returns number of readings in it, or -EPROTO.
+ * Message with more readings than we expect, or shorter than its readings need,
+ * means that PRU and driver disagree on parameters.
+ */
+static int check_message(driver_impl_t *pdriver, unsigned short const *buf, ssize_t size) {
+	if (pdriver->sparse) {
+		return check_sparse(pdriver, (uint8_t const *) buf, size);
+	}
+	if (pdriver->summary_window > 0) {
+		if (size < WIRE_HEADER_SIZE || BUFFER_NUM(buf[0]) > pdriver->num_records
+				|| size < summary_size(pdriver->num_channels, BUFFER_NUM(buf[0]))) {
+			return -EPROTO;
+		}
+		return BUFFER_NUM(buf[0]);
+	}
+	if (size < WIRE_HEADER_SIZE
+			|| BUFFER_NUM(buf[0]) > pdriver->num_records
+			|| size < wire_size(pdriver->format, pdriver->num_channels, BUFFER_NUM(buf[0]))
+					+ (pdriver->indexed ? WIRE_INDEX_SIZE : 0)) {
+		return -EPROTO;
+	}
+	return BUFFER_NUM(buf[0]);
+}
+
+/* bytes PRU sent in a message with num readings */
+static size_t message_size(driver_impl_t *pdriver, unsigned short const *buf, int num) {
+	if (pdriver->sparse) {
+		return wire_sparse_size_of(pdriver->format, (uint8_t const *) buf);
+	}
+	if (pdriver->summary_window > 0) {
+		return summary_size(pdriver->num_channels, num);
+	}
+	return wire_size(pdriver->format, pdriver->num_channels, num) + (pdriver->indexed ? WIRE_INDEX_SIZE : 0);
+}
+
+/*
+ * Accounts for a message just taken from device, result is what check_message
+ * said about it. Its arrival time goes to pdriver->arrival.
+ */
+static int note_message(driver_impl_t *pdriver, unsigned short const *buf, int result) {
+	double now = monotonic_now();
+
+	if (result == -EPROTO) {
+		stat_add(&pdriver->stats.short_reads, 1);
+		return result;
+	}
+	if (pdriver->stats.messages > 0) {
+		histogram_add(pdriver->stats.arrival_histogram, now - pdriver->arrival);
+	}
+	pdriver->arrival = now;
+	stat_add(&pdriver->stats.messages, 1);
+	stat_add(&pdriver->stats.bytes, message_size(pdriver, buf, result));
+	stat_add(&pdriver->stats.samples, result);
+	stat_add(&pdriver->stats.dropped, buf[1]);
+	return result;
+}
+
+static bool shm_available(driver_impl_t *pdriver) {
+	return __atomic_load_n(&pdriver->shm->header.head, __ATOMIC_ACQUIRE) != pdriver->shm_next;
+}
+
+/* TRANSPORT_SHM has no interrupt, so waiting is sleeping and checking again */
+static void shm_wait(driver_impl_t *pdriver) {
+	while (!shm_available(pdriver)) {
+		sleep_ns(SHM_POLL_NS);
+	}
+}
+
+/* keeps a COMMAND_STATUS reply for driver_status */
+static void take_status(driver_impl_t *pdriver, void const *buf, ssize_t size) {
+	unsigned int seq = pdriver->status_seq;
+
+	if (size < (ssize_t) sizeof(status_t)) {
+		stat_add(&pdriver->stats.short_reads, 1);
+		return;
+	}
+	__atomic_store_n(&pdriver->status_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&pdriver->status, buf, sizeof(status_t));
+	__atomic_store_n(&pdriver->status_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * read() of the device that sets status replies aside (see src/telemetry.h), so
+ * that callers only see data messages
+ */
+static ssize_t read_device(driver_impl_t *pdriver, unsigned short *buf) {
+	ssize_t result;
+
+	while (true) {
+		result = read(pdriver->dev, buf, pdriver->msg_size);
+		if (result < (ssize_t) sizeof(uint16_t) || buf[0] != STATUS_MARKER) return result;
+		take_status(pdriver, buf, result);
+	}
+}
+
+/*
+ * Takes the next message without copying it: reads it from device into
+ * pdriver->buffer, or with TRANSPORT_SHM points to its slot in the mapped ring
+ * (-EAGAIN if PRU has not published one yet). Either way it has to be
+ * acknowledged with send_ack(), and with TRANSPORT_SHM it must not be used after
+ * that. Returns number of readings, or negative errno value.
+ */
+static int next_message(driver_impl_t *pdriver, unsigned short **pbuf) {
+	ssize_t result;
+
+	if (pdriver->shm != NULL) {
+		if (!shm_available(pdriver)) return -EAGAIN;
+		*pbuf = (unsigned short *) pdriver->shm->slots[pdriver->shm_next % pdriver->pru_ring.depth];
+		pdriver->shm_next += 1;
+		return note_message(pdriver, *pbuf, check_message(pdriver, *pbuf, WIRE_MAX_SIZE));
+	}
+
+	*pbuf = pdriver->buffer;
+	result = read_device(pdriver, pdriver->buffer);
+	if (result < 0) return -errno;
+	return note_message(pdriver, pdriver->buffer, check_message(pdriver, pdriver->buffer, result));
+}
+
+/*
+ * Same as next_message, but the message is copied to buf, for the reader thread
+ * that keeps messages after acknowledging them.
+ */
+static int read_message(driver_impl_t *pdriver, unsigned short *buf) {
+	ssize_t result;
+
+	if (pdriver->shm != NULL) {
+		unsigned short *slot;
+		int num = next_message(pdriver, &slot);
+		if (num != -EAGAIN) memcpy(buf, slot, pdriver->msg_size);
+		return num;
+	}
+
+	result = read_device(pdriver, buf);
+	if (result < 0) return -errno;
+	return note_message(pdriver, buf, check_message(pdriver, buf, result));
+}
+
+static unsigned short *ring_slot(driver_impl_t *pdriver, unsigned int index) {
+	return (unsigned short *) ((uint8_t *) pdriver->ring + (index & pdriver->ring_mask) * pdriver->msg_size);
+}
+
+/* host seconds per PRU cycle, nominal value until the fit has something to say */
+static double clock_tick_seconds(sample_clock_t const *clock) {
+	double slope;
+
+	if (clock->fit_count < 2 || clock->var_tick <= 0) {
+		return PRU_TICK_SECONDS;
+	}
+	slope = clock->cov / clock->var_tick;
+	if (slope < 0.5 * PRU_TICK_SECONDS || slope > 2.0 * PRU_TICK_SECONDS) {
+		return PRU_TICK_SECONDS;  // not enough spread in the data yet
+	}
+	return slope;
+}
+
+static double clock_time(sample_clock_t const *clock, uint64_t tick) {
+	return clock->mean_time + clock_tick_seconds(clock) * ((double) tick - clock->mean_tick);
+}
+
+/*
+ * Advances sample clock past the current message, whose deltas have just been
+ * unpacked into timestamps. Dropped readings (and in trigger mode, readings
+ * between windows) have no deltas, they are assumed to be spaced by the average
+ * delta seen so far.
+ */
+static void advance_clock(driver_impl_t *pdriver, unsigned int const *timestamps) {
+	sample_clock_t *clock = &pdriver->clock;
+	uint64_t sum = 0;
+	double average, a, dx, dy;
+
+	clock->num = pdriver->msg_num;
+	if (clock->num == 0) {
+		clock->next_sample += pdriver->msg_skipped;
+		return;
+	}
+
+	for (int i = 0; i < clock->num; i++) {
+		sum += timestamps[i];
+	}
+
+	clock->measured_ticks += sum;
+	clock->measured += clock->num;
+	average = (double) clock->measured_ticks / clock->measured;
+
+	clock->first_sample = clock->next_sample + pdriver->msg_skipped;
+	clock->first_tick = clock->tick + (uint64_t) (pdriver->msg_skipped * average + 0.5) + timestamps[0];
+	clock->tick = clock->first_tick + sum - timestamps[0];
+	clock->next_sample = clock->first_sample + clock->num;
+
+	clock->fit_count += 1;
+	a = 1.0 / (clock->fit_count < CLOCK_FIT_WINDOW ? clock->fit_count : CLOCK_FIT_WINDOW);
+	dx = (double) clock->tick - clock->mean_tick;
+	dy = pdriver->msg_time - clock->mean_time;
+	clock->mean_tick += a * dx;
+	clock->mean_time += a * dy;
+	clock->var_tick = (1 - a) * (clock->var_tick + a * dx * dx);
+	clock->cov = (1 - a) * (clock->cov + a * dx * dy);
+}
+
+/*
+ * Makes a message read from device (or taken from reader ring) current.
+ * Packed formats and sparse messages are converted to FORMAT_PLAIN here, so that unpack kernels
+ * work the same for all of them.
+ */
+static void set_message(driver_impl_t *pdriver, unsigned short *buf, int dropped, double time) {
+	if (pdriver->sparse) {
+		unpack_sparse((uint8_t const *) buf, pdriver->format, pdriver->num_channels, pdriver->held,
+				pdriver->decoded + 2);
+		pdriver->msg = pdriver->decoded;
+	} else if (pdriver->format == DRIVER_FORMAT_PLAIN) {
+		pdriver->msg = buf;
+	} else {
+		unpack_wire((uint8_t const *) buf, pdriver->format, pdriver->num_channels, pdriver->decoded + 2);
+		pdriver->msg = pdriver->decoded;
+	}
+	pdriver->msg_num = BUFFER_NUM(buf[0]);
+	pdriver->msg_dropped = dropped + pdriver->carry_left;  // rest of a split message is lost to other reads
+	stat_add(&pdriver->stats.lost, pdriver->carry_left);
+	pdriver->carry_left = 0;
+	pdriver->msg_skipped = dropped;
+	if (pdriver->indexed) {
+		uint32_t index[2];
+		uint64_t first;
+		memcpy(index, (uint8_t const *) buf + wire_size(pdriver->format, pdriver->num_channels, pdriver->msg_num),
+				WIRE_INDEX_SIZE);
+		first = (uint64_t) index[1] << 32 | index[0];
+		pdriver->msg_skipped = first > pdriver->clock.next_sample ? first - pdriver->clock.next_sample : 0;
+	}
+	pdriver->pru_ring.used = BUFFER_RING_USED(buf[0]);
+	if (pdriver->pru_ring.used > pdriver->pru_ring.high_water) {
+		pdriver->pru_ring.high_water = pdriver->pru_ring.used;
+	}
+	pdriver->msg_time = time;
+}
+
+/* float kernels: through calibration tables if there are any, ADC_SCALE otherwise */
+static void unpack_float(driver_impl_t *pdriver, unsigned short const *src, int count,
+		unsigned int *timestamps, float *values) {
+	if (pdriver->calibration != NULL) {
+		pdriver->unpack_lut(src, count, timestamps, values, pdriver->calibration);
+	} else {
+		pdriver->unpack(src, count, timestamps, values, (float) ADC_SCALE);
+	}
+}
+
+static void unpack_float_planar(driver_impl_t *pdriver, unsigned short const *src, int count,
+		unsigned int *timestamps, float *const *channels) {
+	if (pdriver->calibration != NULL) {
+		pdriver->unpack_lut_planar(src, count, timestamps, channels, pdriver->calibration);
+	} else {
+		pdriver->unpack_planar(src, count, timestamps, channels, (float) ADC_SCALE);
 	}
+}
 
-	p = pdriver->buffer;
-	*dropped = p[1];
-	p += 2;
-	for (int i = 0; i < pdriver->num_records; i++) {
-		*timestamps = * (unsigned int *) p; p += 2; timestamps += 1;
+static void unpack(driver_impl_t *pdriver, int *dropped, unsigned int *timestamps, float *values) {
+	unsigned short *p = pdriver->msg;
+
+	*dropped = pdriver->msg_dropped;
+	if (pdriver->layout == DRIVER_LAYOUT_PLANAR) {
+		float *channels[8];
 		for (int j = 0; j < pdriver->num_channels; j++) {
-			*values = (*p) * 1.8 / 4095.0; p += 1; values += 1;
+			channels[j] = values + j * pdriver->num_records;
 		}
+		unpack_float_planar(pdriver, p + 2, pdriver->msg_num, timestamps, channels);
+	} else {
+		unpack_float(pdriver, p + 2, pdriver->msg_num, timestamps, values);
 	}
+	advance_clock(pdriver, timestamps);
+}
 
-	return 0;
+static void unpack_raw(driver_impl_t *pdriver, int *dropped, unsigned int *timestamps, unsigned short *values) {
+	unsigned short *p = pdriver->msg;
+
+	*dropped = pdriver->msg_dropped;
+	if (pdriver->layout == DRIVER_LAYOUT_PLANAR) {
+		unsigned short *channels[8];
+		for (int j = 0; j < pdriver->num_channels; j++) {
+			channels[j] = values + j * pdriver->num_records;
+		}
+		pdriver->unpack_raw_planar(p + 2, pdriver->msg_num, timestamps, channels);
+	} else {
+		pdriver->unpack_raw(p + 2, pdriver->msg_num, timestamps, values);
+	}
+	advance_clock(pdriver, timestamps);
 }
 
-int driver_stop(driver_t *drv) {
-	driver_impl_t *pdriver = (driver_impl_t *) drv;
-	command_t command;
+/*
+ * Background reader thread: reads everything PRU sends as soon as it arrives,
+ * acknowledges it right away, and publishes messages to the ring.
+ * If the ring is full, message is discarded and its readings are added to
+ * the drop count of the next published message. Discarded messages are read
+ * into pdriver->buffer, consumer does not use it while reader runs.
+ */
+static void *reader_main(void *arg) {
+	driver_impl_t *pdriver = (driver_impl_t *) arg;
+	driver_reader_stats_t *stats = &pdriver->reader_stats;
+	struct pollfd pfd[2] = {
+		{ .fd = pdriver->shm != NULL ? -1 : pdriver->dev, .events = POLLIN },
+		{ .fd = pdriver->stop_fd, .events = POLLIN },
+	};
+	uint64_t one = 1;
+	int lost = 0;
+	int err = 0;
 
-	if (pdriver->dev < 0) return 0;  // nothing to do
+	while (err == 0) {
+		unsigned int count = 0;
 
-	command.magic = COMMAND_MAGIC;
-	command.command = COMMAND_STOP;
+		/* TRANSPORT_SHM has nothing to poll: just check for stop, and look at the ring */
+		if (poll(pfd, 2, pdriver->shm != NULL ? 0 : -1) < 0) {
+			if (errno == EINTR) continue;
+			err = errno;
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			return NULL;  // driver_stop
+		}
 
-	write(pdriver->dev, &command, sizeof(command));
+		while (true) {
+			unsigned int head = pdriver->head;
+			unsigned int tail = __atomic_load_n(&pdriver->tail, __ATOMIC_ACQUIRE);
+			bool full = head - tail > pdriver->ring_mask;
+			unsigned short *dst = full ? pdriver->buffer : ring_slot(pdriver, head);
+			int result = read_message(pdriver, dst);
 
-	close(pdriver->dev);
+			if (result == -EAGAIN || result == -EWOULDBLOCK) break;
+			if (result == -EINTR) continue;
+			if (result == -EPROTO) {
+				count += 1;  // counted in short_reads; acknowledge it, or PRU loses the buffer
+				continue;
+			}
+			if (result < 0) {
+				err = -result;
+				break;
+			}
+			count += 1;
+			__atomic_store_n(&stats->messages, stats->messages + 1, __ATOMIC_RELAXED);
 
-	pdriver->dev = -1;
+			if (full) {
+				lost += dst[1] + result;
+				stat_add(&pdriver->stats.lost, result);
+				__atomic_store_n(&stats->overflows, stats->overflows + 1, __ATOMIC_RELAXED);
+				continue;
+			}
 
-	return 0;
+			pdriver->ring_dropped[head & pdriver->ring_mask] = dst[1] + lost;
+			pdriver->ring_time[head & pdriver->ring_mask] = pdriver->arrival;
+			lost = 0;
+			__atomic_store_n(&pdriver->head, head + 1, __ATOMIC_RELEASE);
+			if (head + 1 - tail > stats->high_water) {
+				__atomic_store_n(&stats->high_water, head + 1 - tail, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (count > 0) {
+			int result = send_ack(pdriver, count);
+			if (result < 0) err = -result;
+			write(pdriver->data_fd, &one, sizeof(one));
+		} else if (pdriver->shm != NULL) {
+			sleep_ns(SHM_POLL_NS);
+		}
+	}
+
+	__atomic_store_n(&pdriver->reader_error, err, __ATOMIC_RELEASE);
+	write(pdriver->data_fd, &one, sizeof(one));
+	return NULL;
+}
+
+static bool reader_available(driver_impl_t *pdriver) {
+	return __atomic_load_n(&pdriver->head, __ATOMIC_ACQUIRE) != pdriver->tail;
+}
+
+/*
+ * Blocks until reader thread publishes at least one message
+ */
+static int reader_wait(driver_impl_t *pdriver) {
+	double start;
+	uint64_t value;
+	int err;
+
+	if (reader_available(pdriver)) return 0;
+
+	start = monotonic_now();
+	while (!reader_available(pdriver)) {
+		err = __atomic_load_n(&pdriver->reader_error, __ATOMIC_ACQUIRE);
+		if (err != 0) {
+			return -err;
+		}
+		if (read(pdriver->data_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+			return -errno;
+		}
+	}
+	histogram_add(pdriver->stats.wait_histogram, monotonic_now() - start);
+	return 0;
+}
+
+static void stop_reader(driver_impl_t *pdriver) {
+	uint64_t one = 1;
+
+	if (!pdriver->reader) return;
+
+	write(pdriver->stop_fd, &one, sizeof(one));
+	pthread_join(pdriver->thread, NULL);
+	close(pdriver->stop_fd);
+	close(pdriver->data_fd);
+	free(pdriver->ring);
+	free(pdriver->ring_dropped);
+	free(pdriver->ring_time);
+	pdriver->ring = NULL;
+	pdriver->ring_dropped = NULL;
+	pdriver->ring_time = NULL;
+	pdriver->reader = false;
+}
+
+int driver_start_reader(driver_t *drv, unsigned int capacity, int priority) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	unsigned int size = 2;
+	int err;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->reader) {
+		return -EBUSY;
+	}
+
+	while (size < capacity && size < 0x10000000) {
+		size <<= 1;
+	}
+
+	pdriver->stop_fd = -1;
+	pdriver->data_fd = -1;
+	pdriver->ring = calloc(size, pdriver->msg_size);
+	pdriver->ring_dropped = calloc(size, sizeof(int));
+	pdriver->ring_time = calloc(size, sizeof(double));
+	if (pdriver->ring == NULL || pdriver->ring_dropped == NULL || pdriver->ring_time == NULL) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	pdriver->ring_mask = size - 1;
+	pdriver->head = 0;
+	pdriver->tail = 0;
+	pdriver->reader_error = 0;
+	memset(&pdriver->reader_stats, '\0', sizeof(pdriver->reader_stats));
+	pdriver->reader_stats.capacity = size;
+
+	pdriver->stop_fd = eventfd(0, 0);
+	pdriver->data_fd = eventfd(0, 0);
+	if (pdriver->stop_fd < 0 || pdriver->data_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+	err = set_nonblock(pdriver, true);
+	if (err < 0) {
+		goto fail;
+	}
+
+	err = -pthread_create(&pdriver->thread, NULL, reader_main, pdriver);
+	if (err < 0) {
+		goto fail;
+	}
+
+	if (priority > 0) {
+		struct sched_param param = { .sched_priority = priority };
+		/* needs CAP_SYS_NICE (or rtprio limit), keep running at normal priority if not allowed */
+		if (pthread_setschedparam(pdriver->thread, SCHED_FIFO, &param) == 0) {
+			pdriver->reader_stats.realtime = 1;
+		}
+	}
+
+	pdriver->reader = true;
+	return 0;
+
+fail:
+	if (pdriver->stop_fd >= 0) close(pdriver->stop_fd);
+	if (pdriver->data_fd >= 0) close(pdriver->data_fd);
+	free(pdriver->ring);
+	free(pdriver->ring_dropped);
+	free(pdriver->ring_time);
+	pdriver->ring = NULL;
+	pdriver->ring_dropped = NULL;
+	pdriver->ring_time = NULL;
+	return err;
+}
+
+int driver_reader_stats(driver_t *drv, driver_reader_stats_t *stats) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+
+	if (!pdriver->reader) {
+		memset(stats, '\0', sizeof(*stats));
+		return -ENOENT;
+	}
+
+	stats->capacity = pdriver->reader_stats.capacity;
+	stats->occupancy = __atomic_load_n(&pdriver->head, __ATOMIC_ACQUIRE) - pdriver->tail;
+	stats->high_water = __atomic_load_n(&pdriver->reader_stats.high_water, __ATOMIC_RELAXED);
+	stats->realtime = pdriver->reader_stats.realtime;
+	stats->messages = __atomic_load_n(&pdriver->reader_stats.messages, __ATOMIC_RELAXED);
+	stats->overflows = __atomic_load_n(&pdriver->reader_stats.overflows, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int driver_ring_stats(driver_t *drv, driver_ring_stats_t *stats) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+
+	*stats = pdriver->pru_ring;
+	return 0;
+}
+
+int driver_stats(driver_t *drv, driver_stats_t *stats) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	driver_stats_t *s = &pdriver->stats;
+
+	stats->messages = __atomic_load_n(&s->messages, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+	stats->samples = __atomic_load_n(&s->samples, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+	stats->lost = __atomic_load_n(&s->lost, __ATOMIC_RELAXED);
+	stats->short_reads = __atomic_load_n(&s->short_reads, __ATOMIC_RELAXED);
+	stats->ack_failures = __atomic_load_n(&s->ack_failures, __ATOMIC_RELAXED);
+	for (int i = 0; i < DRIVER_HISTOGRAM_BUCKETS; i++) {
+		stats->wait_histogram[i] = __atomic_load_n(&s->wait_histogram[i], __ATOMIC_RELAXED);
+		stats->arrival_histogram[i] = __atomic_load_n(&s->arrival_histogram[i], __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static void cycle_stat_copy(driver_cycle_stat_t *dst, cycle_stat_t const *src) {
+	dst->count = src->count;
+	dst->min = src->min;
+	dst->max = src->max;
+	dst->total = src->total;
+}
+
+int driver_request_status(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	command_t command = { COMMAND_MAGIC, COMMAND_STATUS };
+	ssize_t result;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	result = write(pdriver->dev, &command, sizeof(command));
+	if (result < 0) return -errno;
+	if (result != sizeof(command)) return -EIO;
+	return 0;
+}
+
+/* TRANSPORT_SHM: data does not come through the device, so nothing else reads replies from it */
+static void shm_take_status(driver_impl_t *pdriver) {
+	struct pollfd pfd = { .fd = pdriver->dev, .events = POLLIN };
+	unsigned short *buf = pdriver->reader ? malloc(pdriver->msg_size) : pdriver->buffer;
+	ssize_t result;
+
+	if (buf == NULL) return;
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+		result = read(pdriver->dev, buf, pdriver->msg_size);
+		if (result <= 0) break;
+		if (result >= (ssize_t) sizeof(uint16_t) && buf[0] == STATUS_MARKER) {
+			take_status(pdriver, buf, result);
+		} else {
+			stat_add(&pdriver->stats.short_reads, 1);  // PRU sends nothing else this way
+		}
+	}
+	if (buf != pdriver->buffer) free(buf);
+}
+
+int driver_status(driver_t *drv, driver_status_t *status) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	status_t copy;
+	unsigned int seq;
+
+	if (pdriver->shm != NULL && pdriver->dev >= 0) {
+		shm_take_status(pdriver);
+	}
+	do {
+		seq = __atomic_load_n(&pdriver->status_seq, __ATOMIC_ACQUIRE);
+		memcpy(&copy, &pdriver->status, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&pdriver->status_seq, __ATOMIC_RELAXED));
+
+	memset(status, '\0', sizeof(*status));
+	if (seq == 0) {
+		return -ENODATA;
+	}
+	status->sequence = seq / 2;
+	status->readings = copy.readings;
+	status->buffers = copy.buffers;
+	status->send_failures = copy.send_failures;
+	status->dropped = copy.dropped;
+	cycle_stat_copy(&status->loop, &copy.loop);
+	cycle_stat_copy(&status->capture, &copy.capture);
+	cycle_stat_copy(&status->io_send, &copy.io_send);
+	cycle_stat_copy(&status->latency, &copy.latency);
+	status->missed = copy.missed;
+	cycle_stat_copy(&status->jitter, &copy.jitter);
+	return 0;
+}
+
+/*
+ * Reader thread, without blocking: -EAGAIN if it has not published a message.
+ * Clears data_fd on the way, so that it polls readable again only when the reader
+ * publishes more.
+ */
+static int reader_try(driver_impl_t *pdriver) {
+	struct pollfd pfd = { .fd = pdriver->data_fd, .events = POLLIN };
+	uint64_t value;
+	int err;
+
+	if (reader_available(pdriver)) return 0;
+	if (poll(&pfd, 1, 0) > 0) {
+		read(pdriver->data_fd, &value, sizeof(value));
+	}
+	if (reader_available(pdriver)) return 0;
+	err = __atomic_load_n(&pdriver->reader_error, __ATOMIC_ACQUIRE);
+	return err != 0 ? -err : -EAGAIN;
+}
+
+/*
+ * Gets next message and makes it current (pdriver->msg). Blocks until one arrives,
+ * or without wait returns -EAGAIN if there is none yet.
+ * Without background reader, message is read from device and acknowledged here
+ * (in release() with TRANSPORT_SHM, as it is unpacked in place).
+ * Must be paired with release() once the message is unpacked.
+ */
+static int receive(driver_impl_t *pdriver, bool wait) {
+	unsigned short *buf;
+	double start;
+	int result;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->recording || pdriver->publishing) {
+		return -EBUSY;
+	}
+
+	if (pdriver->reader) {
+		result = wait ? reader_wait(pdriver) : reader_try(pdriver);
+		if (result < 0) {
+			return result;
+		}
+		set_message(pdriver, ring_slot(pdriver, pdriver->tail),
+				pdriver->ring_dropped[pdriver->tail & pdriver->ring_mask],
+				pdriver->ring_time[pdriver->tail & pdriver->ring_mask]);
+		return 0;
+	}
+
+	start = pdriver->wait_start > 0 ? pdriver->wait_start : monotonic_now();
+	pdriver->wait_start = 0;
+	if (pdriver->shm != NULL) {
+		if (wait) shm_wait(pdriver);
+	} else {
+		result = set_nonblock(pdriver, !wait);
+		if (result < 0) {
+			return result;
+		}
+	}
+
+	do {
+		result = next_message(pdriver, &buf);
+	} while (result == -EINTR);
+	if (result == -EWOULDBLOCK) {
+		result = -EAGAIN;
+	}
+	if (result >= 0 && wait) {
+		histogram_add(pdriver->stats.wait_histogram, pdriver->arrival - start);
+	}
+	if (result == -EPROTO) {
+		send_ack(pdriver, 1);  // acknowledge even a malformed message, or PRU loses the buffer
+		return result;
+	}
+	if (result < 0) {
+		return result;
+	}
+	set_message(pdriver, buf, buf[1], pdriver->arrival);
+
+	if (pdriver->shm != NULL) {
+		return 0;  // message is read in place, release() acknowledges it
+	}
+	return send_ack(pdriver, 1);
+}
+
+static void release(driver_impl_t *pdriver) {
+	if (pdriver->reader) {
+		__atomic_store_n(&pdriver->tail, pdriver->tail + 1, __ATOMIC_RELEASE);
+	} else if (pdriver->shm != NULL) {
+		send_ack(pdriver, 1);
+	}
+}
+
+/* how read_one() unpacks the message */
+enum {
+	READ_FLOAT,         // driver_read
+	READ_RAW,           // driver_read_raw
+	READ_CHANNELS,      // driver_read_channels, values is float *const *
+	READ_CHANNELS_RAW,  // driver_read_channels_raw, values is unsigned short *const *
+};
+
+/* body of driver_read and friends, and of their driver_try_ versions (!wait) */
+static int read_one(driver_impl_t *pdriver, bool wait, int how, int *dropped, unsigned int *timestamps,
+		void const *values) {
+	int result;
+
+	if (pdriver->summary_window > 0) {
+		return -EOPNOTSUPP;  // messages hold no readings, see driver_read_summary
+	}
+	result = receive(pdriver, wait);
+	if (result < 0) {
+		return result;
+	}
+
+	switch (how) {
+	case READ_FLOAT:
+		unpack(pdriver, dropped, timestamps, (float *) values);
+		break;
+	case READ_RAW:
+		unpack_raw(pdriver, dropped, timestamps, (unsigned short *) values);
+		break;
+	case READ_CHANNELS:
+		*dropped = pdriver->msg_dropped;
+		unpack_float_planar(pdriver, pdriver->msg + 2, pdriver->msg_num, timestamps, (float *const *) values);
+		advance_clock(pdriver, timestamps);
+		break;
+	case READ_CHANNELS_RAW:
+		*dropped = pdriver->msg_dropped;
+		pdriver->unpack_raw_planar(pdriver->msg + 2, pdriver->msg_num, timestamps,
+				(unsigned short *const *) values);
+		advance_clock(pdriver, timestamps);
+		break;
+	}
+	release(pdriver);
+
+	return pdriver->msg_num;
+}
+
+int driver_read(driver_t *drv, int *dropped, unsigned int *timestamps, float *values) {
+	return read_one((driver_impl_t *) drv, true, READ_FLOAT, dropped, timestamps, values);
+}
+
+int driver_read_raw(driver_t *drv, int *dropped, unsigned int *timestamps, unsigned short *values) {
+	return read_one((driver_impl_t *) drv, true, READ_RAW, dropped, timestamps, values);
+}
+
+int driver_read_channels(driver_t *drv, int *dropped, unsigned int *timestamps, float *const *channels) {
+	return read_one((driver_impl_t *) drv, true, READ_CHANNELS, dropped, timestamps, channels);
+}
+
+int driver_read_channels_raw(driver_t *drv, int *dropped, unsigned int *timestamps, unsigned short *const *channels) {
+	return read_one((driver_impl_t *) drv, true, READ_CHANNELS_RAW, dropped, timestamps, channels);
+}
+
+int driver_try_read(driver_t *drv, int *dropped, unsigned int *timestamps, float *values) {
+	return read_one((driver_impl_t *) drv, false, READ_FLOAT, dropped, timestamps, values);
+}
+
+int driver_try_read_raw(driver_t *drv, int *dropped, unsigned int *timestamps, unsigned short *values) {
+	return read_one((driver_impl_t *) drv, false, READ_RAW, dropped, timestamps, values);
+}
+
+int driver_try_read_channels(driver_t *drv, int *dropped, unsigned int *timestamps, float *const *channels) {
+	return read_one((driver_impl_t *) drv, false, READ_CHANNELS, dropped, timestamps, channels);
+}
+
+int driver_try_read_channels_raw(driver_t *drv, int *dropped, unsigned int *timestamps, unsigned short *const *channels) {
+	return read_one((driver_impl_t *) drv, false, READ_CHANNELS_RAW, dropped, timestamps, channels);
+}
+
+/* body of driver_read_summary and driver_try_read_summary (!wait) */
+static int read_summary(driver_impl_t *pdriver, bool wait, int *dropped, driver_summary_t *summaries) {
+	uint8_t const *record;
+	uint32_t words[2];
+	int result;
+
+	if (pdriver->summary_window == 0) {
+		return -EOPNOTSUPP;
+	}
+	result = receive(pdriver, wait);
+	if (result < 0) {
+		return result;
+	}
+
+	*dropped = pdriver->msg_dropped;
+	record = (uint8_t const *) pdriver->msg + WIRE_HEADER_SIZE;
+	for (int i = 0; i < pdriver->msg_num; i++) {
+		driver_summary_t *summary = &summaries[i];
+
+		memcpy(words, record, sizeof(words));
+		summary->cycles = (uint64_t) words[1] << 32 | words[0];
+		summary->count = pdriver->summary_window;
+		record += SUMMARY_CYCLES_SIZE;
+		for (int j = 0; j < pdriver->num_channels; j++) {
+			memcpy(&summary->min[j], record, sizeof(uint16_t));
+			memcpy(&summary->max[j], record + 2, sizeof(uint16_t));
+			memcpy(&summary->sum[j], record + 4, sizeof(uint32_t));
+			memcpy(words, record + 8, sizeof(words));
+			summary->sumsq[j] = (uint64_t) words[1] << 32 | words[0];
+			record += SUMMARY_CHANNEL_SIZE;
+		}
+	}
+	release(pdriver);
+
+	return pdriver->msg_num;
+}
+
+int driver_read_summary(driver_t *drv, int *dropped, driver_summary_t *summaries) {
+	return read_summary((driver_impl_t *) drv, true, dropped, summaries);
+}
+
+int driver_try_read_summary(driver_t *drv, int *dropped, driver_summary_t *summaries) {
+	return read_summary((driver_impl_t *) drv, false, dropped, summaries);
+}
+
+int driver_fileno(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->reader) {
+		return pdriver->data_fd;
+	}
+	if (pdriver->shm != NULL) {
+		return -EOPNOTSUPP;
+	}
+	return pdriver->dev;
+}
+
+double driver_scale(void) {
+	return ADC_SCALE;
+}
+
+/* tables of all channels, made on first use with ADC_SCALE for every channel */
+static float *calibration_tables(driver_impl_t *pdriver) {
+	if (pdriver->calibration == NULL) {
+		float *lut = malloc(pdriver->num_channels * UNPACK_LUT_SIZE * sizeof(float));
+		if (lut == NULL) return NULL;
+		for (int i = 0; i < pdriver->num_channels * UNPACK_LUT_SIZE; i++) {
+			lut[i] = (i % UNPACK_LUT_SIZE) * (float) ADC_SCALE;  // same rounding as the scale kernels
+		}
+		pdriver->calibration = lut;
+	}
+	return pdriver->calibration;
+}
+
+int driver_set_calibration(driver_t *drv, unsigned int channel, float const *table) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	float *lut;
+
+	if (channel >= pdriver->num_channels) return -EINVAL;
+	lut = calibration_tables(pdriver);
+	if (lut == NULL) return -ENOMEM;
+	lut += channel * UNPACK_LUT_SIZE;
+	for (int v = 0; v < UNPACK_LUT_SIZE; v++) {
+		lut[v] = table != NULL ? table[v] : v * (float) ADC_SCALE;
+	}
+	return 0;
+}
+
+int driver_set_calibration_linear(driver_t *drv, unsigned int channel, double gain, double offset) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	float *lut;
+
+	if (channel >= pdriver->num_channels) return -EINVAL;
+	lut = calibration_tables(pdriver);
+	if (lut == NULL) return -ENOMEM;
+	lut += channel * UNPACK_LUT_SIZE;
+	for (int v = 0; v < UNPACK_LUT_SIZE; v++) {
+		lut[v] = (float) (v * ADC_SCALE * gain + offset);
+	}
+	return 0;
+}
+
+void driver_clear_calibration(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+
+	free(pdriver->calibration);
+	pdriver->calibration = NULL;
+}
+
+int driver_timing(driver_t *drv, driver_timing_t *timing) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	sample_clock_t const *clock = &pdriver->clock;
+	double tick_seconds = clock_tick_seconds(clock);
+
+	memset(timing, '\0', sizeof(*timing));
+	timing->tick_seconds = tick_seconds;
+	if (clock->fit_count == 0) {
+		return -ENODATA;
+	}
+
+	timing->first_sample = clock->first_sample;
+	timing->first_tick = clock->first_tick;
+	timing->num_records = clock->num;
+	timing->period = tick_seconds * clock->measured_ticks / clock->measured;
+	timing->first_time = clock_time(clock, clock->first_tick);
+	return 0;
+}
+
+int driver_ticks(driver_t *drv, unsigned int const *timestamps, unsigned long long *ticks) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	uint64_t tick = pdriver->clock.first_tick;
+
+	if (pdriver->clock.fit_count == 0) {
+		return -ENODATA;
+	}
+
+	ticks[0] = tick;
+	for (int i = 1; i < pdriver->clock.num; i++) {
+		tick += timestamps[i];
+		ticks[i] = tick;
+	}
+	return 0;
+}
+
+int driver_times(driver_t *drv, unsigned int const *timestamps, double *times) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	sample_clock_t const *clock = &pdriver->clock;
+	double tick_seconds = clock_tick_seconds(clock);
+	double t;
+
+	if (clock->fit_count == 0) {
+		return -ENODATA;
+	}
+
+	t = clock_time(clock, clock->first_tick);
+	times[0] = t;
+	for (int i = 1; i < clock->num; i++) {
+		t += tick_seconds * timestamps[i];
+		times[i] = t;
+	}
+	return 0;
+}
+
+/*
+ * Waits until a message can be received without blocking, or until deadline
+ * (monotonic_now() seconds, negative - none). Returns 0, -ETIMEDOUT, or negative
+ * errno value. Without reader thread, receive() that follows counts the wait.
+ */
+static int wait_message(driver_impl_t *pdriver, double deadline) {
+	double start = monotonic_now();
+	uint64_t value;
+
+	while (true) {
+		int timeout = -1;
+		int result;
+
+		if (deadline >= 0) {
+			double left = deadline - monotonic_now();
+			timeout = left > 0 ? (int) (left * 1000) + 1 : 0;
+		}
+
+		if (pdriver->reader) {
+			struct pollfd pfd = { .fd = pdriver->data_fd, .events = POLLIN };
+			int err;
+
+			if (reader_available(pdriver)) {
+				histogram_add(pdriver->stats.wait_histogram, monotonic_now() - start);
+				return 0;
+			}
+			err = __atomic_load_n(&pdriver->reader_error, __ATOMIC_ACQUIRE);
+			if (err != 0) return -err;
+			result = poll(&pfd, 1, timeout);
+			if (result > 0) read(pdriver->data_fd, &value, sizeof(value));
+		} else if (pdriver->shm != NULL) {
+			if (shm_available(pdriver)) break;
+			if (timeout == 0) return -ETIMEDOUT;
+			sleep_ns(SHM_POLL_NS);
+			continue;
+		} else {
+			struct pollfd pfd = { .fd = pdriver->dev, .events = POLLIN };
+			result = poll(&pfd, 1, timeout);
+			if (result > 0) break;
+		}
+		if (result == 0 && timeout == 0) return -ETIMEDOUT;
+		if (result < 0 && errno != EINTR) return -errno;
+	}
+	pdriver->wait_start = start;
+	return 0;
+}
+
+/* unpacks count plain records into the caller buffers of driver_read_block, starting at reading offset */
+static void put_records(driver_impl_t *pdriver, unsigned short const *src, int count, int offset,
+		int num_samples, unsigned int *timestamps, void *values, bool raw) {
+	int num_channels = pdriver->num_channels;
+
+	if (pdriver->layout == DRIVER_LAYOUT_PLANAR && raw) {
+		unsigned short *channels[8];
+		for (int j = 0; j < num_channels; j++) {
+			channels[j] = (unsigned short *) values + j * num_samples + offset;
+		}
+		pdriver->unpack_raw_planar(src, count, timestamps + offset, channels);
+	} else if (pdriver->layout == DRIVER_LAYOUT_PLANAR) {
+		float *channels[8];
+		for (int j = 0; j < num_channels; j++) {
+			channels[j] = (float *) values + j * num_samples + offset;
+		}
+		unpack_float_planar(pdriver, src, count, timestamps + offset, channels);
+	} else if (raw) {
+		pdriver->unpack_raw(src, count, timestamps + offset, (unsigned short *) values + offset * num_channels);
+	} else {
+		unpack_float(pdriver, src, count, timestamps + offset, (float *) values + offset * num_channels);
+	}
+}
+
+static void add_gap(driver_gap_t *gaps, int max_gaps, driver_block_t *block, unsigned int offset, uint64_t count) {
+	if (count == 0) return;
+	block->dropped += count;
+	if (block->num_gaps > 0 && block->num_gaps <= max_gaps && gaps[block->num_gaps - 1].offset == offset) {
+		gaps[block->num_gaps - 1].count += count;  // empty messages in a row
+		return;
+	}
+	if (block->num_gaps < max_gaps) {
+		gaps[block->num_gaps].offset = offset;
+		gaps[block->num_gaps].count = count;
+	}
+	block->num_gaps += 1;
+}
+
+static int read_block(driver_impl_t *pdriver, int num_samples, int timeout_ms, unsigned int *timestamps,
+		void *values, bool raw, driver_gap_t *gaps, int max_gaps, driver_block_t *block) {
+	int words = 2 + pdriver->num_channels;  // per plain record
+	double deadline = timeout_ms < 0 ? -1 : monotonic_now() + timeout_ms * 1e-3;
+	int count = 0;
+	int result;
+
+	memset(block, '\0', sizeof(*block));
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->recording || pdriver->publishing) {
+		return -EBUSY;
+	}
+	if (pdriver->summary_window > 0) {
+		return -EOPNOTSUPP;
+	}
+	if (pdriver->carry == NULL) {
+		pdriver->carry = malloc(pdriver->num_records * words * sizeof(unsigned short));
+		pdriver->carry_timestamps = malloc(pdriver->num_records * sizeof(unsigned int));
+		if (pdriver->carry == NULL || pdriver->carry_timestamps == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	if (pdriver->carry_left > 0 && num_samples > 0) {
+		count = pdriver->carry_left < num_samples ? pdriver->carry_left : num_samples;
+		put_records(pdriver, pdriver->carry + pdriver->carry_pos * words, count, 0, num_samples, timestamps, values, raw);
+		block->first_sample = pdriver->carry_sample;
+		pdriver->carry_pos += count;
+		pdriver->carry_left -= count;
+		pdriver->carry_sample += count;
+	}
+
+	while (count < num_samples) {
+		int num, take;
+
+		result = wait_message(pdriver, deadline);
+		if (result == 0) {
+			result = receive(pdriver, true);
+		}
+		if (result == -ETIMEDOUT) {
+			break;
+		}
+		if (result < 0) {
+			return count > 0 ? count : result;
+		}
+
+		num = pdriver->msg_num;
+		take = num < num_samples - count ? num : num_samples - count;
+		put_records(pdriver, pdriver->msg + 2, take, count, num_samples, timestamps, values, raw);
+		if (take == num) {
+			advance_clock(pdriver, timestamps + count);
+		} else {
+			/* keep the rest for the next call, the clock needs all timestamps of the message now */
+			for (int i = 0; i < num; i++) {
+				memcpy(&pdriver->carry_timestamps[i], pdriver->msg + 2 + i * words, sizeof(unsigned int));
+			}
+			memcpy(pdriver->carry, pdriver->msg + 2 + take * words, (num - take) * words * sizeof(unsigned short));
+			pdriver->carry_pos = 0;
+			pdriver->carry_left = num - take;
+			advance_clock(pdriver, pdriver->carry_timestamps);
+			pdriver->carry_sample = pdriver->clock.first_sample + take;
+		}
+		release(pdriver);
+
+		if (num > 0) {
+			if (count == 0) {
+				block->first_sample = pdriver->clock.first_sample;
+			} else {
+				add_gap(gaps, max_gaps, block, count, pdriver->msg_skipped);
+			}
+		} else if (count > 0) {
+			add_gap(gaps, max_gaps, block, count, pdriver->msg_skipped);
+		}
+		count += take;
+	}
+
+	return count;
+}
+
+int driver_read_block(driver_t *drv, int num_samples, int timeout_ms, unsigned int *timestamps,
+		float *values, driver_gap_t *gaps, int max_gaps, driver_block_t *block) {
+	return read_block((driver_impl_t *) drv, num_samples, timeout_ms, timestamps, values, false,
+			gaps, max_gaps, block);
+}
+
+int driver_read_block_raw(driver_t *drv, int num_samples, int timeout_ms, unsigned int *timestamps,
+		unsigned short *values, driver_gap_t *gaps, int max_gaps, driver_block_t *block) {
+	return read_block((driver_impl_t *) drv, num_samples, timeout_ms, timestamps, values, true,
+			gaps, max_gaps, block);
+}
+
+int driver_read_many(driver_t *drv, int max_messages, int *dropped, int *counts,
+		unsigned int *timestamps, float *values) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	int num_messages = 0;
+	int result;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->recording || pdriver->publishing) {
+		return -EBUSY;
+	}
+	if (pdriver->summary_window > 0) {
+		return -EOPNOTSUPP;
+	}
+
+	if (pdriver->reader) {
+		result = reader_wait(pdriver);
+		if (result < 0) {
+			return result;
+		}
+		while (num_messages < max_messages && reader_available(pdriver)) {
+			receive(pdriver, true);
+			unpack(pdriver, dropped, timestamps, values);
+			release(pdriver);
+			if (counts != NULL) counts[num_messages] = pdriver->msg_num;
+			dropped += 1;
+			timestamps += pdriver->num_records;
+			values += pdriver->num_records * pdriver->num_channels;
+			num_messages += 1;
+		}
+		return num_messages;
+	}
+
+	while (num_messages < max_messages) {
+		bool wait = num_messages == 0 && pdriver->drained;
+		double start = wait ? monotonic_now() : 0;
+		unsigned short *buf;
+
+		/*
+		 * Last call emptied the queue, most likely there is nothing there yet: block
+		 * in read() rather than poll() first or find out with a read() that returns
+		 * EAGAIN. Only draining is non-blocking.
+		 */
+		if (pdriver->shm != NULL) {
+			if (wait) shm_wait(pdriver);
+		} else {
+			result = set_nonblock(pdriver, !wait);
+			if (result < 0) {
+				if (num_messages > 0) send_ack(pdriver, num_messages);
+				return result;
+			}
+		}
+
+		result = next_message(pdriver, &buf);
+		if (result == -EAGAIN || result == -EWOULDBLOCK) {
+			pdriver->drained = true;
+			if (num_messages > 0) break;  // got everything that was queued
+			continue;
+		}
+		if (result == -EINTR) {
+			continue;
+		}
+		if (result < 0) {
+			if (result == -EPROTO) num_messages += 1;  // still has to be acknowledged
+			if (num_messages > 0) send_ack(pdriver, num_messages);
+			return result;
+		}
+
+		if (wait) {
+			histogram_add(pdriver->stats.wait_histogram, pdriver->arrival - start);
+			/*
+			 * read() that really blocked got the message PRU just sent, the queue
+			 * is empty again: return it without another read() to find that out.
+			 * One that did not was behind a backlog, which is drained as usual.
+			 */
+			pdriver->drained = pdriver->shm == NULL && pdriver->arrival - start >= BLOCKED_READ_SECONDS;
+		}
+		set_message(pdriver, buf, buf[1], pdriver->arrival);
+		unpack(pdriver, dropped, timestamps, values);
+		if (counts != NULL) counts[num_messages] = pdriver->msg_num;
+		dropped += 1;
+		timestamps += pdriver->num_records;
+		values += pdriver->num_records * pdriver->num_channels;
+		num_messages += 1;
+		if (pdriver->drained) break;
+	}
+
+	result = send_ack(pdriver, num_messages);
+	if (result < 0) {
+		return result;
+	}
+
+	return num_messages;
+}
+
+/*
+ * Recorder (driver_record_start). Recorder thread is the only consumer of the
+ * reader ring while recording. It gathers messages into a block of block_size
+ * bytes, and writes each full block with a single pwrite() to the current
+ * segment, followed by its index entry and the segment header. Layout of
+ * segments is in src/record.h. Stats are written by recorder thread only.
+ */
+typedef struct recorder {
+	driver_record_config_t config;
+	char *path;
+	pthread_t thread;
+	int stop_fd;                 // eventfd, tells recorder thread to finish
+	int fd;                      // current segment, -1 if none is open
+	record_header_t header;      // of the current segment
+	uint8_t *block;              // block being filled, RECORD_ALIGN aligned
+	uint32_t used;               // bytes of it in use
+	uint32_t sequence;           // number of the block being filled
+	unsigned int *timestamps;    // scratch for unpack_raw(), to advance the sample clock
+	unsigned short *values;
+	driver_record_stats_t stats;
+} recorder_t;
+
+static uint64_t align_up(uint64_t size, uint64_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+static char *segment_path(recorder_t *rec, uint32_t segment) {
+	size_t size = strlen(rec->path) + 16;
+	char *path = malloc(size);
+	if (path != NULL) snprintf(path, size, "%s.%06" PRIu32, rec->path, segment);
+	return path;
+}
+
+static int pwrite_all(int fd, void const *buf, size_t size, uint64_t offset) {
+	while (size > 0) {
+		ssize_t result = pwrite(fd, buf, size, offset);
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		buf = (uint8_t const *) buf + result;
+		size -= result;
+		offset += result;
+	}
+	return 0;
+}
+
+/* cuts the current segment down to the blocks written and closes it */
+static int close_segment(recorder_t *rec) {
+	int err = 0;
+
+	if (rec->fd < 0) return 0;
+	if (ftruncate(rec->fd, rec->header.data_offset + (uint64_t) rec->header.num_blocks * rec->header.block_size) < 0) {
+		err = -errno;
+	}
+	if (close(rec->fd) < 0 && err == 0) {
+		err = -errno;
+	}
+	rec->fd = -1;
+	return err;
+}
+
+/* opens the next segment, removing the oldest one if there are max_segments already */
+static int open_segment(driver_impl_t *pdriver, recorder_t *rec) {
+	record_header_t *h = &rec->header;
+	driver_config_t const *config = &pdriver->config;
+	uint32_t segment = rec->stats.segments;
+	uint64_t available;
+	char *path;
+	int err;
+
+	path = segment_path(rec, segment);
+	if (path == NULL) return -ENOMEM;
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	free(path);
+	if (rec->fd < 0) return -errno;
+
+	memset(h, '\0', sizeof(*h));
+	memcpy(h->magic, RECORD_MAGIC, sizeof(h->magic));
+	h->version = RECORD_VERSION;
+	h->kind = rec->config.kind;
+	h->segment = segment;
+	h->block_size = rec->config.block_size;
+	available = rec->config.segment_size > RECORD_HEADER_SIZE ? rec->config.segment_size - RECORD_HEADER_SIZE : 0;
+	h->max_blocks = available / (h->block_size + sizeof(record_index_t));
+	if (h->max_blocks == 0) h->max_blocks = 1;
+	h->index_offset = RECORD_HEADER_SIZE;
+	h->data_offset = h->index_offset + align_up((uint64_t) h->max_blocks * sizeof(record_index_t), RECORD_ALIGN);
+
+	h->num_channels = pdriver->num_channels;
+	memcpy(h->channels, config->channels, sizeof(h->channels));
+	h->clk_div = config->clk_div;
+	h->step_avg = config->step_avg;
+	h->target_delay = config->target_delay;
+	h->format = config->format;
+	h->adc_mode = config->adc_mode;
+	h->decimate_factor = config->decimate_factor;
+	h->decimate_order = config->decimate_order;
+	h->trigger_mode = config->trigger_mode;
+	h->flags = (pdriver->indexed ? RECORD_INDEXED : 0) | (pdriver->sparse ? RECORD_SPARSE : 0);
+	memcpy(h->channel_avg, config->channel_avg, sizeof(h->channel_avg));
+	for (int i = 0; i < 8; i++) {
+		h->channel_divisor[i] = config->channel_divisor[i];
+	}
+	h->tick_seconds = clock_tick_seconds(&pdriver->clock);
+	h->scale = ADC_SCALE;
+
+	/* reserve the whole segment up front, so that blocks do not wait for the filesystem to find room */
+	err = posix_fallocate(rec->fd, 0, h->data_offset + (uint64_t) h->max_blocks * h->block_size);
+	if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+		close_segment(rec);
+		return -err;
+	}
+	err = pwrite_all(rec->fd, h, sizeof(*h), 0);
+	if (err < 0) {
+		close_segment(rec);
+		return err;
+	}
+
+	rec->stats.segments += 1;
+	if (rec->config.max_segments > 0 && segment >= rec->config.max_segments) {
+		path = segment_path(rec, segment - rec->config.max_segments);
+		if (path != NULL) unlink(path);
+		free(path);
+	}
+	return 0;
+}
+
+/* writes out the block being filled, moving on to the next segment when the current one is full */
+static int flush_block(driver_impl_t *pdriver, recorder_t *rec) {
+	record_block_t *block = (record_block_t *) rec->block;
+	record_header_t *h = &rec->header;
+	record_index_t index;
+	uint64_t offset;
+	int err;
+
+	if (block->num_messages == 0) return 0;
+
+	if (rec->fd >= 0 && h->num_blocks == h->max_blocks) {
+		err = close_segment(rec);
+		if (err < 0) return err;
+	}
+	if (rec->fd < 0) {
+		err = open_segment(pdriver, rec);
+		if (err < 0) return err;
+	}
+
+	block->used = rec->used;
+	block->sequence = rec->sequence;
+	block->first_time = clock_time(&pdriver->clock, block->first_tick);
+	memset(rec->block + rec->used, '\0', h->block_size - rec->used);
+
+	offset = h->data_offset + (uint64_t) h->num_blocks * h->block_size;
+	err = pwrite_all(rec->fd, rec->block, h->block_size, offset);
+	if (err < 0) return err;
+
+	index.first_sample = block->first_sample;
+	index.first_tick = block->first_tick;
+	index.first_time = block->first_time;
+	index.num_readings = block->num_readings;
+	index.num_messages = block->num_messages;
+	err = pwrite_all(rec->fd, &index, sizeof(index), h->index_offset + (uint64_t) h->num_blocks * sizeof(index));
+	if (err < 0) return err;
+
+	if (h->num_blocks == 0) {
+		h->first_sample = block->first_sample;
+		h->first_tick = block->first_tick;
+		h->first_time = block->first_time;
+	}
+	h->num_blocks += 1;
+	h->tick_seconds = clock_tick_seconds(&pdriver->clock);
+	err = pwrite_all(rec->fd, h, sizeof(*h), 0);
+	if (err < 0) return err;
+
+	__atomic_store_n(&rec->stats.bytes, rec->stats.bytes + h->block_size, __ATOMIC_RELAXED);
+	rec->sequence += 1;
+	rec->used = sizeof(record_block_t);
+	memset(block, '\0', sizeof(*block));
+	return 0;
+}
+
+/* appends the current message to the block, writing the block out first if it does not fit */
+static int record_message(driver_impl_t *pdriver, recorder_t *rec, unsigned short const *buf) {
+	record_block_t *block = (record_block_t *) rec->block;
+	sample_clock_t const *clock = &pdriver->clock;
+	record_entry_t entry;
+	void const *payload;
+	int dropped;
+	int err;
+
+	unpack_raw(pdriver, &dropped, rec->timestamps, rec->values);
+
+	memset(&entry, '\0', sizeof(entry));
+	entry.num = pdriver->msg_num;
+	entry.dropped = pdriver->msg_dropped;
+	entry.first_sample = entry.num > 0 ? clock->first_sample : clock->next_sample;
+	entry.first_tick = entry.num > 0 ? clock->first_tick : clock->tick;
+	if (rec->config.kind == DRIVER_RECORD_DECODED) {
+		payload = pdriver->msg + 2;
+		entry.size = entry.num * (4 + 2 * pdriver->num_channels);
+	} else {
+		payload = buf;
+		entry.size = message_size(pdriver, buf, entry.num);
+	}
+
+	if (rec->used + sizeof(entry) + align_up(entry.size, 8) > rec->header.block_size) {
+		err = flush_block(pdriver, rec);
+		if (err < 0) return err;
+	}
+	if (block->num_messages == 0) {
+		block->first_sample = entry.first_sample;
+		block->first_tick = entry.first_tick;
+	}
+	memcpy(rec->block + rec->used, &entry, sizeof(entry));
+	memcpy(rec->block + rec->used + sizeof(entry), payload, entry.size);
+	rec->used += sizeof(entry) + align_up(entry.size, 8);
+	block->num_messages += 1;
+	block->num_readings += entry.num;
+
+	__atomic_store_n(&rec->stats.messages, rec->stats.messages + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->stats.readings, rec->stats.readings + entry.num, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->stats.dropped, rec->stats.dropped + (entry.dropped > 0 ? entry.dropped : 0),
+			__ATOMIC_RELAXED);
+	return 0;
+}
+
+static void *recorder_main(void *arg) {
+	driver_impl_t *pdriver = (driver_impl_t *) arg;
+	recorder_t *rec = pdriver->recorder;
+	struct pollfd pfd[2] = {
+		{ .fd = pdriver->data_fd, .events = POLLIN },
+		{ .fd = rec->stop_fd, .events = POLLIN },
+	};
+	bool stopping = false;
+	uint64_t value;
+	int err = 0;
+
+	while (err == 0) {
+		while (err == 0 && reader_available(pdriver)) {
+			unsigned int slot = pdriver->tail & pdriver->ring_mask;
+			unsigned short *buf = ring_slot(pdriver, pdriver->tail);
+
+			set_message(pdriver, buf, pdriver->ring_dropped[slot], pdriver->ring_time[slot]);
+			err = -record_message(pdriver, rec, buf);
+			release(pdriver);
+		}
+		if (err != 0 || stopping) break;
+		err = __atomic_load_n(&pdriver->reader_error, __ATOMIC_ACQUIRE);
+		if (err != 0) break;
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno != EINTR) err = errno;
+			continue;
+		}
+		if (pfd[0].revents & POLLIN) {
+			read(pdriver->data_fd, &value, sizeof(value));
+		}
+		if (pfd[1].revents & POLLIN) {
+			stopping = true;  // take what reader has published so far, then finish
+		}
+	}
+
+	if (err == 0) err = -flush_block(pdriver, rec);
+	value = -close_segment(rec);
+	if (err == 0) err = value;
+	__atomic_store_n(&rec->stats.error, err, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->stats.recording, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void free_recorder(recorder_t *rec) {
+	if (rec == NULL) return;
+	if (rec->stop_fd >= 0) close(rec->stop_fd);
+	free(rec->path);
+	free(rec->block);
+	free(rec->timestamps);
+	free(rec->values);
+	free(rec);
+}
+
+int driver_record_start(driver_t *drv, driver_record_config_t const *config) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	recorder_t *rec;
+	size_t largest;
+	int err;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->recording || pdriver->publishing) {
+		return -EBUSY;
+	}
+	if (pdriver->summary_window > 0) {
+		return -EOPNOTSUPP;  // recordings and subscribers expect readings
+	}
+	if (config->path == NULL || config->path[0] == '\0' || config->kind > DRIVER_RECORD_DECODED
+			|| config->block_size % RECORD_ALIGN != 0) {
+		return -EINVAL;
+	}
+
+	rec = calloc(1, sizeof(recorder_t));
+	if (rec == NULL) {
+		return -ENOMEM;
+	}
+	rec->stop_fd = -1;
+	rec->fd = -1;
+	rec->config = *config;
+	if (rec->config.segment_size == 0) rec->config.segment_size = RECORD_DEFAULT_SEGMENT_SIZE;
+	if (rec->config.block_size == 0) rec->config.block_size = RECORD_DEFAULT_BLOCK_SIZE;
+	if (rec->config.reader_capacity == 0) rec->config.reader_capacity = RECORD_DEFAULT_READER_CAPACITY;
+	/* a block has to fit the largest message, whatever was asked for */
+	largest = sizeof(record_block_t) + sizeof(record_entry_t)
+			+ align_up(pdriver->msg_size > pdriver->num_records * (4 + 2 * pdriver->num_channels)
+				? pdriver->msg_size : pdriver->num_records * (4 + 2 * pdriver->num_channels), 8);
+	if (rec->config.block_size < largest) rec->config.block_size = align_up(largest, RECORD_ALIGN);
+	rec->path = strdup(config->path);
+	rec->config.path = rec->path;
+	rec->used = sizeof(record_block_t);
+	rec->timestamps = malloc(pdriver->num_records * sizeof(unsigned int));
+	rec->values = malloc(pdriver->num_records * pdriver->num_channels * sizeof(unsigned short));
+	if (rec->path == NULL || rec->timestamps == NULL || rec->values == NULL
+			|| posix_memalign((void **) &rec->block, RECORD_ALIGN, rec->config.block_size) != 0) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	memset(rec->block, '\0', rec->config.block_size);
+	rec->stop_fd = eventfd(0, 0);
+	if (rec->stop_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (!pdriver->reader) {
+		err = driver_start_reader(drv, rec->config.reader_capacity, 0);
+		if (err < 0) goto fail;
+	}
+
+	/* first segment is opened here, so that a bad path is reported right away */
+	err = open_segment(pdriver, rec);
+	if (err < 0) goto fail;
+
+	free_recorder(pdriver->recorder);
+	pdriver->recorder = rec;
+	rec->stats.recording = 1;
+	err = -pthread_create(&rec->thread, NULL, recorder_main, pdriver);
+	if (err < 0) {
+		pdriver->recorder = NULL;
+		close_segment(rec);
+		goto fail;
+	}
+	pdriver->recording = true;
+	return 0;
+
+fail:
+	free_recorder(rec);
+	return err;
+}
+
+int driver_record_stop(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	recorder_t *rec = pdriver->recorder;
+	uint64_t one = 1;
+
+	if (!pdriver->recording) return 0;
+
+	write(rec->stop_fd, &one, sizeof(one));
+	pthread_join(rec->thread, NULL);
+	pdriver->recording = false;
+	return -rec->stats.error;
+}
+
+int driver_record_stats(driver_t *drv, driver_record_stats_t *stats) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	recorder_t *rec = pdriver->recorder;
+
+	if (rec == NULL) {
+		memset(stats, '\0', sizeof(*stats));
+		return -ENOENT;
+	}
+
+	stats->messages = __atomic_load_n(&rec->stats.messages, __ATOMIC_RELAXED);
+	stats->readings = __atomic_load_n(&rec->stats.readings, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&rec->stats.dropped, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&rec->stats.bytes, __ATOMIC_RELAXED);
+	stats->segments = __atomic_load_n(&rec->stats.segments, __ATOMIC_RELAXED);
+	stats->recording = __atomic_load_n(&rec->stats.recording, __ATOMIC_ACQUIRE);
+	stats->error = __atomic_load_n(&rec->stats.error, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Publisher (driver_publish_start). Like the recorder, publisher thread is the
+ * only consumer of the reader ring while publishing. It decodes each message
+ * into scratch arrays and copies the readings into the shared ring, following
+ * the reserve/head protocol of src/fanout.h. Stats are written by publisher
+ * thread only, subscriber entries are read as they are.
+ */
+typedef struct publisher {
+	driver_publish_config_t config;
+	char *name;
+	pthread_t thread;
+	int stop_fd;                 // eventfd, tells publisher thread to finish
+	fanout_header_t *header;     // the mapping, NULL if not mapped
+	uint64_t mask;               // capacity - 1
+	uint32_t *timestamps;        // arrays of the mapping
+	uint64_t *samples;
+	double *times;
+	uint16_t *values;
+	unsigned int *scratch_timestamps;  // one decoded message
+	unsigned short *scratch_values;
+	double *scratch_times;
+	driver_publish_stats_t stats;
+} publisher_t;
+
+/* publisher of the ring is there and has not stopped */
+static bool fanout_alive(fanout_header_t const *h) {
+	pid_t pid = __atomic_load_n(&h->pid, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == FANOUT_RUNNING
+			&& (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* maps and fills in the ring, replacing whatever stale one had the name */
+static int open_fanout(driver_impl_t *pdriver, publisher_t *pub) {
+	uint64_t capacity = pub->config.capacity;
+	fanout_header_t *h;
+	uint64_t size;
+	int fd;
+
+	fd = shm_open(pub->name, O_RDONLY, 0);
+	if (fd >= 0) {
+		h = mmap(NULL, sizeof(fanout_header_t), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (h != MAP_FAILED) {
+			bool alive = memcmp(h->magic, FANOUT_MAGIC, sizeof(h->magic)) == 0 && fanout_alive(h);
+			munmap(h, sizeof(fanout_header_t));
+			if (alive) return -EADDRINUSE;
+		}
+		shm_unlink(pub->name);
+	}
+
+	fd = shm_open(pub->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return -errno;
+	size = FANOUT_HEADER_SIZE + capacity * (sizeof(uint32_t) + sizeof(uint64_t) + sizeof(double)
+			+ pdriver->num_channels * sizeof(uint16_t));
+	size = align_up(size, 4096);
+	if (ftruncate(fd, size) < 0) {
+		int err = -errno;
+		close(fd);
+		shm_unlink(pub->name);
+		return err;
+	}
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		int err = -errno;
+		shm_unlink(pub->name);
+		return err;
+	}
+
+	/* 8-byte arrays first, so that every array is aligned to its element */
+	h->version = FANOUT_VERSION;
+	h->pid = getpid();
+	h->num_channels = pdriver->num_channels;
+	memcpy(h->channels, pdriver->config.channels, sizeof(h->channels));
+	h->capacity = capacity;
+	h->size = size;
+	h->samples_offset = FANOUT_HEADER_SIZE;
+	h->times_offset = h->samples_offset + capacity * sizeof(uint64_t);
+	h->timestamps_offset = h->times_offset + capacity * sizeof(double);
+	h->values_offset = h->timestamps_offset + capacity * sizeof(uint32_t);
+	h->scale = ADC_SCALE;
+	memcpy(h->magic, FANOUT_MAGIC, sizeof(h->magic));
+	__atomic_store_n(&h->state, FANOUT_RUNNING, __ATOMIC_RELEASE);
+
+	pub->header = h;
+	pub->mask = capacity - 1;
+	pub->samples = (uint64_t *) ((uint8_t *) h + h->samples_offset);
+	pub->times = (double *) ((uint8_t *) h + h->times_offset);
+	pub->timestamps = (uint32_t *) ((uint8_t *) h + h->timestamps_offset);
+	pub->values = (uint16_t *) ((uint8_t *) h + h->values_offset);
+	return 0;
+}
+
+/* decodes the current message and appends its readings to the ring */
+static void publish_message(driver_impl_t *pdriver, publisher_t *pub) {
+	fanout_header_t *h = pub->header;
+	sample_clock_t const *clock = &pdriver->clock;
+	int n = pdriver->msg_num;
+	int num_channels = pdriver->num_channels;
+	uint64_t head = h->head;  // publisher is its only writer
+
+	pdriver->unpack_raw(pdriver->msg + 2, n, pub->scratch_timestamps, pub->scratch_values);  // interleaved, whatever the layout
+	advance_clock(pdriver, pub->scratch_timestamps);
+	if (n > 0 && driver_times(&pdriver->pub, pub->scratch_timestamps, pub->scratch_times) < 0) {
+		memset(pub->scratch_times, '\0', n * sizeof(double));
+	}
+
+	__atomic_store_n(&pub->stats.messages, pub->stats.messages + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pub->stats.dropped, pub->stats.dropped + (pdriver->msg_dropped > 0 ? pdriver->msg_dropped : 0),
+			__ATOMIC_RELAXED);
+	if (n == 0) return;
+
+	__atomic_store_n(&h->reserve, head + n, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (int i = 0; i < n; i++) {
+		uint64_t p = (head + i) & pub->mask;
+		pub->timestamps[p] = pub->scratch_timestamps[i];
+		pub->samples[p] = clock->first_sample + i;
+		pub->times[p] = pub->scratch_times[i];
+		memcpy(pub->values + p * num_channels, pub->scratch_values + i * num_channels,
+				num_channels * sizeof(uint16_t));
+	}
+	__atomic_store_n(&h->head, head + n, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&pub->stats.readings, pub->stats.readings + n, __ATOMIC_RELAXED);
+}
+
+static void *publisher_main(void *arg) {
+	driver_impl_t *pdriver = (driver_impl_t *) arg;
+	publisher_t *pub = pdriver->publisher;
+	struct pollfd pfd[2] = {
+		{ .fd = pdriver->data_fd, .events = POLLIN },
+		{ .fd = pub->stop_fd, .events = POLLIN },
+	};
+	uint64_t value;
+	int err = 0;
+
+	while (err == 0) {
+		while (reader_available(pdriver)) {
+			unsigned int slot = pdriver->tail & pdriver->ring_mask;
+			unsigned short *buf = ring_slot(pdriver, pdriver->tail);
+
+			set_message(pdriver, buf, pdriver->ring_dropped[slot], pdriver->ring_time[slot]);
+			publish_message(pdriver, pub);
+			release(pdriver);
+		}
+		err = __atomic_load_n(&pdriver->reader_error, __ATOMIC_ACQUIRE);
+		if (err != 0) break;
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno != EINTR) err = errno;
+			continue;
+		}
+		if (pfd[0].revents & POLLIN) {
+			read(pdriver->data_fd, &value, sizeof(value));
+		}
+		if (pfd[1].revents & POLLIN) {
+			break;  // subscribers keep what was published, nothing to finish
+		}
+	}
+
+	__atomic_store_n(&pub->header->state, FANOUT_STOPPED, __ATOMIC_RELEASE);
+	__atomic_store_n(&pub->stats.error, err, __ATOMIC_RELAXED);
+	__atomic_store_n(&pub->stats.publishing, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void free_publisher(publisher_t *pub) {
+	if (pub == NULL) return;
+	if (pub->stop_fd >= 0) close(pub->stop_fd);
+	if (pub->header != NULL) munmap(pub->header, pub->header->size);
+	free(pub->name);
+	free(pub->scratch_timestamps);
+	free(pub->scratch_values);
+	free(pub->scratch_times);
+	free(pub);
+}
+
+int driver_publish_start(driver_t *drv, driver_publish_config_t const *config) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	publisher_t *pub;
+	int err;
+
+	if (pdriver->dev < 0) {
+		return -EBADF;
+	}
+	if (pdriver->recording || pdriver->publishing) {
+		return -EBUSY;
+	}
+	if (pdriver->summary_window > 0) {
+		return -EOPNOTSUPP;
+	}
+	if (config->capacity > FANOUT_MAX_CAPACITY
+			|| (config->name != NULL && (config->name[0] != '/' || strchr(config->name + 1, '/') != NULL))) {
+		return -EINVAL;
+	}
+
+	pub = calloc(1, sizeof(publisher_t));
+	if (pub == NULL) {
+		return -ENOMEM;
+	}
+	pub->stop_fd = -1;
+	pub->config = *config;
+	pub->config.capacity = FANOUT_MIN_CAPACITY;
+	while (pub->config.capacity < (config->capacity ? config->capacity : FANOUT_DEFAULT_CAPACITY)
+			|| pub->config.capacity < 2 * (unsigned int) pdriver->num_records) {  // a message never laps itself
+		pub->config.capacity <<= 1;
+	}
+	if (pub->config.reader_capacity == 0) pub->config.reader_capacity = FANOUT_DEFAULT_READER_CAPACITY;
+	pub->name = strdup(config->name != NULL ? config->name : DRIVER_DEFAULT_FANOUT);
+	pub->config.name = pub->name;
+	pub->scratch_timestamps = malloc(pdriver->num_records * sizeof(unsigned int));
+	pub->scratch_values = malloc(pdriver->num_records * pdriver->num_channels * sizeof(unsigned short));
+	pub->scratch_times = malloc(pdriver->num_records * sizeof(double));
+	if (pub->name == NULL || pub->scratch_timestamps == NULL || pub->scratch_values == NULL
+			|| pub->scratch_times == NULL) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	pub->stop_fd = eventfd(0, 0);
+	if (pub->stop_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (!pdriver->reader) {
+		err = driver_start_reader(drv, pub->config.reader_capacity, 0);
+		if (err < 0) goto fail;
+	}
+
+	err = open_fanout(pdriver, pub);
+	if (err < 0) goto fail;
+
+	free_publisher(pdriver->publisher);
+	pdriver->publisher = pub;
+	pub->stats.publishing = 1;
+	err = -pthread_create(&pub->thread, NULL, publisher_main, pdriver);
+	if (err < 0) {
+		pdriver->publisher = NULL;
+		shm_unlink(pub->name);
+		goto fail;
+	}
+	pdriver->publishing = true;
+	return 0;
+
+fail:
+	free_publisher(pub);
+	return err;
+}
+
+int driver_publish_stop(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	publisher_t *pub = pdriver->publisher;
+	uint64_t one = 1;
+
+	if (!pdriver->publishing) return 0;
+
+	write(pub->stop_fd, &one, sizeof(one));
+	pthread_join(pub->thread, NULL);
+	shm_unlink(pub->name);
+	pdriver->publishing = false;
+	return -pub->stats.error;
+}
+
+int driver_publish_stats(driver_t *drv, driver_publish_stats_t *stats) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	publisher_t *pub = pdriver->publisher;
+	uint64_t head;
+
+	memset(stats, '\0', sizeof(*stats));
+	if (pub == NULL) {
+		return -ENOENT;
+	}
+
+	stats->messages = __atomic_load_n(&pub->stats.messages, __ATOMIC_RELAXED);
+	stats->readings = __atomic_load_n(&pub->stats.readings, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&pub->stats.dropped, __ATOMIC_RELAXED);
+	stats->publishing = __atomic_load_n(&pub->stats.publishing, __ATOMIC_ACQUIRE);
+	stats->error = __atomic_load_n(&pub->stats.error, __ATOMIC_RELAXED);
+
+	head = __atomic_load_n(&pub->header->head, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < FANOUT_MAX_READERS; i++) {
+		fanout_reader_t const *r = &pub->header->readers[i];
+		pid_t pid = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+		uint64_t cursor;
+
+		if (pid == 0 || (kill(pid, 0) < 0 && errno == ESRCH)) continue;
+		cursor = __atomic_load_n(&r->cursor, __ATOMIC_RELAXED);
+		stats->subscribers += 1;
+		stats->lapped += __atomic_load_n(&r->lapped, __ATOMIC_RELAXED);
+		if (head > cursor && head - cursor > stats->max_lag) stats->max_lag = head - cursor;
+	}
+	return 0;
+}
+
+/*
+ * Subscriber (driver_subscribe). Cursor is private, and copied to the entry in
+ * readers of the header (if there is one) for the publisher to see.
+ */
+typedef struct {
+	driver_subscription_t pub;
+	fanout_header_t *header;
+	size_t size;
+	fanout_reader_t *entry;      // NULL if memory is read-only
+	uint64_t capacity;
+	uint64_t cursor;             // next reading to take
+	uint64_t lapped;             // readings lost so far
+	uint32_t const *timestamps;  // arrays of the mapping
+	uint64_t const *samples;
+	double const *times;
+	uint16_t const *values;
+} subscription_impl_t;
+
+/* claims a free entry of readers, or one whose process is gone; NULL if there is none */
+static fanout_reader_t *claim_reader(fanout_header_t *h) {
+	int32_t self = getpid();
+
+	for (int i = 0; i < FANOUT_MAX_READERS; i++) {
+		fanout_reader_t *r = &h->readers[i];
+		int32_t pid = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+
+		if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) continue;
+		if (__atomic_compare_exchange_n(&r->pid, &pid, self, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+driver_subscription_t *driver_subscribe(char const *name) {
+	subscription_impl_t *sub;
+	fanout_header_t *h;
+	struct stat st;
+	int prot = PROT_READ | PROT_WRITE;
+	int fd, err;
+
+	sub = calloc(1, sizeof(subscription_impl_t));
+	if (sub == NULL) {
+		return NULL;  // errno is ENOMEM
+	}
+	fd = shm_open(name != NULL ? name : DRIVER_DEFAULT_FANOUT, O_RDWR, 0);
+	if (fd < 0 && errno == EACCES) {
+		prot = PROT_READ;
+		fd = shm_open(name != NULL ? name : DRIVER_DEFAULT_FANOUT, O_RDONLY, 0);
+	}
+	if (fd < 0) {
+		err = errno;
+		goto fail;
+	}
+	err = fstat(fd, &st) < 0 ? errno : st.st_size < FANOUT_HEADER_SIZE ? EPROTO : 0;
+	if (err != 0) {
+		close(fd);
+		goto fail;
+	}
+	h = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		err = errno;
+		goto fail;
+	}
+	sub->header = h;
+	sub->size = st.st_size;
+	if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == 0 || memcmp(h->magic, FANOUT_MAGIC, sizeof(h->magic)) != 0
+			|| h->version != FANOUT_VERSION || h->size != st.st_size) {
+		err = EPROTO;
+		goto fail;
+	}
+
+	sub->capacity = h->capacity;
+	sub->samples = (uint64_t const *) ((uint8_t const *) h + h->samples_offset);
+	sub->times = (double const *) ((uint8_t const *) h + h->times_offset);
+	sub->timestamps = (uint32_t const *) ((uint8_t const *) h + h->timestamps_offset);
+	sub->values = (uint16_t const *) ((uint8_t const *) h + h->values_offset);
+	sub->cursor = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	if (prot & PROT_WRITE) {
+		sub->entry = claim_reader(h);
+		if (sub->entry != NULL) {
+			__atomic_store_n(&sub->entry->cursor, sub->cursor, __ATOMIC_RELAXED);
+			__atomic_store_n(&sub->entry->lapped, 0, __ATOMIC_RELAXED);
+		}
+	}
+	return &sub->pub;
+
+fail:
+	if (sub->header != NULL) munmap(sub->header, sub->size);
+	free(sub);
+	errno = err;
+	return NULL;
+}
+
+int driver_subscription_info(driver_subscription_t *s, driver_subscription_info_t *info) {
+	subscription_impl_t *sub = (subscription_impl_t *) s;
+	fanout_header_t const *h = sub->header;
+
+	memset(info, '\0', sizeof(*info));
+	info->num_channels = h->num_channels;
+	memcpy(info->channels, h->channels, sizeof(info->channels));
+	info->capacity = h->capacity;
+	info->scale = h->scale;
+	return 0;
+}
+
+int driver_subscription_next(driver_subscription_t *s, int max_readings, int timeout_ms, driver_view_t *view) {
+	subscription_impl_t *sub = (subscription_impl_t *) s;
+	fanout_header_t const *h = sub->header;
+	double deadline = timeout_ms > 0 ? monotonic_now() + timeout_ms / 1000.0 : 0;
+	uint64_t head, reserve, count;
+
+	if (max_readings <= 0) return -EINVAL;
+	while ((head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE)) <= sub->cursor) {
+		if (!fanout_alive(h)) return -EPIPE;
+		if (timeout_ms == 0 || (timeout_ms > 0 && monotonic_now() >= deadline)) return -ETIMEDOUT;
+		sleep_ns(SHM_POLL_NS);
+	}
+
+	view->lapped = 0;
+	reserve = __atomic_load_n(&h->reserve, __ATOMIC_ACQUIRE);
+	if (reserve > sub->capacity && sub->cursor < reserve - sub->capacity) {
+		view->lapped = reserve - sub->capacity - sub->cursor;
+		sub->cursor = reserve - sub->capacity;
+		sub->lapped += view->lapped;
+	}
+	count = head - sub->cursor;
+	if (count > max_readings) count = max_readings;
+	if (count > sub->capacity - (sub->cursor & (sub->capacity - 1))) {
+		count = sub->capacity - (sub->cursor & (sub->capacity - 1));  // views do not wrap
+	}
+
+	view->position = sub->cursor;
+	view->count = count;
+	view->timestamps = sub->timestamps + (sub->cursor & (sub->capacity - 1));
+	view->samples = (unsigned long long const *) sub->samples + (sub->cursor & (sub->capacity - 1));
+	view->times = sub->times + (sub->cursor & (sub->capacity - 1));
+	view->values = sub->values + (sub->cursor & (sub->capacity - 1)) * h->num_channels;
+	sub->cursor += count;
+	if (sub->entry != NULL) {
+		__atomic_store_n(&sub->entry->cursor, sub->cursor, __ATOMIC_RELAXED);
+		__atomic_store_n(&sub->entry->lapped, sub->lapped, __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+int driver_subscription_check(driver_subscription_t *s, driver_view_t const *view) {
+	subscription_impl_t *sub = (subscription_impl_t *) s;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);  // what was read from the view comes before reserve
+	if (__atomic_load_n(&sub->header->reserve, __ATOMIC_RELAXED) > view->position + sub->capacity) {
+		return -ESTALE;
+	}
+	return 0;
+}
+
+void driver_unsubscribe(driver_subscription_t *s) {
+	subscription_impl_t *sub = (subscription_impl_t *) s;
+
+	if (sub == NULL) return;
+	if (sub->entry != NULL) {
+		__atomic_store_n(&sub->entry->pid, 0, __ATOMIC_RELEASE);
+	}
+	munmap(sub->header, sub->size);
+	free(sub);
+}
+
+int driver_stop(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	command_t command;
+	int result = 0;
+
+	if (pdriver->dev < 0) return 0;  // nothing to do
+
+	driver_record_stop(drv);
+	driver_publish_stop(drv);
+	stop_reader(pdriver);
+
+	command.magic = COMMAND_MAGIC;
+	command.command = COMMAND_STOP;
+
+	if (write(pdriver->dev, &command, sizeof(command)) != sizeof(command)) {
+		result = -EIO;
+	}
+
+	close(pdriver->dev);
+	if (pdriver->shm != NULL) {
+		munmap(pdriver->shm, sizeof(shm_t));
+		pdriver->shm = NULL;
+	}
+
+	pdriver->dev = -1;
+
+	return result;
+}
+
+int driver_close(driver_t *drv) {
+	driver_impl_t *pdriver = (driver_impl_t *) drv;
+	int result;
+
+	if (pdriver == NULL) return 0;
+
+	result = driver_stop(drv);
+	free(pdriver->buffer);
+	free(pdriver->decoded);
+	free(pdriver->calibration);
+	free(pdriver->carry);
+	free(pdriver->carry_timestamps);
+	free_recorder(pdriver->recorder);
+	free_publisher(pdriver->publisher);
+	free(pdriver);
+
+	return result;
 }
@@ -10,14 +10,586 @@ typedef struct {
     unsigned char eye[8];
 } driver_t;
 
+#define DRIVER_DEFAULT_DEVICE "/dev/rpmsg_pru30"
+
+/*
+ * Layout of values returned by driver_read, driver_read_raw and driver_read_many:
+ *   DRIVER_LAYOUT_INTERLEAVED - [ch0_0, ch1_0, ..., ch0_1, ch1_1, ...]
+ *   DRIVER_LAYOUT_PLANAR      - [ch0_0, ch0_1, ..., ch1_0, ch1_1, ...], i.e. each channel
+ *                               is a contiguous block of driver_max_records() values
+ */
+#define DRIVER_LAYOUT_INTERLEAVED 0
+#define DRIVER_LAYOUT_PLANAR 1
+
+/*
+ * Error handling: functions returning int return 0 (or a count, where documented)
+ * on success, and a negative errno value on failure, e.g. -EBADF after driver_stop,
+ * -EPROTO if message from PRU has unexpected size. Use strerror(-result) to print it.
+ *
+ * Each driver_start() returns a separate handle with its own buffers, so several
+ * captures (e.g. PRU and emulator) can run in one process. One handle must not be
+ * used from several threads at once.
+ */
+
+/*
+ * Wire format of data buffers, see src/wire.h:
+ *   DRIVER_FORMAT_PLAIN        - 16-bit values, 32-bit timestamps
+ *   DRIVER_FORMAT_PACKED       - 12-bit values, timestamps as base + 8-bit deltas
+ *   DRIVER_FORMAT_PACKED_FIXED - 12-bit values, timestamps are all equal to the first one
+ *                                of the buffer (PRU guarantees they are within ts_jitter)
+ * Packed formats carry 50-140% more readings per message (fewer messages, interrupts,
+ * and ACKs), but buffers are sent early when a timestamp does not fit, so the number
+ * of readings per buffer varies.
+ */
+#define DRIVER_FORMAT_PLAIN 0
+#define DRIVER_FORMAT_PACKED 1
+#define DRIVER_FORMAT_PACKED_FIXED 2
+
+/*
+ * ADC sequencer mode:
+ *   DRIVER_ADC_ONESHOT    - PRU triggers every reading, sample_rate or target_delay
+ *                           paces them
+ *   DRIVER_ADC_CONTINUOUS - ADC converts requested channels back to back on its own, PRU
+ *                           drains them from FIFO. Fastest; rate is set by clk_div and
+ *                           step_avg, sample_rate and target_delay are ignored.
+ *
+ * sample_rate triggers readings on a fixed grid of the PRU IEP timer (see
+ * src/pacer.h): the long-run rate is exact, and timestamps add up to true time.
+ * target_delay instead waits that many cycles after a reading is taken, before
+ * the next one is triggered, so the time the reading itself takes adds to it.
+ * Deadlines that pass while the ADC is still busy (rate too high for clk_div,
+ * step_avg, and channels) are skipped; telemetry counts them, and how late
+ * triggers came (driver_status).
+ */
+#define DRIVER_ADC_ONESHOT 0
+#define DRIVER_ADC_CONTINUOUS 1
+
+/*
+ * How data buffers reach the driver (commands always go through device):
+ *   DRIVER_TRANSPORT_RPMSG - PRU sends them over rpmsg, driver read()s and acknowledges them
+ *   DRIVER_TRANSPORT_SHM   - driver maps PRU ring (see src/shm.h) and reads buffers in
+ *                            place, no syscalls or copies per message. Has no interrupt:
+ *                            blocking reads sleep and check again every 200us.
+ *                            Mapping comes from shm_path: /dev/mem (needs root) at the
+ *                            PRU shared RAM address, or a regular file (emulator -m).
+ */
+#define DRIVER_TRANSPORT_RPMSG 0
+#define DRIVER_TRANSPORT_SHM 1
+
+#define DRIVER_DEFAULT_SHM "/dev/mem"
+
+/*
+ * Trigger capture (see src/trigger.h). PRU keeps readings to itself until a watched
+ * channel meets its threshold, then sends pre_trigger readings before that one, the
+ * one itself, and post_trigger readings after it. Firing again within the window
+ * extends it. Gaps between windows are not reported as dropped: driver_timing()
+ * gives the sample index of each message instead, and a message never spans two
+ * windows.
+ *   DRIVER_TRIGGER_LEVEL - fires on readings at/above (rising) or at/below (falling) threshold
+ *   DRIVER_TRIGGER_EDGE  - fires on readings that cross the threshold in that direction
+ * pre_trigger can be up to driver_max_pre_trigger(num_channels) readings. History
+ * goes out in one burst, PRU ring needs room for it to avoid drops.
+ */
+#define DRIVER_TRIGGER_NONE 0
+#define DRIVER_TRIGGER_LEVEL 1
+#define DRIVER_TRIGGER_EDGE 2
+
+extern int driver_max_pre_trigger(unsigned int num_channels);
+
+/*
+ * Per-channel averaging and rates. channels[i] is averaged over 2^channel_avg[i]
+ * samples, or 2^step_avg if that is more. With channel_divisor[i] above 1 it is
+ * converted only on every divisor-th reading (readings count from 0 at start,
+ * dropped ones included, see driver_timing), so a slow channel takes neither
+ * conversion time nor message space on the others. At least one channel must
+ * have divisor 0 or 1, it sets the pace. Does not go with decimation or trigger.
+ *
+ * Reads still return num_channels values per reading: a channel that was not
+ * converted repeats its last value. channels[i] is fresh on reading s if
+ * s % channel_divisor[i] == 0. Messages hold a varying number of readings, up to
+ * driver_config_max_records().
+ */
+
+/*
+ * Capture parameters for driver_open. Zero-initialized config is valid: plain format,
+ * interleaved layout, default device, one-shot ADC at full speed without averaging.
+ */
+typedef struct {
+    char const *device;          // path to rpmsg device or emulator socket, NULL - DRIVER_DEFAULT_DEVICE
+    unsigned int clk_div;        // ADC clock divider, 0 - fastest
+    unsigned int step_avg;       // average over 2^step_avg samples
+    unsigned int num_channels;   // 1-8
+    unsigned char channels[8];   // AIN channels to capture, first num_channels are used
+    unsigned int max_num;        // if non-zero, limits the number of readings per buffer
+    unsigned int target_delay;   // if non-zero, target number of PRU cycles between readings
+    unsigned int layout;         // DRIVER_LAYOUT_*
+    unsigned int format;         // DRIVER_FORMAT_*
+    unsigned int ts_jitter;      // DRIVER_FORMAT_PACKED_FIXED: max timestamp deviation, PRU cycles
+    unsigned int adc_mode;       // DRIVER_ADC_*
+    unsigned int ring_depth;     // PRU ring buffers, 0 - default (8), at most 24
+    unsigned int transport;      // DRIVER_TRANSPORT_*
+    char const *shm_path;        // DRIVER_TRANSPORT_SHM: what to map, NULL - DRIVER_DEFAULT_SHM
+    unsigned int decimate_factor; // PRU averages this many ADC readings per record, 0 or 1 - off
+    unsigned int decimate_order;  // 0 or 1 - boxcar, 2..3 - CIC; factor^order must not exceed 2^20
+    unsigned int trigger_mode;   // DRIVER_TRIGGER_*
+    unsigned int trigger_channels;  // bit i - channels[i] is watched
+    unsigned int trigger_rising;    // bit i - channels[i] fires on rising values, falling otherwise
+    unsigned short trigger_threshold[8];  // ADC counts, in channels order
+    unsigned int pre_trigger;    // readings before the one that fired
+    unsigned int post_trigger;   // readings after it, less than 65535
+    unsigned char channel_avg[8];      // in channels order, 0 - step_avg
+    unsigned short channel_divisor[8]; // in channels order, 0 or 1 - every reading
+    unsigned int sample_rate;    // readings per second on a timer schedule, 0 - target_delay paces them
+    unsigned int summary_window; // readings per summary, 0 - off (see driver_read_summary)
+} driver_config_t;
+
+/*
+ * Opens the device and asks PRU to start capturing. Returns a handle that has
+ * to be released with driver_close(), or NULL with errno set.
+ */
+extern driver_t *driver_open(driver_config_t const *config);
+
+/*
+ * Same as driver_open with DRIVER_FORMAT_PLAIN.
+ *
+ * device - path to rpmsg character device, or to the unix socket of PRU emulator.
+ *          NULL selects DRIVER_DEFAULT_DEVICE.
+ * layout - DRIVER_LAYOUT_INTERLEAVED or DRIVER_LAYOUT_PLANAR
+ */
 extern driver_t *driver_start(
+   char const *device,
    unsigned int clk_div, unsigned int step_avg,
    unsigned int num_channels, unsigned char const *channels,
-   unsigned int max_num, unsigned int target_delay);
+   unsigned int max_num, unsigned int target_delay,
+   unsigned int layout);
 
+/*
+ * All driver_read functions return the number of readings in the buffer (at most
+ * driver_max_records(), always equal to it with DRIVER_FORMAT_PLAIN), or a negative
+ * errno value. Output buffers must have room for driver_max_records() readings.
+ */
 extern int driver_read(driver_t *drv, int *num_dropped, unsigned int *timestamps, float *values);
+
+/*
+ * Same as driver_read, but values are raw 12-bit ADC counts (0..4095), not volts.
+ * Multiply by driver_scale() to get volts.
+ */
+extern int driver_read_raw(driver_t *drv, int *num_dropped, unsigned int *timestamps, unsigned short *values);
+extern double driver_scale(void);
+
+/*
+ * Per-channel calibration of float reads (driver_read, driver_read_channels,
+ * driver_read_block and their variants). Each channel converts through a table
+ * of 4096 floats indexed by the ADC count, looked up in the same pass that
+ * unpacks the message, so offset/gain correction or sensor linearization cost
+ * no more than the default scale. channel is the index in channels of the config
+ * (0..num_channels-1), not the AIN number.
+ *
+ * driver_set_calibration copies table (NULL sets the channel back to
+ * driver_scale()). driver_set_calibration_linear fills the table with
+ * count * driver_scale() * gain + offset. Channels not set keep driver_scale().
+ * driver_clear_calibration drops all tables. Raw reads are not affected. Returns
+ * 0, -EINVAL for a bad channel, -ENOMEM. Call between reads, not during one in
+ * another thread.
+ */
+extern int driver_set_calibration(driver_t *drv, unsigned int channel, float const *table);
+extern int driver_set_calibration_linear(driver_t *drv, unsigned int channel, double gain, double offset);
+extern void driver_clear_calibration(driver_t *drv);
+
+/*
+ * Same as driver_read and driver_read_raw, but values of channel j go to channels[j],
+ * regardless of the layout requested in driver_start. Each channels[j] must have room
+ * for driver_max_records() values.
+ */
+extern int driver_read_channels(driver_t *drv, int *num_dropped, unsigned int *timestamps, float *const *channels);
+extern int driver_read_channels_raw(driver_t *drv, int *num_dropped, unsigned int *timestamps, unsigned short *const *channels);
+
+/*
+ * Non-blocking reads, for event loops. driver_try_read* are driver_read* that
+ * return -EAGAIN instead of blocking when no message is there yet.
+ *
+ * driver_fileno() returns a descriptor to poll for POLLIN: the device, or the
+ * reader thread's eventfd once driver_start_reader() was called (so ask again
+ * after starting it). DRIVER_TRANSPORT_SHM has no interrupt to wait for: without
+ * the reader thread there is no descriptor, and -EOPNOTSUPP is returned.
+ *
+ * Poll it level-triggered (as select, poll, and asyncio's add_reader do): it stays
+ * readable while messages are waiting, and a wakeup may still find nothing (e.g.
+ * when only a COMMAND_STATUS answer came in). Do not read the descriptor yourself.
+ */
+extern int driver_fileno(driver_t *drv);
+extern int driver_try_read(driver_t *drv, int *num_dropped, unsigned int *timestamps, float *values);
+extern int driver_try_read_raw(driver_t *drv, int *num_dropped, unsigned int *timestamps, unsigned short *values);
+extern int driver_try_read_channels(driver_t *drv, int *num_dropped, unsigned int *timestamps, float *const *channels);
+extern int driver_try_read_channels_raw(driver_t *drv, int *num_dropped, unsigned int *timestamps, unsigned short *const *channels);
+
+/*
+ * Summary mode (summary_window of the config, see src/summary.h). PRU keeps min,
+ * max, sum, and sum of squares of every channel over summary_window readings (after
+ * decimation), up to 2^20 of them, and sends one summary per window instead of the
+ * readings: the ADC keeps its full rate while messages, ACKs, and host work drop by
+ * the window. Summaries cover whole readings, so it does not go with trigger or
+ * channel_divisor.
+ *
+ * driver_read_summary() returns the number of summaries in the next message (at
+ * most driver_config_max_records()) and num_dropped, windows lost for lack of a PRU
+ * ring buffer. Values are ADC counts: mean is sum / count, RMS sqrt(sumsq / count),
+ * multiply by driver_scale() for volts. driver_try_read_summary() returns -EAGAIN
+ * instead of blocking. In summary mode, reads of readings, recording, and publishing
+ * return -EOPNOTSUPP; driver_stats() counts summaries as samples, and the sample
+ * clock (driver_timing) is not kept.
+ */
+typedef struct {
+    unsigned long long cycles;    // PRU cycles since the previous summary
+    unsigned int count;           // readings in the window
+    unsigned short min[8];        // per channel, in channels order
+    unsigned short max[8];
+    unsigned int sum[8];
+    unsigned long long sumsq[8];
+} driver_summary_t;
+
+extern int driver_read_summary(driver_t *drv, int *num_dropped, driver_summary_t *summaries);
+extern int driver_try_read_summary(driver_t *drv, int *num_dropped, driver_summary_t *summaries);
+
+/*
+ * Absolute time of readings.
+ *
+ * Timestamps returned by driver_read and friends are deltas: PRU cycles (5ns)
+ * since the previous reading. Driver integrates them into 64-bit PRU time
+ * ("ticks" since capture start) and sample index, both counting dropped readings
+ * (whose deltas are unknown and assumed to be average). It also keeps a running
+ * linear fit of CLOCK_MONOTONIC at message arrival against PRU time, which maps
+ * ticks to host time.
+ *
+ * All three functions describe the message returned by the last driver_read
+ * (or the last message of driver_read_many), and return -ENODATA before the
+ * first one.
+ */
+typedef struct {
+    unsigned long long first_sample;  // index of the first reading, counting dropped ones
+    unsigned long long first_tick;    // PRU time of the first reading
+    unsigned int num_records;         // number of readings in the message
+    double tick_seconds;              // host seconds per PRU cycle (from the fit)
+    double period;                    // host seconds between readings, averaged since start
+    double first_time;                // CLOCK_MONOTONIC seconds of the first reading
+} driver_timing_t;
+
+extern int driver_timing(driver_t *drv, driver_timing_t *timing);
+
+/*
+ * Converts timestamps returned by the last read into PRU time (ticks) or
+ * CLOCK_MONOTONIC seconds (times). Output must have room for driver_max_records() values.
+ */
+extern int driver_ticks(driver_t *drv, unsigned int const *timestamps, unsigned long long *ticks);
+extern int driver_times(driver_t *drv, unsigned int const *timestamps, double *times);
+
+/*
+ * Reads all messages that are already queued (but no more than max_messages),
+ * blocking only if there are none; after blocking, it returns just the message
+ * that ended the wait. Acknowledges all of them with a single COMMAND_ACK_N.
+ * Messages are stored one after another, each taking driver_max_records()
+ * readings of space whatever its actual count: buffers must have room for
+ * max_messages elements (dropped and counts), max_messages * driver_max_records()
+ * (timestamps), or that times num_channels (values). counts receives the number
+ * of readings in each message, and can be NULL with DRIVER_FORMAT_PLAIN.
+ *
+ * Returns number of messages read, or negative errno value.
+ */
+extern int driver_read_many(driver_t *drv, int max_messages, int *dropped, int *counts,
+		unsigned int *timestamps, float *values);
+
+/*
+ * Reads exactly num_samples readings into caller buffers of any size, going
+ * through as many messages as it takes, unless timeout_ms (negative - no limit)
+ * runs out first. A message that does not fit entirely is split: the rest of it
+ * starts the next driver_read_block (other reads count it as dropped instead).
+ * Values are laid out as configured, except that with DRIVER_LAYOUT_PLANAR
+ * channel j starts at values + j * num_samples.
+ *
+ * Readings missing from the block (dropped, or between trigger windows) are
+ * reported as gaps: gaps[k] says that count readings are missing just before
+ * reading offset of the block. Up to max_gaps of them are stored, block->num_gaps
+ * counts all of them. Sample index of reading i is block->first_sample + i plus
+ * counts of the gaps at or before it.
+ *
+ * Returns number of readings read, less than num_samples on timeout, or negative
+ * errno value if nothing was read. Does not touch Python objects: ctypes lets
+ * other Python threads run for the whole call.
+ */
+typedef struct {
+    unsigned int offset;  // index of the reading the gap comes before
+    unsigned int count;   // readings missing
+} driver_gap_t;
+
+typedef struct {
+    unsigned long long first_sample;  // sample index of the first reading returned
+    unsigned long long dropped;       // readings missing, counts of all gaps added up
+    unsigned int num_gaps;            // gaps in the block, may be more than max_gaps
+} driver_block_t;
+
+extern int driver_read_block(driver_t *drv, int num_samples, int timeout_ms, unsigned int *timestamps,
+		float *values, driver_gap_t *gaps, int max_gaps, driver_block_t *block);
+extern int driver_read_block_raw(driver_t *drv, int num_samples, int timeout_ms, unsigned int *timestamps,
+		unsigned short *values, driver_gap_t *gaps, int max_gaps, driver_block_t *block);
+
+/*
+ * Starts background reader thread. From now on, the thread reads and acknowledges
+ * messages as soon as PRU sends them, and keeps them in a ring of `capacity`
+ * messages (rounded up to a power of two) until consumer calls one of the
+ * driver_read functions. This protects PRU from running out of buffers when
+ * consumer stalls for a while.
+ *
+ * If priority > 0, thread is switched to SCHED_FIFO with that priority. If this is
+ * not permitted, thread keeps running with normal priority (see `realtime` in stats).
+ *
+ * If ring overflows, messages are discarded and their readings are reported
+ * as dropped with the next message.
+ *
+ * Reader thread is stopped by driver_stop. Returns -EBUSY if already started.
+ */
+extern int driver_start_reader(driver_t *drv, unsigned int capacity, int priority);
+
+typedef struct {
+    unsigned int capacity;         // ring size, in messages
+    unsigned int occupancy;        // messages waiting to be read by consumer
+    unsigned int high_water;       // largest occupancy seen
+    unsigned int realtime;         // 1 if thread runs with SCHED_FIFO priority
+    unsigned long long messages;   // messages received by reader thread
+    unsigned long long overflows;  // messages discarded because ring was full
+} driver_reader_stats_t;
+
+/* Returns -ENOENT (and zeroed stats) if reader thread is not running */
+extern int driver_reader_stats(driver_t *drv, driver_reader_stats_t *stats);
+
+/*
+ * PRU side ring. PRU fills ring_depth buffers in turn, and a buffer is in use from
+ * the moment PRU starts filling it until driver acknowledges it. Readings are
+ * dropped when all of them are in use. Every message reports how many were in use
+ * when it was sent, so used close to depth means the host is about to fall behind.
+ * Stats describe the message returned by the last read.
+ */
+typedef struct {
+    unsigned int depth;       // number of buffers
+    unsigned int used;        // buffers in use when the last message was sent
+    unsigned int high_water;  // largest used seen
+} driver_ring_stats_t;
+
+extern int driver_ring_stats(driver_t *drv, driver_ring_stats_t *stats);
+
+/*
+ * Counters of the whole capture, kept from driver_open on. Cheap enough to leave
+ * on: one clock read per message (which timing needs anyway) and one per wait.
+ * Readings can go missing in three places, told apart here:
+ *   dropped - PRU had no free buffer (firmware side, see driver_ring_stats)
+ *   lost    - host discarded them: reader ring overflow (see driver_reader_stats), or
+ *             the rest of a message split by driver_read_block taken by another read
+ *   short_reads - messages rejected as shorter than their readings need (-EPROTO)
+ * A consumer that keeps up spends most of wait_histogram in the higher buckets;
+ * one that falls behind hardly waits at all, and arrival_histogram, time between
+ * messages coming off the device, shows bursts as PRU ring catches up.
+ *
+ * Histogram bucket 0 counts times under 1us, bucket i (1 <= i < last) times in
+ * [2^(i-1), 2^i) us, the last bucket everything longer.
+ */
+#define DRIVER_HISTOGRAM_BUCKETS 24
+
+typedef struct {
+    unsigned long long messages;      // taken from the device (or PRU ring with DRIVER_TRANSPORT_SHM)
+    unsigned long long bytes;         // in those messages
+    unsigned long long samples;       // readings in those messages
+    unsigned long long dropped;       // readings dropped by PRU
+    unsigned long long lost;          // readings discarded by the host
+    unsigned long long short_reads;   // malformed messages
+    unsigned long long ack_failures;  // acknowledgements that could not be sent
+    unsigned long long wait_histogram[DRIVER_HISTOGRAM_BUCKETS];     // consumer blocked in a read
+    unsigned long long arrival_histogram[DRIVER_HISTOGRAM_BUCKETS];  // between consecutive messages
+} driver_stats_t;
+
+extern int driver_stats(driver_t *drv, driver_stats_t *stats);
+
+/*
+ * Firmware telemetry (src/telemetry.h): counters and cycle stats PRU keeps since
+ * START. driver_request_status() asks for them; PRU answers in between data
+ * messages, and whichever read comes across the answer sets it aside: the reader
+ * thread, or without it the next driver_read*. With DRIVER_TRANSPORT_SHM
+ * driver_status() picks it up from the device itself. driver_status() returns
+ * the latest answer, -ENODATA if none came yet; sequence tells a fresh one from
+ * the one before. Cycle stats are in PRU cycles (5ns).
+ */
+typedef struct {
+    unsigned int count;
+    unsigned int min;
+    unsigned int max;
+    unsigned long long total;
+} driver_cycle_stat_t;
+
+typedef struct {
+    unsigned int sequence;        // number of answers received so far
+    unsigned int readings;        // ADC readings, before decimation
+    unsigned int buffers;         // buffers sent
+    unsigned int send_failures;   // sends refused by the transport (retried, so nothing lost)
+    unsigned int dropped;         // readings dropped for lack of a free PRU buffer
+    driver_cycle_stat_t loop;     // one pass of the firmware main loop
+    driver_cycle_stat_t capture;  // handling of one reading
+    driver_cycle_stat_t io_send;  // one successful send
+    driver_cycle_stat_t latency;  // first reading of a buffer to the buffer being sent
+    unsigned int missed;          // sample_rate: deadlines skipped
+    driver_cycle_stat_t jitter;   // sample_rate: ADC trigger after its deadline
+} driver_status_t;
+
+extern int driver_request_status(driver_t *drv);
+extern int driver_status(driver_t *drv, driver_status_t *status);
+
+/*
+ * Recording to disk. driver_record_start() starts the background reader (if not
+ * started yet, with reader_capacity messages) and a recorder thread, which takes
+ * messages from the reader ring, gathers them into blocks of block_size bytes,
+ * and writes each block to disk with one aligned write. Segment files of
+ * segment_size bytes are preallocated and rotated: with max_segments, only the
+ * latest that many are kept. Reader ring absorbs disk stalls, readings are dropped
+ * only if it overflows. Layout of the files is described in src/record.h.
+ *
+ * While recording, the handle belongs to the recorder: reads return -EBUSY.
+ * driver_record_stop() writes out what is left and closes the last segment, and
+ * is called by driver_stop() too. The reader thread keeps running.
+ */
+#define DRIVER_RECORD_RAW 0      // messages as PRU sent them, smallest
+#define DRIVER_RECORD_DECODED 1  // plain records [ts32, v0, ..., vN-1], whatever the wire format
+
+typedef struct {
+    char const *path;                 // segments are path.000000, path.000001, ...
+    unsigned int kind;                // DRIVER_RECORD_*
+    unsigned long long segment_size;  // bytes per segment file, 0 - 64MB
+    unsigned int max_segments;        // keep only the latest this many segments, 0 - all
+    unsigned int block_size;          // bytes per write, multiple of 4096, 0 - 1MB
+    unsigned int reader_capacity;     // messages, if reader thread has to be started; 0 - 4096
+} driver_record_config_t;
+
+extern int driver_record_start(driver_t *drv, driver_record_config_t const *config);
+extern int driver_record_stop(driver_t *drv);
+
+typedef struct {
+    unsigned long long messages;   // messages recorded
+    unsigned long long readings;   // readings recorded
+    unsigned long long dropped;    // readings dropped, by PRU or by reader ring
+    unsigned long long bytes;      // bytes written to disk
+    unsigned int segments;         // segment files opened
+    unsigned int recording;        // 1 until driver_record_stop() or an error
+    int error;                     // errno value that stopped the recorder, 0 if none
+} driver_record_stats_t;
+
+/* Returns -ENOENT (and zeroed stats) if recording was never started */
+extern int driver_record_stats(driver_t *drv, driver_record_stats_t *stats);
+
+/*
+ * Fan-out to other processes. Only one process can own the device; to share a
+ * capture, it publishes. driver_publish_start() starts the background reader (if
+ * not started yet, with reader_capacity messages) and a publisher thread, which
+ * decodes every message and appends its readings to a POSIX shared memory ring
+ * (shm_open name, e.g. "/bbb_adc"), laid out as described in src/fanout.h. Any
+ * number of processes take readings from it in place with driver_subscribe().
+ * The publisher never waits for them: a subscriber that falls more than capacity
+ * readings behind is told how many it lost.
+ *
+ * Like recording, publishing owns the handle: reads return -EBUSY, and recording
+ * does not go with it (record from a subscriber instead). Returns -EADDRINUSE if
+ * a live publisher has the name already. driver_publish_stop() marks the ring
+ * stopped and removes the name, and is called by driver_stop() too.
+ */
+#define DRIVER_DEFAULT_FANOUT "/bbb_adc"
+
+typedef struct {
+    char const *name;                 // shm_open name, NULL - DRIVER_DEFAULT_FANOUT
+    unsigned int capacity;            // readings in the ring, rounded up to a power of 2; 0 - 262144
+    unsigned int reader_capacity;     // messages, if reader thread has to be started; 0 - 4096
+} driver_publish_config_t;
+
+extern int driver_publish_start(driver_t *drv, driver_publish_config_t const *config);
+extern int driver_publish_stop(driver_t *drv);
+
+typedef struct {
+    unsigned long long messages;      // messages published
+    unsigned long long readings;      // readings published
+    unsigned long long dropped;       // readings dropped, by PRU or by reader ring
+    unsigned int subscribers;         // attached now (read-only ones are not seen)
+    unsigned long long max_lag;       // readings the slowest of them has yet to take
+    unsigned long long lapped;        // readings they lost to the ring, added up
+    unsigned int publishing;          // 1 until driver_publish_stop() or an error
+    int error;                        // errno value that stopped the publisher, 0 if none
+} driver_publish_stats_t;
+
+/* Returns -ENOENT (and zeroed stats) if publishing was never started */
+extern int driver_publish_stats(driver_t *drv, driver_publish_stats_t *stats);
+
+/*
+ * Subscribing to a published capture, from any process. driver_subscribe()
+ * maps the ring and starts with the readings published from then on. Returns
+ * NULL with errno set: ENOENT if nothing is published under name (NULL -
+ * DRIVER_DEFAULT_FANOUT), EPROTO if it is not a ring of this version. Memory that
+ * may not be written is mapped read-only; such a subscriber works the same, but
+ * does not show in publisher stats. One subscription must not be used from
+ * several threads at once.
+ *
+ * driver_subscription_next() waits up to timeout_ms (-1 - forever, 0 - not at all)
+ * and describes up to max_readings of the next readings in view. Arrays of the
+ * view point into shared memory, nothing is copied, and they end early at the end
+ * of the ring. Returns the count, -ETIMEDOUT, or -EPIPE once the publisher has
+ * stopped (or died) and every reading was taken. view->lapped is the number of
+ * readings the ring overwrote before this subscriber got to them, missing just
+ * before view->position. The next call moves on past the view.
+ *
+ * A view stays valid until the publisher laps it, i.e. publishes capacity more
+ * readings. To be sure of what was read from it, copy or process first, then call
+ * driver_subscription_check(): 0 if the view was intact all along, -ESTALE if
+ * some of it may have been overwritten meanwhile.
+ */
+typedef struct {
+    unsigned char eye[8];
+} driver_subscription_t;
+
+typedef struct {
+    unsigned long long position;       // of the first reading, counting from 0 when publishing started
+    unsigned long long lapped;         // readings lost just before this view
+    unsigned int count;                // readings in the view
+    unsigned int const *timestamps;    // PRU cycles since the previous reading, as driver_read
+    unsigned long long const *samples; // sample index of each reading, dropped ones counted
+    double const *times;               // CLOCK_MONOTONIC seconds of each reading
+    unsigned short const *values;      // ADC counts, count * num_channels, interleaved
+} driver_view_t;
+
+typedef struct {
+    unsigned int num_channels;
+    unsigned char channels[8];
+    unsigned int capacity;             // readings in the ring
+    double scale;                      // volts per ADC count
+} driver_subscription_info_t;
+
+extern driver_subscription_t *driver_subscribe(char const *name);
+extern int driver_subscription_info(driver_subscription_t *sub, driver_subscription_info_t *info);
+extern int driver_subscription_next(driver_subscription_t *sub, int max_readings, int timeout_ms,
+        driver_view_t *view);
+extern int driver_subscription_check(driver_subscription_t *sub, driver_view_t const *view);
+extern void driver_unsubscribe(driver_subscription_t *sub);
+
+/*
+ * Asks PRU to stop capturing and closes the device. The handle stays valid
+ * (reads fail with -EBADF) until driver_close().
+ */
 extern int driver_stop(driver_t *drv);
 
+/* Stops capture if still running, and frees the handle. NULL is ignored. */
+extern int driver_close(driver_t *drv);
+
+/* Maximum number of readings per buffer for the given format */
+extern int driver_max_records(unsigned int format, unsigned int num_channels, unsigned int max_num);
+
+/* Same as driver_max_records with DRIVER_FORMAT_PLAIN */
 extern int driver_num_records(unsigned int num_channels, unsigned int max_num);
 
+/*
+ * Maximum number of readings per buffer for the given config: driver_max_records(),
+ * or more when channel_divisor leaves some channels out of most readings
+ */
+extern int driver_config_max_records(driver_config_t const *config);
+
 #endif
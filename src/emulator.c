@@ -0,0 +1,677 @@
+/*
+ * PRU emulator.
+ *
+ * Host-side stand-in for the firmware in src/firmware.c. Listens on a unix
+ * socket (SOCK_SEQPACKET, so that message boundaries are preserved just like with
+ * /dev/rpmsg_pru30) and speaks the same protocol: waits for COMMAND_START,
+ * generates synthetic ADC readings at the requested rate, packs them into
+ * buffer_t messages and sends them out, releasing ring buffers on COMMAND_ACK.
+ * Answers COMMAND_STATUS with telemetry (src/telemetry.h), cycles there being
+ * host time converted to PRU cycles.
+ *
+ * Ring buffer and drop accounting mirror ring_t, send_to_buffer(), and send_summary() from the
+ * firmware, so that driver behaviour under load can be studied without hardware.
+ *
+ * Usage:
+ *     pru_emulator [-v] [-r rate] [-w sine|saw|square|const] [-f freq] [-j jitter] [-m file] socket_path
+ *
+ *     -v       - print per-session statistics to stderr
+ *     -r rate  - number of ADC readings per second. 0 means "as fast as we can".
+ *                If START command has non-zero target_delay, rate is derived from it
+ *                (200MHz PRU clock), like on the real PRU. Continuous ADC mode ignores
+ *                target_delay, like the firmware does. Non-zero sample_rate of START
+ *                sets the rate instead, on the grid of src/pacer.h.
+ *     -w wave  - waveform to generate. Each channel gets its own phase.
+ *     -f freq  - waveform frequency in Hz
+ *     -j cycles - make timestamps vary randomly by up to that many PRU cycles,
+ *                to exercise early flushes of packed formats (see src/wire.h).
+ *                With sample_rate, triggers come late by up to that many cycles
+ *                instead, and it shows as jitter in telemetry.
+ *     -m file  - shared memory for TRANSPORT_SHM (see src/shm.h): file is created and
+ *                mapped, and stands in for PRU shared RAM. Without it, START with
+ *                TRANSPORT_SHM never gets its ring ready.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include "common.h"
+#include "wire.h"
+#include "ring.h"
+#include "shm.h"
+#include "decimate.h"
+#include "trigger.h"
+#include "schedule.h"
+#include "telemetry.h"
+#include "pacer.h"
+#include "summary.h"
+
+#define PRU_CLOCK_HZ 200000000
+#define MAX_SIZE WIRE_MAX_SIZE
+
+/* how many readings to produce at most per one pass of the main loop */
+#define MAX_BURST 64
+
+typedef enum {
+	WAVE_SINE,
+	WAVE_SAW,
+	WAVE_SQUARE,
+	WAVE_CONST,
+} wave_t;
+
+typedef struct {
+	double rate;        // readings per second, 0 - unlimited
+	wave_t wave;
+	double freq;        // waveform frequency
+	uint32_t jitter;    // timestamps vary randomly by up to that many cycles
+	int verbose;
+	shm_t *shm;         // -m file, NULL if not given
+} options_t;
+
+typedef struct {
+	int fd;
+	ring_t ring;
+	uint8_t buffers[RING_MAX_DEPTH][WIRE_MAX_SIZE];
+	uint32_t transport;
+	shm_header_t *shm;
+	uint32_t released;     // TRANSPORT_SHM: host's tail as of the last io_released()
+	decimator_t decimator;
+	trigger_t trigger;
+	uint16_t history[TRIGGER_HISTORY_WORDS];
+	uint64_t index;        // readings passed to capture(), i.e. after decimation
+	schedule_t schedule;
+	summary_t summary;
+	uint16_t num_channels;
+	uint8_t channels[8];
+	uint16_t capacity;     // records per buffer
+	uint32_t format;
+	uint32_t ts_jitter;
+	uint32_t cycles;       // PRU cycles between readings
+	double period;         // seconds between readings, 0 - unlimited
+	pacer_t pacer;         // sample_rate: timer grid, in PRU cycles since START
+	uint64_t count;        // readings generated so far
+	double start;
+
+	/* send_to_buffer() state, see sender_t in firmware.c */
+	buffer_t *b;
+	int offset;
+	int dropped;
+	uint32_t base;
+	int8_t deltas[WIRE_MAX_RECORDS];
+	int indexed;
+	uint64_t b_index;
+	uint64_t next_index;
+	int sparse;
+	uint16_t num_values;
+	uint8_t masks[WIRE_MAX_RECORDS];
+
+	/* statistics */
+	uint64_t sent;
+	uint64_t dropped_total;
+	telemetry_t telemetry;
+} session_t;
+
+static volatile sig_atomic_t done = 0;
+
+static void on_signal(int sig) {
+	done = 1;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* PRU cycles since START, see telemetry_now() in firmware.c */
+static uint32_t telemetry_now(session_t const *s) {
+	return (uint32_t) (uint64_t) ((now() - s->start) * PRU_CLOCK_HZ);
+}
+
+static uint16_t wave_value(options_t const *opt, uint8_t channel, double t) {
+	double phase = opt->freq * t + channel / 8.0;
+	double x;
+
+	phase -= floor(phase);
+	switch (opt->wave) {
+	case WAVE_SINE:
+		x = 0.5 + 0.5 * sin(2 * M_PI * phase);
+		break;
+	case WAVE_SAW:
+		x = phase;
+		break;
+	case WAVE_SQUARE:
+		x = phase < 0.5 ? 1.0 : 0.0;
+		break;
+	default:
+		x = (channel + 1) / 9.0;
+		break;
+	}
+	return (uint16_t) (x * 4095.0 + 0.5);
+}
+
+/* same logic as io_start(), io_released(), and io_send() in firmware.c */
+static void io_start(session_t *s, options_t const *opt, uint32_t transport, uint32_t shm_id) {
+	s->transport = TRANSPORT_RPMSG;
+	if (transport == TRANSPORT_SHM && opt->shm != NULL) {
+		s->transport = TRANSPORT_SHM;
+		s->shm = &opt->shm->header;
+		__atomic_store_n(&s->shm->id, 0, __ATOMIC_RELEASE);
+		s->shm->depth = s->ring.depth;
+		s->shm->slot_size = WIRE_MAX_SIZE;
+		s->shm->head = 0;
+		s->shm->tail = 0;
+		s->released = 0;
+		__atomic_store_n(&s->shm->id, shm_id, __ATOMIC_RELEASE);
+	}
+}
+
+static uint32_t io_released(session_t *s) {
+	uint32_t tail, count;
+
+	if (s->transport != TRANSPORT_SHM) return 0;
+	tail = __atomic_load_n(&s->shm->tail, __ATOMIC_ACQUIRE);
+	count = tail - s->released;
+	s->released = tail;
+	return count;
+}
+
+static int io_send(session_t *s, void *payload, uint16_t len) {
+	if (s->transport == TRANSPORT_SHM) {
+		__atomic_store_n(&s->shm->head, s->shm->head + 1, __ATOMIC_RELEASE);
+		return len;
+	}
+	if (send(s->fd, payload, len, MSG_DONTWAIT) != len) {
+		return 0;
+	}
+	return len;
+}
+
+/* same logic as send_queued(), send_buffer(), send_to_buffer(), and capture() in firmware.c */
+static void send_queued(session_t *s) {
+	buffer_t *b;
+	int size;
+	uint32_t start;
+
+	while ((b = (buffer_t *) ring_next_queued(&s->ring)) != NULL) {
+		size = s->summary.window > 0 ? summary_size(s->num_channels, BUFFER_NUM(b->num))
+				: s->sparse ? wire_sparse_size_of(s->format, (uint8_t *) b)
+				: wire_size(s->format, s->num_channels, BUFFER_NUM(b->num)) + (s->indexed ? WIRE_INDEX_SIZE : 0);
+		b->num = BUFFER_NUM(b->num) | (s->ring.used << 10);
+		start = telemetry_now(s);
+		if (io_send(s, b, size) != size) {
+			s->telemetry.status.send_failures += 1;
+			return;
+		}
+		cycle_stat_add(&s->telemetry.status.io_send, telemetry_now(s) - start);
+		cycle_stat_add(&s->telemetry.status.latency, telemetry_now(s) - s->telemetry.first_time[s->ring.send]);
+		s->telemetry.status.buffers += 1;
+		s->sent += BUFFER_NUM(b->num);
+		ring_sent(&s->ring);
+	}
+}
+
+static void send_buffer(session_t *s) {
+	buffer_t *b = s->b;
+
+	if (s->sparse) {
+		uint8_t *end = ((uint8_t *) b) + wire_sparse_size(s->format, b->num, s->num_values);
+		b->data[0] = s->num_values;
+		if (s->format == FORMAT_PACKED) {
+			memcpy(end - 2 * b->num, s->masks, b->num);
+			memcpy(end - b->num, s->deltas, b->num);
+		} else if (s->format == FORMAT_PACKED_FIXED) {
+			memcpy(end - b->num, s->masks, b->num);
+		}
+	} else if (s->format == FORMAT_PACKED) {
+		memcpy(((uint8_t *) b) + wire_size(s->format, s->num_channels, b->num) - b->num, s->deltas, b->num);
+	}
+	if (s->indexed) {
+		uint32_t index[2] = { (uint32_t) s->b_index, (uint32_t) (s->b_index >> 32) };
+		memcpy(((uint8_t *) b) + wire_size(s->format, s->num_channels, b->num), index, WIRE_INDEX_SIZE);
+	}
+	ring_queue(&s->ring);
+	s->b = NULL;
+	s->dropped = 0;
+	send_queued(s);
+}
+
+static void send_to_buffer(session_t *s, uint64_t index, uint32_t cycles, uint16_t *values, uint16_t due) {
+	buffer_t *b;
+	int skip = s->sparse ? WIRE_COUNT_SIZE / 2 : 0;
+
+	if (s->format != FORMAT_PLAIN && s->b != NULL && s->b->num > 0
+			&& !wire_delta_fits(s->format, (int32_t) (cycles - s->base), s->ts_jitter)) {
+		send_buffer(s);
+	}
+	if (s->indexed && s->b != NULL && s->b->num > 0 && index != s->next_index) {
+		send_buffer(s);
+	}
+
+	if (s->b == NULL) {
+		uint16_t slot = s->ring.head;
+		s->b = (buffer_t *) ring_allocate(&s->ring);
+		if (s->b == NULL) {
+			// no more buffers!
+			s->dropped += 1;
+			s->dropped_total += 1;
+			s->telemetry.status.dropped += 1;
+			return;
+		}
+		s->telemetry.first_time[slot] = s->telemetry.clock;
+		s->b->num_dropped = s->dropped > 0xffff ? 0xffff : s->dropped;
+		s->b->num = 0;
+		s->offset = skip;
+		s->dropped = 0;
+		s->b_index = index;
+		s->num_values = 0;
+	}
+	b = s->b;
+	s->next_index = index + 1;
+
+	if (s->format == FORMAT_PLAIN) {
+		memcpy(&b->data[s->offset], &cycles, sizeof(uint32_t)); s->offset += 2;
+		if (s->sparse) {
+			b->data[s->offset++] = due;
+			for (int i = 0; i < s->num_channels; i++) {
+				if ((due >> i) & 1) {
+					b->data[s->offset++] = values[i];
+					s->num_values += 1;
+				}
+			}
+		} else {
+			memcpy(&b->data[s->offset], values, sizeof(uint16_t) * s->num_channels); s->offset += s->num_channels;
+		}
+	} else {
+		uint8_t *packed = ((uint8_t *) b) + WIRE_HEADER_SIZE + 2 * skip + WIRE_BASE_SIZE;
+		if (b->num == 0) {
+			s->base = cycles;
+			memcpy(&b->data[skip], &cycles, sizeof(uint32_t));
+		}
+		if (s->sparse) {
+			for (int i = 0; i < s->num_channels; i++) {
+				if ((due >> i) & 1) {
+					wire_put12(packed, s->num_values++, values[i]);
+				}
+			}
+			s->masks[b->num] = due;
+		} else {
+			uint16_t k = b->num * s->num_channels;
+			for (int i = 0; i < s->num_channels; i++) {
+				wire_put12(packed, k + i, values[i]);
+			}
+		}
+		s->deltas[b->num] = (int8_t) (cycles - s->base);
+	}
+	b->num += 1;
+
+	if (b->num >= s->capacity || (s->sparse
+			&& wire_sparse_size(s->format, b->num + 1, s->num_values + s->num_channels) > WIRE_MAX_SIZE)) {
+		send_buffer(s);
+	}
+}
+
+static void send_summary(session_t *s) {
+	if (s->b == NULL) {
+		uint16_t slot = s->ring.head;
+		s->b = (buffer_t *) ring_allocate(&s->ring);
+		if (s->b == NULL) {
+			s->dropped += 1;
+			s->dropped_total += 1;
+			s->telemetry.status.dropped += s->summary.window;
+			return;
+		}
+		s->telemetry.first_time[slot] = s->telemetry.clock;
+		s->b->num_dropped = s->dropped > 0xffff ? 0xffff : s->dropped;
+		s->b->num = 0;
+		s->dropped = 0;
+	}
+
+	summary_put(((uint8_t *) s->b) + summary_size(s->num_channels, s->b->num), &s->summary);
+	s->b->num += 1;
+
+	if (s->b->num >= s->capacity) {
+		send_buffer(s);
+	}
+}
+
+static void capture(session_t *s, uint32_t cycles, uint16_t *values, uint16_t due) {
+	trigger_t *t = &s->trigger;
+	uint64_t index = s->index++;
+
+	if (s->summary.window > 0) {
+		if (summary_push(&s->summary, cycles, values)) {
+			send_summary(s);
+		}
+		return;
+	}
+
+	if (t->mode == TRIGGER_NONE) {
+		send_to_buffer(s, index, cycles, values, due);
+		return;
+	}
+
+	if (trigger_fires(t, values)) {
+		if (t->remaining == 0) {
+			uint16_t n = trigger_history_length(t);
+			for (uint16_t i = 0; i < n; i++) {
+				uint16_t recalled[8];
+				uint32_t recalled_cycles;
+				trigger_recall(t, i, &recalled_cycles, recalled);
+				send_to_buffer(s, index - n + i, recalled_cycles, recalled, due);
+			}
+		}
+		t->remaining = t->post + 1;
+	}
+
+	if (t->remaining == 0) {
+		trigger_remember(t, cycles, values);
+		return;
+	}
+
+	send_to_buffer(s, index, cycles, values, due);
+	t->remaining -= 1;
+	if (t->remaining == 0) {
+		if (s->b != NULL && s->b->num > 0) {
+			send_buffer(s);
+		}
+		t->history_count = 0;
+	}
+}
+
+/* how many more readings fit into the buffer being filled (sparse: at least; summary: readings of its records) */
+static int records_left(session_t const *s) {
+	int num = s->b == NULL ? 0 : s->b->num;
+	int left = 0;
+
+	if (s->summary.window > 0) return (s->capacity - num) * s->summary.window - s->summary.count;
+	if (!s->sparse) return s->capacity - num;
+	while (num + left < s->capacity && wire_sparse_size(s->format, num + left + 1,
+			(s->b == NULL ? 0 : s->num_values) + (left + 1) * s->num_channels) <= WIRE_MAX_SIZE) {
+		left += 1;
+	}
+	return left > 0 ? left : 1;
+}
+
+static void session_start(session_t *s, options_t const *opt, command_start_t const *start) {
+	ring_open(&s->ring, opt->shm != NULL ? opt->shm->slots : s->buffers, start->ring_depth);
+	io_start(s, opt, start->transport, start->shm_id);
+	s->num_channels = start->num_channels > 8 ? 8 : start->num_channels;
+	memcpy(s->channels, start->channels, sizeof(s->channels));
+	s->format = start->format <= FORMAT_PACKED_FIXED ? start->format : FORMAT_PLAIN;
+	s->ts_jitter = start->ts_jitter;
+	s->capacity = start->trigger_mode == TRIGGER_NONE ? wire_capacity(s->format, s->num_channels)
+			: wire_indexed_capacity(s->format, s->num_channels);
+	decimate_open(&s->decimator, start->decimate_factor, start->decimate_order, s->num_channels);
+	trigger_open(&s->trigger, start, s->num_channels, s->history);
+	schedule_open(&s->schedule, start, s->num_channels);
+	if (s->schedule.sparse) {
+		s->capacity = wire_sparse_capacity(s->format, schedule_min_values(&s->schedule));
+	}
+	summary_open(&s->summary, start->trigger_mode == TRIGGER_NONE && !s->schedule.sparse
+			? start->summary_window : 0, s->num_channels);
+	if (s->summary.window > 0) {
+		s->capacity = summary_capacity(s->num_channels);
+		s->format = FORMAT_PLAIN;
+	}
+	s->index = 0;
+	s->indexed = start->trigger_mode != TRIGGER_NONE;
+	s->sparse = s->schedule.sparse;
+	if (start->max_num > 0 && start->max_num < s->capacity) {
+		s->capacity = start->max_num;
+	}
+	pacer_open(&s->pacer, start->adc_mode != ADC_MODE_CONTINUOUS ? start->sample_rate : 0, 0);
+	if (s->pacer.rate > 0) {
+		s->period = 1.0 / s->pacer.rate;
+	} else if (start->target_delay > 0 && start->adc_mode != ADC_MODE_CONTINUOUS) {
+		s->period = (double) start->target_delay / PRU_CLOCK_HZ;
+	} else if (opt->rate > 0) {
+		s->period = 1.0 / opt->rate;
+	} else {
+		s->period = 0;
+	}
+	s->cycles = s->period > 0 ? (uint32_t) (s->period * PRU_CLOCK_HZ) : 0;
+	s->count = 0;
+	s->start = now();
+	s->b = NULL;
+	s->offset = 0;
+	s->dropped = 0;
+	s->sent = 0;
+	s->dropped_total = 0;
+	telemetry_open(&s->telemetry);
+}
+
+/*
+ * Handles commands from the driver. Returns 0 when connection is closed.
+ */
+static int session_recv(session_t *s, options_t const *opt, int *running) {
+	uint8_t recv_buffer[MAX_SIZE];
+	command_t *cmd = (command_t *) recv_buffer;
+	ssize_t len;
+
+	while ((len = recv(s->fd, recv_buffer, sizeof(recv_buffer), MSG_DONTWAIT)) != 0) {
+		if (len < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		if (len < sizeof(command_t) || cmd->magic != COMMAND_MAGIC) {
+			continue;
+		}
+		if (!*running && cmd->command == COMMAND_START && len >= sizeof(command_start_t)) {
+			session_start(s, opt, (command_start_t *) recv_buffer);
+			*running = 1;
+		} else if (*running && cmd->command == COMMAND_ACK) {
+			ring_release(&s->ring, 1);
+		} else if (*running && cmd->command == COMMAND_ACK_N && len >= sizeof(command_ack_n_t)) {
+			ring_release(&s->ring, ((command_ack_n_t *) recv_buffer)->count);
+		} else if (*running && cmd->command == COMMAND_STOP) {
+			*running = 0;
+		} else if (cmd->command == COMMAND_STATUS) {
+			s->telemetry.pending = 1;
+		}
+	}
+	return 0;
+}
+
+static void session_run(int fd, options_t const *opt) {
+	static session_t s;
+	int running = 0;
+
+	memset(&s, '\0', sizeof(s));
+	s.fd = fd;
+	telemetry_open(&s.telemetry);
+
+	while (!done) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		struct timespec timeout = { 0, 0 };
+
+		if ((running && s.ring.queued > 0) || s.telemetry.pending) {
+			pfd.events |= POLLOUT;  // wake up as soon as queued buffers (or status reply) can go
+		}
+
+		if (running && s.period > 0) {
+			/*
+			 * Sleep until the current buffer fills up. Readings are generated in
+			 * bulk, but each message leaves at the same time it would leave the PRU.
+			 */
+			double wait = s.start + (s.count + records_left(&s) * s.decimator.factor) * s.period - now();
+			if (wait > 0) {
+				timeout.tv_sec = (time_t) wait;
+				timeout.tv_nsec = (long) ((wait - timeout.tv_sec) * 1e9);
+			}
+		}
+		if (ppoll(&pfd, 1, running ? &timeout : NULL, NULL) < 0 && errno != EINTR) {
+			break;
+		}
+		if (!session_recv(&s, opt, &running)) {
+			break;
+		}
+		/* status reply goes over the socket whatever the data transport, like rpmsg on PRU */
+		if (s.telemetry.pending && send(fd, &s.telemetry.status, sizeof(status_t), MSG_DONTWAIT) == sizeof(status_t)) {
+			s.telemetry.pending = 0;
+		}
+
+		if (running) {
+			uint64_t due = s.count + MAX_BURST;
+			uint32_t loop_start = telemetry_now(&s);
+
+			ring_release(&s.ring, io_released(&s));
+			send_queued(&s);
+			if (s.period > 0) {
+				uint64_t n = (uint64_t) ((now() - s.start) / s.period);
+				if (n < due) due = n;
+			}
+			while (s.count < due) {
+				uint16_t values[8];
+				uint16_t filtered[8];
+				double t = s.count * (s.period > 0 ? s.period : 1.0 / PRU_CLOCK_HZ);
+				for (int i = 0; i < s.num_channels; i++) {
+					values[i] = wave_value(opt, s.channels[i], t);
+				}
+				uint32_t cycles = s.cycles;
+				if (s.pacer.rate > 0) {
+					/* trigger comes late by up to -j cycles, but never misses its period */
+					uint32_t jitter = opt->jitter < s.pacer.period ? opt->jitter : s.pacer.period - 1;
+					pacer_due(&s.pacer, s.pacer.deadline + (jitter > 0 ? rand() % (jitter + 1) : 0));
+					cycles = s.pacer.interval;
+					cycle_stat_add(&s.telemetry.status.jitter, s.pacer.late);
+					s.telemetry.status.missed = s.pacer.missed;
+				} else if (opt->jitter > 0 && cycles > opt->jitter) {
+					cycles += rand() % (2 * opt->jitter + 1) - opt->jitter;
+				}
+				uint16_t due = schedule_next(&s.schedule);
+				/* readings are generated late and in bulk: clock is when the reading was due */
+				s.telemetry.clock = s.period > 0 ? (uint32_t) (uint64_t) (t * PRU_CLOCK_HZ) : telemetry_now(&s);
+				s.telemetry.status.readings += 1;
+				uint32_t capture_start = telemetry_now(&s);
+				if (s.decimator.factor == 1) {
+					capture(&s, cycles, values, due);
+				} else if (decimate_push(&s.decimator, cycles, values, &cycles, filtered)) {
+					capture(&s, cycles, filtered, due);
+				}
+				cycle_stat_add(&s.telemetry.status.capture, telemetry_now(&s) - capture_start);
+				s.count += 1;
+			}
+			cycle_stat_add(&s.telemetry.status.loop, telemetry_now(&s) - loop_start);
+		}
+	}
+
+	if (opt->verbose && s.count > 0) {
+		fprintf(stderr, "pru_emulator: generated %llu, sent %llu, dropped %llu\n",
+				(unsigned long long) s.count,
+				(unsigned long long) s.sent,
+				(unsigned long long) s.dropped_total);
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: pru_emulator [-v] [-r rate] [-w sine|saw|square|const] [-f freq] [-j jitter] [-m file] socket_path\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	options_t opt = { .rate = 15000, .wave = WAVE_SINE, .freq = 50 };
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	char const *path;
+	char const *shm_path = NULL;
+	int opt_char;
+	int listener;
+
+	while ((opt_char = getopt(argc, argv, "vr:w:f:j:m:")) != -1) {
+		switch (opt_char) {
+		case 'v':
+			opt.verbose = 1;
+			break;
+		case 'r':
+			opt.rate = atof(optarg);
+			break;
+		case 'w':
+			if (strcmp(optarg, "sine") == 0) opt.wave = WAVE_SINE;
+			else if (strcmp(optarg, "saw") == 0) opt.wave = WAVE_SAW;
+			else if (strcmp(optarg, "square") == 0) opt.wave = WAVE_SQUARE;
+			else if (strcmp(optarg, "const") == 0) opt.wave = WAVE_CONST;
+			else usage();
+			break;
+		case 'f':
+			opt.freq = atof(optarg);
+			break;
+		case 'j':
+			opt.jitter = atoi(optarg);
+			break;
+		case 'm':
+			shm_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+	path = argv[optind];
+
+	if (shm_path != NULL) {
+		int fd = open(shm_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, sizeof(shm_t)) < 0) {
+			perror(shm_path);
+			return 1;
+		}
+		opt.shm = mmap(NULL, sizeof(shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (opt.shm == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path is too long: %s\n", path);
+		return 1;
+	}
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (listener < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 1) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	memset(&sa, '\0', sizeof(sa));
+	sa.sa_handler = on_signal;  // no SA_RESTART: we want accept() and ppoll() interrupted
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!done) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			perror("accept");
+			break;
+		}
+		session_run(fd, &opt);
+		close(fd);
+	}
+
+	close(listener);
+	unlink(path);
+	return 0;
+}
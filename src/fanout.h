@@ -0,0 +1,69 @@
+#ifndef __FANOUT_H
+#define __FANOUT_H
+
+/*
+ * Layout of the POSIX shared memory that driver_publish_start() fills with
+ * decoded readings, for any number of processes to read with driver_subscribe().
+ *
+ * The mapping is fanout_header_t, padded to FANOUT_HEADER_SIZE, then four arrays
+ * of capacity entries each (capacity is a power of 2), at the offsets given in
+ * the header:
+ *
+ *   timestamps - uint32_t, PRU cycles since the previous reading (as driver_read)
+ *   samples    - uint64_t, sample index of the reading, dropped ones counted
+ *   times      - double, CLOCK_MONOTONIC seconds of the reading (driver_times)
+ *   values     - uint16_t ADC counts, num_channels per reading, interleaved
+ *
+ * Reading number p (counting from 0 since publishing started) is at p % capacity
+ * of every array. One publisher, no locks: for every message it
+ *
+ *   1. stores reserve = head + n, the readings it is about to overwrite
+ *   2. writes readings head .. head + n - 1
+ *   3. stores head = head + n, readings below head are complete
+ *
+ * The publisher never waits for subscribers. A subscriber keeps its own cursor;
+ * readings below reserve - capacity may already be overwritten, so a cursor that
+ * fell behind that has lapped the ring, and jumps ahead to it. Readings taken in
+ * place are checked against reserve again once the subscriber is done with them.
+ *
+ * Subscribers claim an entry of readers (pid, then cursor and lapped count kept
+ * up to date), so that the publisher can report how far behind each one is. An
+ * entry whose process is gone is taken over. state is FANOUT_STOPPED once the
+ * publisher is done; a new publisher replaces the memory, subscribers of the old
+ * one see it stopped.
+ */
+#define FANOUT_MAGIC "bbbfan01"
+#define FANOUT_VERSION 1
+#define FANOUT_HEADER_SIZE 4096
+#define FANOUT_MAX_READERS 16
+
+#define FANOUT_RUNNING 1
+#define FANOUT_STOPPED 2
+
+typedef struct {
+	int32_t pid;              // 0 - entry is free
+	uint32_t reserved;
+	uint64_t cursor;          // next reading this subscriber takes
+	uint64_t lapped;          // readings overwritten before this subscriber took them
+} fanout_reader_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t state;           // FANOUT_RUNNING or FANOUT_STOPPED
+	int32_t pid;              // publisher
+	uint32_t num_channels;
+	uint8_t channels[8];
+	uint64_t capacity;        // readings, power of 2
+	uint64_t size;            // bytes of the mapping
+	uint64_t timestamps_offset;
+	uint64_t samples_offset;
+	uint64_t times_offset;
+	uint64_t values_offset;
+	double scale;             // volts per ADC count
+	uint64_t reserve __attribute__((aligned(64)));  // readings written or being written
+	uint64_t head __attribute__((aligned(64)));     // readings complete
+	fanout_reader_t readers[FANOUT_MAX_READERS] __attribute__((aligned(64)));
+} fanout_header_t;
+
+#endif
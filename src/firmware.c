@@ -33,14 +33,25 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <pru_cfg.h>
 #include <pru_ctrl.h>
 #include <pru_intc.h>
+#include <pru_iep.h>
 #include <sys_tscAdcSs.h>
 #include <rsc_types.h>
 #include <pru_rpmsg.h>
 #include "firmware_resource_table.h"
 #include "common.h"
+#include "wire.h"
+#include "ring.h"
+#include "shm.h"
+#include "decimate.h"
+#include "trigger.h"
+#include "schedule.h"
+#include "telemetry.h"
+#include "pacer.h"
+#include "summary.h"
 
 volatile register uint32_t __R31;
 
@@ -77,15 +88,29 @@ volatile register uint32_t __R31;
 #define RPMSG_BUF_HEADER_SIZE           16
 #define MAX_SIZE (RPMSG_BUF_SIZE - RPMSG_BUF_HEADER_SIZE)
 
+/*
+ * Ring buffers live in the 12KB shared RAM (see .shared in firmware.cmd), which
+ * fits RING_MAX_DEPTH of them, instead of the 8KB data RAM where stack and
+ * rpmsg state live too. Host can map it, see src/shm.h.
+ */
+#pragma DATA_SECTION(shared, ".shared")
+shm_t shared;
+
 typedef struct {
 	struct pru_rpmsg_transport transport;
 	uint16_t src, dst;
+	uint32_t data_transport;  // TRANSPORT_*, how data buffers are sent
+	volatile shm_header_t *shm;
+	uint32_t released;        // TRANSPORT_SHM: host's tail as of the last io_released()
 } io_t;
 
 io_t *io_open() {
 	static io_t io;
 	volatile uint8_t *status;
 
+	io.data_transport = TRANSPORT_RPMSG;
+	io.shm = &shared.header;
+
 	/* Make sure the Linux drivers are ready for RPMsg communication */
 	status = &resourceTable.rpmsg_vdev.status;
 	while (!(*status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -134,10 +159,47 @@ uint16_t io_recv(io_t *pio, void *buffer) {
 	return 0; // not reachable, makes compiler happy though
 }
 
+/*
+ * Selects transport for data buffers at START. With TRANSPORT_SHM the ring has
+ * to be reset before host is told (by shm_id) that it is ready.
+ */
+void io_start(io_t *pio, uint32_t transport, uint32_t shm_id, uint16_t depth) {
+	pio->data_transport = transport;
+	if (transport == TRANSPORT_SHM) {
+		pio->shm->id = 0;
+		pio->shm->depth = depth;
+		pio->shm->slot_size = WIRE_MAX_SIZE;
+		pio->shm->head = 0;
+		pio->shm->tail = 0;
+		pio->released = 0;
+		pio->shm->id = shm_id;
+	}
+}
+
+/* number of buffers host released since the last call (TRANSPORT_SHM only) */
+uint32_t io_released(io_t *pio) {
+	uint32_t tail, count;
+
+	if (pio->data_transport != TRANSPORT_SHM) return 0;
+	tail = pio->shm->tail;
+	count = tail - pio->released;
+	pio->released = tail;
+	return count;
+}
+
+/*
+ * With TRANSPORT_SHM payload is already in its slot (buffers are sent in ring
+ * order), so sending is just publishing it.
+ */
 uint16_t io_send(io_t *pio, void *payload, uint16_t len) {
 	int16_t rc;
 	if (len == 0) return 0;
 
+	if (pio->data_transport == TRANSPORT_SHM) {
+		pio->shm->head += 1;
+		return len;
+	}
+
 	rc = pru_rpmsg_send(&pio->transport, pio->dst, pio->src, payload, len);
 	if (rc == PRU_RPMSG_SUCCESS) {
 		return len;
@@ -145,6 +207,17 @@ uint16_t io_send(io_t *pio, void *payload, uint16_t len) {
 	return 0;
 }
 
+/*
+ * COMMAND_STATUS reply goes over rpmsg whatever the data transport. Returns 0 if
+ * rpmsg has no room for it now.
+ */
+uint16_t io_send_status(io_t *pio, status_t *status) {
+	if (pru_rpmsg_send(&pio->transport, pio->dst, pio->src, status, sizeof(status_t)) == PRU_RPMSG_SUCCESS) {
+		return sizeof(status_t);
+	}
+	return 0;
+}
+
 void io_close(io_t *pio) {
 	while (pru_rpmsg_channel(RPMSG_NS_DESTROY, &pio->transport, CHAN_NAME,
 			CHAN_DESC, CHAN_PORT) != PRU_RPMSG_SUCCESS) {
@@ -154,20 +227,74 @@ void io_close(io_t *pio) {
 
 typedef struct {
 	uint16_t num_channels;
+	uint8_t channels[8];
 	uint16_t index[8]; 
 	uint16_t value[9];   // extra value is used as a dump
+	uint32_t step_mask;  // STEPENABLE bits of the requested channels only
+	uint16_t num_steps;  // number of bits set in step_mask
+	uint32_t due_mask;   // one-shot: STEPENABLE bits of the channels due on the next reading
+	uint16_t due_steps;  // number of bits set in due_mask
+	uint16_t last_step;  // step id of the last step of a sequence
+	uint16_t continuous;
+	uint16_t state;      // one-shot state machine, see adc_read()
 } adc_t;
 
-adc_t *adc_open(uint16_t clk_div, uint16_t step_avg, uint16_t num_channels, uint8_t *channels) {
+/*
+ * Channel c is converted by step c + 1 (STEPCONFIG<c+1>, STEPENABLE bit c + 1), and
+ * its FIFO words are tagged with step id c. Only steps of the requested channels are
+ * enabled. In continuous mode the sequencer re-runs enabled steps on its own, and
+ * adc_read() only drains FIFO0; in one-shot mode every reading is triggered by
+ * writing STEPENABLE, for the channels due on that reading only (see adc_select).
+ */
+void adc_flush() {
+	uint32_t count = ADC_TSC.FIFO0COUNT;
+	uint32_t data;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		data = ADC_TSC.FIFO0DATA;
+	}
+}
+
+/*
+ * Averaging of channel c (AIN c) is the largest of step_avg and channel_avg of the
+ * requested entries of channel c
+ */
+adc_t *adc_open(uint16_t clk_div, uint16_t step_avg, uint8_t const *channel_avg,
+		uint16_t num_channels, uint8_t *channels, uint16_t continuous) {
 	static adc_t adc;
+	uint16_t mode = continuous ? 1 : 0;
+	uint16_t avg[8];
 	uint16_t i;
 
+	for (i = 0; i < 8; i++) {
+		avg[i] = step_avg;
+	}
+	for (i = 0; i < num_channels; i++) {
+		if (channel_avg[i] > avg[channels[i] & 7]) {
+			avg[channels[i] & 7] = channel_avg[i];
+		}
+	}
+
 	adc.num_channels = num_channels;
+	memcpy(adc.channels, channels, sizeof(adc.channels));
+	adc.step_mask = 0;
+	adc.num_steps = 0;
+	adc.last_step = 0;
+	adc.continuous = continuous;
+	adc.state = 0;
 	for (i = 0; i < 8; i++) {
 		adc.index[i] = 8;  // point to the dump
 	}
 	for (i = 0; i < num_channels; i++) {
 		adc.index[channels[i]] = i;
+		if (!(adc.step_mask & (1 << (channels[i] + 1)))) {
+			adc.num_steps += 1;
+		}
+		adc.step_mask |= 1 << (channels[i] + 1);
+		if (channels[i] > adc.last_step) {
+			adc.last_step = channels[i];
+		}
 	}
 
 	/* set the always on clock domain to NO_SLEEP. Enable ADC_TSC clock */
@@ -185,100 +312,101 @@ adc_t *adc_open(uint16_t clk_div, uint16_t step_avg, uint16_t num_channels, uint
 	ADC_TSC.CTRL_bit.ENABLE = 0;
 	ADC_TSC.CTRL_bit.STEPCONFIG_WRITEPROTECT_N_ACTIVE_LOW = 1;
 	ADC_TSC.ADC_CLKDIV_bit.ADC_CLKDIV = clk_div;
+	ADC_TSC.STEPENABLE = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG1 register for channel 5  
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x0 = Channel 1
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG1_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG1_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG1_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG1_bit.AVERAGING = avg[0];
 	ADC_TSC.STEPCONFIG1_bit.SEL_INP_SWC_3_0 = 0;
 	ADC_TSC.STEPCONFIG1_bit.FIFO_SELECT = 0;
 
 	/*
 	 * set the ADC_TSC STEPCONFIG2 register for channel 6
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x1 = Channel 2
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG2_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG2_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG2_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG2_bit.AVERAGING = avg[1];
 	ADC_TSC.STEPCONFIG2_bit.SEL_INP_SWC_3_0 = 1;
 	ADC_TSC.STEPCONFIG2_bit.FIFO_SELECT = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG3 register for channel 7
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x2 = Channel 3
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG3_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG3_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG3_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG3_bit.AVERAGING = avg[2];
 	ADC_TSC.STEPCONFIG3_bit.SEL_INP_SWC_3_0 = 2;
 	ADC_TSC.STEPCONFIG3_bit.FIFO_SELECT = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG4 register for channel 8
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x3= Channel 4
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG4_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG4_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG4_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG4_bit.AVERAGING = avg[3];
 	ADC_TSC.STEPCONFIG4_bit.SEL_INP_SWC_3_0 = 3;
 	ADC_TSC.STEPCONFIG4_bit.FIFO_SELECT = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG1 register for channel 5  
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x4 = Channel 5
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG5_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG5_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG5_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG5_bit.AVERAGING = avg[4];
 	ADC_TSC.STEPCONFIG5_bit.SEL_INP_SWC_3_0 = 4;
 	ADC_TSC.STEPCONFIG5_bit.FIFO_SELECT = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG1 register for channel 5  
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x5  = Channel 6
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG6_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG6_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG6_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG6_bit.AVERAGING = avg[5];
 	ADC_TSC.STEPCONFIG6_bit.SEL_INP_SWC_3_0 = 5;
 	ADC_TSC.STEPCONFIG6_bit.FIFO_SELECT = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG1 register for channel 5  
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x6 = Channel 7
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG7_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG7_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG7_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG7_bit.AVERAGING = avg[6];
 	ADC_TSC.STEPCONFIG7_bit.SEL_INP_SWC_3_0 = 6;
 	ADC_TSC.STEPCONFIG7_bit.FIFO_SELECT = 0;
 
 	/* 
 	 * set the ADC_TSC STEPCONFIG1 register for channel 5  
-	 * Mode = 0; SW enabled, one-shot
+	 * Mode = 0 or 1; SW enabled, one-shot or continuous
 	 * Averaging = 0x3; 8 sample average
 	 * SEL_INP_SWC_3_0 = 0x7 = Channel 8
 	 * use FIFO0
 	 */
-	ADC_TSC.STEPCONFIG8_bit.MODE = 0;
-	ADC_TSC.STEPCONFIG8_bit.AVERAGING = step_avg;
+	ADC_TSC.STEPCONFIG8_bit.MODE = mode;
+	ADC_TSC.STEPCONFIG8_bit.AVERAGING = avg[7];
 	ADC_TSC.STEPCONFIG8_bit.SEL_INP_SWC_3_0 = 7;
 	ADC_TSC.STEPCONFIG8_bit.FIFO_SELECT = 0;
 
@@ -292,51 +420,111 @@ adc_t *adc_open(uint16_t clk_div, uint16_t step_avg, uint16_t num_channels, uint
 	ADC_TSC.CTRL_bit.STEP_ID_TAG = 1;
 	ADC_TSC.CTRL_bit.ENABLE = 1;
 
+	adc.due_mask = adc.step_mask;
+	adc.due_steps = adc.num_steps;
+
+	if (continuous) {
+		adc_flush();
+		ADC_TSC.STEPENABLE = adc.step_mask;  // sequencer keeps running from now on
+	}
+
 	return &adc;
 }
 
+/*
+ * Selects channels for the next one-shot reading, due bit i - channels[i]. Values
+ * of the others keep what they had. Continuous mode converts all channels anyway.
+ */
+void adc_select(adc_t *padc, uint16_t due) {
+	uint32_t step;
+	uint16_t i;
+
+	padc->due_mask = 0;
+	padc->due_steps = 0;
+	for (i = 0; i < padc->num_channels; i++) {
+		if (!((due >> i) & 1)) continue;
+		step = 1 << (padc->channels[i] + 1);
+		if (!(padc->due_mask & step)) {
+			padc->due_steps += 1;
+		}
+		padc->due_mask |= step;
+	}
+}
+
+void adc_close(adc_t *padc) {
+	ADC_TSC.STEPENABLE = 0;
+	adc_flush();
+}
+
+/*
+ * Continuous mode: takes FIFO0 words as they come, until the last step of the
+ * sequence. Words are placed by their step id, so a sequence that lost words
+ * to FIFO overrun still ends at the right place.
+ */
+uint16_t adc_read_continuous(adc_t *padc, uint16_t *values) {
+	uint32_t data;
+	uint16_t channel;
+
+	while (ADC_TSC.FIFO0COUNT > 0) {
+		data = ADC_TSC.FIFO0DATA;
+		channel = (data >> 16) & 0xf;
+		padc->value[padc->index[channel & 7]] = data & 0xfff;
+		if (channel == padc->last_step) {
+			memcpy(values, padc->value, padc->num_channels * sizeof(uint16_t));
+			return padc->num_channels;
+		}
+	}
+	return 0;
+}
+
+/* sample_rate: when one-shot readings are triggered, by IEP timer (see src/pacer.h) */
+static pacer_t pacer;
+
 uint16_t adc_read(adc_t *padc, uint16_t *values) {
-	static int state = 0;
-	uint32_t count = ADC_TSC.FIFO0COUNT;
 	uint32_t data;
 	uint16_t channel;
 	uint16_t i;
 
-	switch (state) {
+	if (padc->continuous) {
+		return adc_read_continuous(padc, values);
+	}
+
+	switch (padc->state) {
 	case 0:	// prepare
 		/* 
 		* Clear FIFO0 by reading from it
 		* We are using single-shot mode. 
 		* It should not usually enter the for loop
 		*/
-		for (i = 0; i < count; i++) {
-			data = ADC_TSC.FIFO0DATA;
-		}
-		state = 1;
+		adc_flush();
+		padc->state = 1;
 		return 0;
 	
-	case 1: // trigger the capture
-		ADC_TSC.STEPENABLE = 0x1fe;  // enable all 8 capture channels
-		state = 2;
+	case 1: // trigger the capture, when it is due if paced
+		if (pacer.rate > 0 && !pacer_due(&pacer, CT_IEP.TMR_CNT)) {
+			return 0;
+		}
+		ADC_TSC.STEPENABLE = padc->due_mask;  // enable requested (and due) channels only
+		padc->state = 2;
 		return 0;
 	
 	case 2: // wait for fifo0 to populate
 
-		if (ADC_TSC.FIFO0COUNT < 8) {
+		if (ADC_TSC.FIFO0COUNT < padc->due_steps) {
 			return 0;
 		}
 
-		state = 3;
+		padc->state = 3;
 		return 0;
 
-	case 3:  // all 8 channels are ready in fifo0
-		for (i = 0; i < 8; i++) {
+	case 3:  // all requested channels are ready in fifo0
+		for (i = 0; i < padc->due_steps; i++) {
 			data = ADC_TSC.FIFO0DATA;
 			channel = (data >> 16) & 0xf;
-			padc->value[padc->index[channel]] = data & 0xfff;
+			padc->value[padc->index[channel & 7]] = data & 0xfff;
 		}
 		memcpy(values, padc->value, padc->num_channels * sizeof(uint16_t));
-		state = 0;
+		padc->state = 0;
 		return padc->num_channels;
 	}
 
@@ -345,70 +533,267 @@ uint16_t adc_read(adc_t *padc, uint16_t *values) {
 
 uint8_t recv_buffer[MAX_SIZE];
 
+ring_t *ring_get() {
+	static ring_t r;
+	return &r;
+}
+
+/*
+ * State of the buffer being filled by send_to_buffer()
+ */
 typedef struct {
-#define RING_SIZE 8
-	uint16_t available;
-	uint16_t head;
-	uint8_t rings[RING_SIZE][MAX_SIZE];
-} ring_t;
-
-
-void *ring_allocate_buffer(ring_t *ring) {
-	void *p = (void *) ring->rings[ring->head];
-	if (ring->available == 0) return NULL;
-	ring->head = (ring->head + 1) & (RING_SIZE - 1);
-	ring->available -= 1;
-	return p;
+	buffer_t *b;
+	int offset;          // FORMAT_PLAIN: next word in b->data
+	int dropped;
+	uint32_t base;       // packed formats: timestamp of the first record
+	int8_t deltas[WIRE_MAX_RECORDS];  // FORMAT_PACKED: appended to the buffer when complete
+	int indexed;         // trigger capture: buffers carry index of their first record
+	uint64_t index;      // index of the first record of b
+	uint64_t next_index; // index of the record that would continue b
+	int sparse;          // channels have different rates: records hold due channels only
+	uint16_t num_values; // sparse: values in b so far
+	uint8_t masks[WIRE_MAX_RECORDS];  // sparse packed formats: appended to the buffer when complete
+	int summary;         // summary mode: records are window statistics, see src/summary.h
+} sender_t;
+
+static sender_t sender = { NULL, 0, 0, 0 };
+
+static telemetry_t telemetry;
+
+/* PRU cycles since START; CYCLE itself starts over on every reading */
+static inline uint32_t telemetry_now() {
+	return telemetry.clock + PRU0_CTRL.CYCLE;
 }
 
-void ring_release_buffer(ring_t *ring) {
-	ring->available += 1;
+/*
+ * Sends queued buffers, oldest first, until transport refuses one.
+ * Refused buffer stays queued and is retried on the next call.
+ */
+void send_queued(io_t *pio, ring_t *ring, uint16_t num_channels, uint32_t format) {
+	buffer_t *b;
+	int size;
+	uint32_t start;
+
+	while ((b = (buffer_t *) ring_next_queued(ring)) != NULL) {
+		size = sender.summary ? summary_size(num_channels, BUFFER_NUM(b->num))
+				: sender.sparse ? wire_sparse_size_of(format, (uint8_t *) b)
+				: wire_size(format, num_channels, BUFFER_NUM(b->num)) + (sender.indexed ? WIRE_INDEX_SIZE : 0);
+		b->num = BUFFER_NUM(b->num) | (ring->used << 10);
+		start = telemetry_now();
+		if (io_send(pio, b, size) != size) {
+			telemetry.status.send_failures += 1;
+			return;
+		}
+		cycle_stat_add(&telemetry.status.io_send, telemetry_now() - start);
+		cycle_stat_add(&telemetry.status.latency, telemetry_now() - telemetry.first_time[ring->send]);
+		telemetry.status.buffers += 1;
+		ring_sent(ring);
+	}
 }
 
-ring_t *ring_open() {
-	static ring_t r;
-	r.head = 0;
-	r.available = RING_SIZE;
-	return &r;
+/* current buffer is complete: queue it, and try to send */
+void send_buffer(io_t *pio, ring_t *ring, uint16_t num_channels, uint32_t format) {
+	buffer_t *b = sender.b;
+
+	if (sender.sparse) {
+		uint8_t *end = ((uint8_t *) b) + wire_sparse_size(format, b->num, sender.num_values);
+		b->data[0] = sender.num_values;
+		if (format == FORMAT_PACKED) {
+			memcpy(end - 2 * b->num, sender.masks, b->num);
+			memcpy(end - b->num, sender.deltas, b->num);
+		} else if (format == FORMAT_PACKED_FIXED) {
+			memcpy(end - b->num, sender.masks, b->num);
+		}
+	} else if (format == FORMAT_PACKED) {
+		memcpy(((uint8_t *) b) + wire_size(format, num_channels, b->num) - b->num, sender.deltas, b->num);
+	}
+	if (sender.indexed) {
+		uint32_t index[2] = { (uint32_t) sender.index, (uint32_t) (sender.index >> 32) };
+		memcpy(((uint8_t *) b) + wire_size(format, num_channels, b->num), index, WIRE_INDEX_SIZE);
+	}
+	ring_queue(ring);
+	sender.b = NULL;
+	sender.dropped = 0;
+	send_queued(pio, ring, num_channels, format);
 }
 
-void send_to_buffer(io_t *pio, ring_t *ring,
-		uint32_t cycles, uint16_t *values, uint16_t num_channels, uint16_t max_num) {
-	static int offset = 0;
-	static int dropped = 0;
-	static buffer_t *b = NULL;
-	int size;
+/*
+ * Appends one record (reading number index, values of due channels) to the current
+ * buffer, sends the buffer out when it is full (capacity records, see wire_capacity,
+ * or a sparse buffer with no room for another record), or when timestamp can
+ * not be packed into it, or (trigger capture) when the record does not follow the
+ * last one
+ */
+void send_to_buffer(io_t *pio, ring_t *ring, uint64_t index,
+		uint32_t cycles, uint16_t *values, uint16_t due, uint16_t num_channels,
+		uint32_t format, uint32_t ts_jitter, uint16_t capacity) {
+	buffer_t *b;
+	uint16_t skip = sender.sparse ? WIRE_COUNT_SIZE / 2 : 0;  // sparse: num_values comes first
+	uint16_t i;
+
+	if (format != FORMAT_PLAIN && sender.b != NULL && sender.b->num > 0
+			&& !wire_delta_fits(format, (int32_t) (cycles - sender.base), ts_jitter)) {
+		send_buffer(pio, ring, num_channels, format);  // early, with fewer records
+	}
+	if (sender.indexed && sender.b != NULL && sender.b->num > 0 && index != sender.next_index) {
+		send_buffer(pio, ring, num_channels, format);  // buffer holds contiguous readings only
+	}
 
-	if (b == NULL) {
-		b = (buffer_t *) ring_allocate_buffer(ring);
-		if (b == NULL) {
+	if (sender.b == NULL) {
+		uint16_t slot = ring->head;
+		sender.b = (buffer_t *) ring_allocate(ring);
+		if (sender.b == NULL) {
 			// no more buffers!
-			dropped += 1;
+			sender.dropped += 1;
+			telemetry.status.dropped += 1;
 			return;
 		}
-		b->num_dropped = dropped > 0xffff ? 0xffff : dropped;
-		b->num = 0;
-		offset = 0;
-		dropped = 0;
+		telemetry.first_time[slot] = telemetry.clock;  // time of the reading being captured
+		sender.b->num_dropped = sender.dropped > 0xffff ? 0xffff : sender.dropped;
+		sender.b->num = 0;
+		sender.offset = skip;
+		sender.dropped = 0;
+		sender.index = index;
+		sender.num_values = 0;
+	}
+	b = sender.b;
+	sender.next_index = index + 1;
+
+	if (format == FORMAT_PLAIN) {
+		memcpy(&b->data[sender.offset], &cycles, sizeof(uint32_t)); sender.offset += 2;
+		if (sender.sparse) {
+			b->data[sender.offset++] = due;
+			for (i = 0; i < num_channels; i++) {
+				if ((due >> i) & 1) {
+					b->data[sender.offset++] = values[i];
+					sender.num_values += 1;
+				}
+			}
+		} else {
+			memcpy(&b->data[sender.offset], values, sizeof(uint16_t) * num_channels); sender.offset += num_channels;
+		}
+	} else {
+		uint8_t *packed = ((uint8_t *) b) + WIRE_HEADER_SIZE + 2 * skip + WIRE_BASE_SIZE;
+		if (b->num == 0) {
+			sender.base = cycles;
+			memcpy(&b->data[skip], &cycles, sizeof(uint32_t));
+		}
+		if (sender.sparse) {
+			for (i = 0; i < num_channels; i++) {
+				if ((due >> i) & 1) {
+					wire_put12(packed, sender.num_values++, values[i]);
+				}
+			}
+			sender.masks[b->num] = due;
+		} else {
+			uint16_t k = b->num * num_channels;
+			for (i = 0; i < num_channels; i++) {
+				wire_put12(packed, k + i, values[i]);
+			}
+		}
+		sender.deltas[b->num] = (int8_t) (cycles - sender.base);
 	}
-
-	memcpy(&b->data[offset], &cycles, sizeof(uint32_t)); offset += 2;
-	memcpy(&b->data[offset], values, sizeof(uint16_t) * num_channels); offset += num_channels;
 	b->num += 1;
 
-	size = ((uint8_t *) &b->data[offset]) - ((uint8_t *) b);
-	if (size + sizeof(uint16_t) * (2 + num_channels)  > MAX_SIZE
-			|| max_num == b->num) {
+	if (b->num >= capacity || (sender.sparse
+			&& wire_sparse_size(format, b->num + 1, sender.num_values + num_channels) > WIRE_MAX_SIZE)) {
 		// next measurement will not fit here, have to send!
-		if (io_send(pio, b, size) != size) {
-			b->num_dropped = 0xffff; // (b->num + b->num_dropped) > 0xffff ? 0xffff : (b->num + b->num_dropped);
-			b->num = 0;
-			dropped = 0;
-			offset = 0;
-		} else {
-			b = NULL;
-			dropped = 0;
+		send_buffer(pio, ring, num_channels, format);
+	}
+}
+
+/*
+ * Summary mode: appends the record of the window just completed to the current
+ * buffer, and sends the buffer out when it is full (capacity records). A window
+ * with no free ring buffer is dropped whole.
+ */
+void send_summary(io_t *pio, ring_t *ring, summary_t const *s, uint16_t num_channels, uint16_t capacity) {
+	buffer_t *b;
+
+	if (sender.b == NULL) {
+		uint16_t slot = ring->head;
+		sender.b = (buffer_t *) ring_allocate(ring);
+		if (sender.b == NULL) {
+			sender.dropped += 1;
+			telemetry.status.dropped += s->window;
+			return;
+		}
+		telemetry.first_time[slot] = telemetry.clock;
+		sender.b->num_dropped = sender.dropped > 0xffff ? 0xffff : sender.dropped;
+		sender.b->num = 0;
+		sender.dropped = 0;
+	}
+	b = sender.b;
+
+	summary_put(((uint8_t *) b) + summary_size(num_channels, b->num), s);
+	b->num += 1;
+
+	if (b->num >= capacity) {
+		send_buffer(pio, ring, num_channels, FORMAT_PLAIN);
+	}
+}
+
+/* summary mode: statistics of the readings since the last record */
+static summary_t summary;
+
+/*
+ * Pre-trigger history, in the data RAM of PRU1 which we do not use otherwise
+ * (see .history in firmware.cmd)
+ */
+#pragma DATA_SECTION(history, ".history")
+uint16_t history[TRIGGER_HISTORY_WORDS];
+
+/*
+ * Passes reading number index on to send_to_buffer(). In trigger mode, keeps it in
+ * history instead, until the trigger fires (see src/trigger.h). History then goes
+ * out in one burst, so it needs free ring buffers to avoid drops. In summary mode,
+ * only adds it to the statistics of its window.
+ */
+void capture(io_t *pio, ring_t *ring, trigger_t *t, uint64_t index,
+		uint32_t cycles, uint16_t *values, uint16_t due, uint16_t num_channels,
+		uint32_t format, uint32_t ts_jitter, uint16_t capacity) {
+	uint16_t i, n;
+
+	if (summary.window > 0) {
+		if (summary_push(&summary, cycles, values)) {
+			send_summary(pio, ring, &summary, num_channels, capacity);
+		}
+		return;
+	}
+
+	if (t->mode == TRIGGER_NONE) {
+		send_to_buffer(pio, ring, index, cycles, values, due, num_channels, format, ts_jitter, capacity);
+		return;
+	}
+
+	if (trigger_fires(t, values)) {
+		if (t->remaining == 0) {
+			uint16_t recalled[8];
+			uint32_t recalled_cycles;
+
+			n = trigger_history_length(t);
+			for (i = 0; i < n; i++) {
+				trigger_recall(t, i, &recalled_cycles, recalled);
+				send_to_buffer(pio, ring, index - n + i, recalled_cycles, recalled, due,
+						num_channels, format, ts_jitter, capacity);
+			}
+		}
+		t->remaining = t->post + 1;  // this reading, and post more
+	}
+
+	if (t->remaining == 0) {
+		trigger_remember(t, cycles, values);
+		return;
+	}
+
+	send_to_buffer(pio, ring, index, cycles, values, due, num_channels, format, ts_jitter, capacity);
+	t->remaining -= 1;
+	if (t->remaining == 0) {
+		// window is over: send the rest of it now, and start history over
+		if (sender.b != NULL && sender.b->num > 0) {
+			send_buffer(pio, ring, num_channels, format);
 		}
+		t->history_count = 0;
 	}
 }
 
@@ -418,8 +803,16 @@ void main(void) {
 	ring_t *ring;
 	adc_t *padc = NULL;
 	command_t *cmd = (command_t *) recv_buffer;
-	uint16_t max_num = 0;  // if non-zero, limits the buffer size
+	uint16_t capacity = 0;  // records per buffer, limited by max_num if non-zero
 	uint32_t target_delay = 0;  // target number of PRU cycles between captures
+	uint32_t format = FORMAT_PLAIN;
+	uint32_t ts_jitter = 0;
+	uint16_t num_channels = 0;
+	static decimator_t decimator;
+	static trigger_t trigger;
+	static schedule_t schedule;
+	uint16_t due = 0;    // channels due on the reading being taken, see src/schedule.h
+	uint64_t index = 0;  // readings since START, after decimation
 
 	/* 
 	 * Allow OCP master port access by the PRU so the PRU can read 
@@ -432,37 +825,115 @@ void main(void) {
 	 */
   	PRU0_CTRL.CTRL_bit.CTR_EN = 1; // turn on cycle counter
 
+	/*
+	 * IEP timer runs free, counting PRU cycles: it paces readings with
+	 * sample_rate, and is never reset, deadlines are relative
+	 */
+	CT_IEP.TMR_GLB_CFG_bit.DEFAULT_INC = 1;
+	CT_IEP.TMR_GLB_CFG_bit.CNT_EN = 1;
+
 	pio = io_open();
-	ring = ring_open();
+	ring = ring_get();
+	ring_open(ring, shared.slots, RING_DEFAULT_DEPTH);
+	telemetry_open(&telemetry);
 
 	while (1) {
+		uint32_t loop_start = telemetry_now();
 		uint16_t len = io_recv(pio, recv_buffer);
 		if (len >= sizeof(command_t) && cmd->magic == COMMAND_MAGIC) {
 			if (padc == NULL && cmd->command == COMMAND_START) {
 				command_start_t *start = (command_start_t *) recv_buffer;
-				padc = adc_open(start->clk_div, start->step_avg, start->num_channels, start->channels);
-				max_num = start->max_num;
-				target_delay = start->target_delay;
+				padc = adc_open(start->clk_div, start->step_avg, start->channel_avg, start->num_channels,
+						start->channels, start->adc_mode == ADC_MODE_CONTINUOUS);
+				format = start->format;
+				ts_jitter = start->ts_jitter;
+				capacity = start->trigger_mode == TRIGGER_NONE ? wire_capacity(format, start->num_channels)
+						: wire_indexed_capacity(format, start->num_channels);
+				num_channels = start->num_channels;
+				decimate_open(&decimator, start->decimate_factor, start->decimate_order, num_channels);
+				trigger_open(&trigger, start, num_channels, history);
+				schedule_open(&schedule, start, num_channels);
+				if (schedule.sparse) {
+					capacity = wire_sparse_capacity(format, schedule_min_values(&schedule));
+				}
+				/* summaries are of whole readings, not of trigger windows or sparse ones */
+				summary_open(&summary, start->trigger_mode == TRIGGER_NONE && !schedule.sparse
+						? start->summary_window : 0, num_channels);
+				if (summary.window > 0) {
+					capacity = summary_capacity(num_channels);
+					format = FORMAT_PLAIN;  // records have a layout of their own
+				}
+				due = schedule_next(&schedule);
+				adc_select(padc, due);
+				index = 0;
+				ring_open(ring, shared.slots, start->ring_depth);
+				io_start(pio, start->transport, start->shm_id, ring->depth);
+				sender.b = NULL;
+				sender.dropped = 0;
+				sender.indexed = start->trigger_mode != TRIGGER_NONE;
+				sender.sparse = schedule.sparse;
+				sender.summary = summary.window > 0;
+				if (start->max_num > 0 && start->max_num < capacity) {
+					capacity = start->max_num;
+				}
+				/* continuous ADC sets its own pace, waiting would overrun FIFO0 */
+				target_delay = start->adc_mode == ADC_MODE_CONTINUOUS ? 0 : start->target_delay;
+				pacer_open(&pacer, start->adc_mode == ADC_MODE_CONTINUOUS ? 0 : start->sample_rate, CT_IEP.TMR_CNT);
+				if (pacer.rate > 0) {
+					target_delay = 0;
+				}
+				telemetry_open(&telemetry);
 				PRU0_CTRL.CYCLE = 0;
+				loop_start = 0;
 			} else if (padc != NULL && cmd->command == COMMAND_ACK) {
-				ring_release_buffer(ring);  // CPU acknowledged receiving data buffer
+				ring_release(ring, 1);  // CPU acknowledged receiving data buffer
+			} else if (padc != NULL && cmd->command == COMMAND_ACK_N && len >= sizeof(command_ack_n_t)) {
+				command_ack_n_t *ack = (command_ack_n_t *) recv_buffer;
+				ring_release(ring, ack->count);  // CPU acknowledged several buffers at once
 			} else if (padc != NULL && cmd->command == COMMAND_STOP) {
+				adc_close(padc);
 				padc = NULL;
+			} else if (cmd->command == COMMAND_STATUS) {
+				telemetry.pending = 1;
 			}
 		}
+		if (telemetry.pending && io_send_status(pio, &telemetry.status) > 0) {
+			telemetry.pending = 0;
+		}
 
 		if (padc != NULL) {
 			uint16_t values[8];
+			uint16_t filtered[8];
+
+			ring_release(ring, io_released(pio));  // TRANSPORT_SHM: host acknowledges by moving tail
+			send_queued(pio, ring, num_channels, format);  // retry what transport refused before
 			uint16_t len = adc_read(padc, values);
 			if (len > 0) {
 				// assert (len == padc->num_channels);
 				uint32_t cycles = PRU0_CTRL.CYCLE;
+				uint32_t capture_start;
 				while (cycles < target_delay) {
 				        cycles = PRU0_CTRL.CYCLE;
                                 }
 				PRU0_CTRL.CYCLE = 0;
-				send_to_buffer(pio, ring, cycles, values, len, max_num);
+				telemetry.clock += cycles;
+				telemetry.status.readings += 1;
+				if (pacer.rate > 0) {
+					cycles = pacer.interval;  // trigger to trigger, on the timer grid
+					cycle_stat_add(&telemetry.status.jitter, pacer.late);
+					telemetry.status.missed = pacer.missed;
+				}
+				capture_start = telemetry_now();
+				if (decimator.factor == 1) {
+					capture(pio, ring, &trigger, index++, cycles, values, due, len, format, ts_jitter, capacity);
+				} else if (decimate_push(&decimator, cycles, values, &cycles, filtered)) {
+					capture(pio, ring, &trigger, index++, cycles, filtered, due, len, format, ts_jitter, capacity);
+				}
+				cycle_stat_add(&telemetry.status.capture, telemetry_now() - capture_start);
+				due = schedule_next(&schedule);
+				adc_select(padc, due);
 			}
+			cycle_stat_add(&telemetry.status.loop, telemetry_now() - loop_start);
 		}
 	}
 }
@@ -83,4 +83,6 @@ SECTIONS {
 	.fardata	>  PRU_DMEM_0_1, PAGE 1
 
 	.resource_table > PRU_DMEM_0_1, PAGE 1
+	.shared		>  PRU_SHAREDMEM, PAGE 2
+	.history	>  PRU_DMEM_1_0, PAGE 1
 }
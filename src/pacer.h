@@ -0,0 +1,73 @@
+#ifndef __PACER_H
+#define __PACER_H
+
+/*
+ * Absolute sample schedule (sample_rate of command_start_t). Shared by firmware,
+ * emulator, and driver.
+ *
+ * Readings are due on a fixed grid of a free-running timer (IEP on PRU, counting
+ * PRU cycles): deadline k is k * PACER_CLOCK_HZ / rate cycles after START. The
+ * period is rarely a whole number of cycles, so deadlines advance by its whole
+ * part and take one cycle more whenever the remainders add up to one, and rate
+ * readings span exactly one second however long the capture runs.
+ *
+ * Nothing waits for a deadline: PRU checks the timer on its way through the main
+ * loop and triggers the ADC on the first pass at or after it. How late that was is
+ * the jitter. A reading that is late by a whole period or more has its deadlines
+ * skipped, not caught up with, so readings stay on the grid. Timestamps are the
+ * timer cycles between triggers, so they add up to the true time of every reading.
+ */
+#define PACER_CLOCK_HZ 200000000
+#define PACER_MAX_RATE 200000   // ADC does not convert faster than that
+
+typedef struct {
+	uint32_t rate;       // readings per second, 0 - not paced
+	uint32_t period;     // whole timer cycles per reading
+	uint32_t remainder;  // PACER_CLOCK_HZ % rate, spread over the periods
+	uint32_t error;      // remainders added up so far, below rate
+	uint32_t deadline;   // timer value the next reading is due at
+	uint32_t last;       // timer value the last reading was triggered at
+	uint32_t interval;   // timer cycles between the last two triggers
+	uint32_t late;       // cycles the last trigger came after its deadline
+	uint32_t missed;     // deadlines skipped since START
+} pacer_t;
+
+/* first reading is due at once */
+static inline void pacer_open(pacer_t *p, uint32_t rate, uint32_t now) {
+	p->rate = rate;
+	p->period = rate > 0 ? PACER_CLOCK_HZ / rate : 0;
+	p->remainder = rate > 0 ? PACER_CLOCK_HZ % rate : 0;
+	p->error = 0;
+	p->deadline = now;
+	p->last = now;
+	p->interval = 0;
+	p->late = 0;
+	p->missed = 0;
+}
+
+static inline void pacer_advance(pacer_t *p) {
+	p->deadline += p->period;
+	p->error += p->remainder;
+	if (p->error >= p->rate) {
+		p->error -= p->rate;
+		p->deadline += 1;
+	}
+}
+
+/* 1 if a reading is due at timer value now; it is taken to be triggered then */
+static inline int pacer_due(pacer_t *p, uint32_t now) {
+	uint32_t late = now - p->deadline;
+
+	if ((int32_t) late < 0) return 0;
+	p->interval = now - p->last;
+	p->last = now;
+	p->late = late;
+	pacer_advance(p);
+	while ((int32_t) (now - p->deadline) >= 0) {
+		pacer_advance(p);
+		p->missed += 1;
+	}
+	return 1;
+}
+
+#endif
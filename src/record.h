@@ -0,0 +1,104 @@
+#ifndef __RECORD_H
+#define __RECORD_H
+
+/*
+ * Layout of recording segments written by driver_record_start(), read back by
+ * bbb_pru_adc/record.py. All integers little-endian.
+ *
+ * A recording is a series of segment files, path.000000, path.000001, ... Each
+ * segment is:
+ *
+ *   record_header_t, padded to RECORD_HEADER_SIZE
+ *   index: record_index_t for each of max_blocks blocks, padded to 4096 bytes
+ *   blocks: block i is block_size bytes at data_offset + i * block_size
+ *
+ * Segment file is preallocated at full size when opened, and cut down to the
+ * blocks actually written when closed. Header and index entry are updated after
+ * every block, so a segment cut short by a crash is still readable up to its
+ * last complete block.
+ *
+ * A block starts with record_block_t, followed by entries, one per PRU message:
+ * record_entry_t and size bytes of payload, padded to 8 bytes. Payload is
+ *
+ *   RECORD_RAW     - the message as PRU sent it (wire format and flags of the header)
+ *   RECORD_DECODED - num records of [ts32, v0, ..., vN-1] (uint16 words, as FORMAT_PLAIN),
+ *                    whatever the wire format was
+ *
+ * first_sample and first_tick are the sample index and PRU time of the first
+ * reading (see driver_timing_t), so a reading can be found with a binary search of
+ * the index, then a scan of the entries of one block. Times of readings follow
+ * from first_time of their block and tick_seconds of the segment.
+ */
+#define RECORD_MAGIC "bbbadc01"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 4096
+
+#define RECORD_RAW 0
+#define RECORD_DECODED 1
+
+/* flags: how raw messages are laid out, see src/wire.h */
+#define RECORD_INDEXED 1  // messages end with the index trailer (trigger capture)
+#define RECORD_SPARSE 2   // records hold due channels only (channel_divisor)
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t kind;            // RECORD_RAW or RECORD_DECODED
+	uint32_t segment;         // number of this segment, from 0
+	uint32_t block_size;      // bytes, multiple of 4096
+	uint32_t max_blocks;      // entries in the index
+	uint32_t num_blocks;      // blocks written
+	uint64_t index_offset;
+	uint64_t data_offset;
+
+	/* capture parameters */
+	uint32_t num_channels;
+	uint8_t channels[8];
+	uint32_t clk_div;
+	uint32_t step_avg;
+	uint32_t target_delay;
+	uint32_t format;          // wire format of RECORD_RAW payloads
+	uint32_t adc_mode;
+	uint32_t decimate_factor;
+	uint32_t decimate_order;
+	uint32_t trigger_mode;
+	uint32_t flags;           // RECORD_INDEXED, RECORD_SPARSE
+	uint8_t channel_avg[8];
+	uint16_t channel_divisor[8];
+
+	/* timestamp base: the first reading of this segment */
+	uint64_t first_sample;
+	uint64_t first_tick;
+	double first_time;        // CLOCK_MONOTONIC seconds
+	double tick_seconds;      // host seconds per PRU cycle, as of the last block
+	double scale;             // volts per ADC count
+} record_header_t;
+
+typedef struct {
+	uint64_t first_sample;
+	uint64_t first_tick;
+	double first_time;
+	uint32_t num_readings;
+	uint32_t num_messages;
+} record_index_t;
+
+typedef struct {
+	uint32_t used;            // bytes of the block in use, this header included
+	uint32_t num_messages;
+	uint32_t num_readings;
+	uint32_t sequence;        // number of the block since the recording started
+	uint64_t first_sample;
+	uint64_t first_tick;
+	double first_time;
+} record_block_t;
+
+typedef struct {
+	uint32_t size;            // payload bytes, not counting padding
+	uint32_t num;             // readings
+	int32_t dropped;          // readings dropped just before this message
+	uint32_t reserved;
+	uint64_t first_sample;
+	uint64_t first_tick;
+} record_entry_t;
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef __RING_H
+#define __RING_H
+
+/*
+ * Ring of data buffers on PRU side. Shared by firmware and emulator.
+ *
+ * A buffer goes through these states, in ring order:
+ *   free -> filling (ring_allocate) -> queued (ring_queue) -> sent (ring_sent)
+ *   -> free (ring_release, when CPU acknowledges it)
+ *
+ * Queued buffers are kept until the transport accepts them, so a busy transport
+ * delays data instead of losing it. Readings are dropped only when every buffer
+ * is in use. Depth can be anything from 1 to RING_MAX_DEPTH.
+ */
+typedef struct {
+	uint16_t depth;
+	uint16_t head;      // next buffer to fill
+	uint16_t send;      // next buffer to send
+	uint16_t used;      // buffers not free
+	uint16_t queued;    // buffers filled, but not sent yet
+	uint16_t unacked;   // buffers sent, but not acknowledged yet
+	uint8_t (*buffers)[WIRE_MAX_SIZE];
+} ring_t;
+
+static inline void ring_open(ring_t *ring, uint8_t (*buffers)[WIRE_MAX_SIZE], uint32_t depth) {
+	if (depth == 0) depth = RING_DEFAULT_DEPTH;
+	if (depth > RING_MAX_DEPTH) depth = RING_MAX_DEPTH;
+	ring->depth = depth;
+	ring->head = 0;
+	ring->send = 0;
+	ring->used = 0;
+	ring->queued = 0;
+	ring->unacked = 0;
+	ring->buffers = buffers;
+}
+
+static inline void *ring_allocate(ring_t *ring) {
+	void *p;
+	if (ring->used == ring->depth) return NULL;
+	p = (void *) ring->buffers[ring->head];
+	ring->head = ring->head + 1 == ring->depth ? 0 : ring->head + 1;
+	ring->used += 1;
+	return p;
+}
+
+/* the buffer being filled is complete */
+static inline void ring_queue(ring_t *ring) {
+	ring->queued += 1;
+}
+
+/* oldest queued buffer, NULL if there are none */
+static inline void *ring_next_queued(ring_t *ring) {
+	if (ring->queued == 0) return NULL;
+	return (void *) ring->buffers[ring->send];
+}
+
+/* buffer returned by ring_next_queued has been sent */
+static inline void ring_sent(ring_t *ring) {
+	ring->send = ring->send + 1 == ring->depth ? 0 : ring->send + 1;
+	ring->queued -= 1;
+	ring->unacked += 1;
+}
+
+static inline void ring_release(ring_t *ring, uint32_t count) {
+	if (count > ring->unacked) {
+		count = ring->unacked;  // guard against bogus ACKs
+	}
+	ring->unacked -= count;
+	ring->used -= count;
+}
+
+#endif
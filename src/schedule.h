@@ -0,0 +1,71 @@
+#ifndef __SCHEDULE_H
+#define __SCHEDULE_H
+
+/*
+ * Per-channel rates (channel_divisor of command_start_t). Shared by firmware and
+ * emulator.
+ *
+ * channels[i] is converted on every divisor[i]-th reading, counting from 0 at
+ * START, so every channel is due on reading 0. At least one channel has divisor
+ * 1; it sets the pace, the others are converted along with it when due. In
+ * one-shot ADC mode only the steps of due channels are triggered, which makes
+ * readings shorter; in continuous mode all steps run and values of channels that
+ * are not due are discarded.
+ *
+ * When any divisor is above 1, buffers carry only the values of due channels,
+ * and every record says which ones those are (see "sparse" in src/wire.h).
+ *
+ * Decimation and trigger need every channel on every reading, divisors are
+ * ignored with them.
+ */
+typedef struct {
+	uint16_t num_channels;
+	uint16_t all;           // mask of all num_channels channels
+	uint16_t sparse;        // some channel has divisor above 1
+	uint16_t divisor[8];
+	uint16_t countdown[8];  // readings until channels[i] is due, 0 - due on the next one
+} schedule_t;
+
+/* divisor 0 means 1 */
+static inline void schedule_open(schedule_t *s, command_start_t const *start, uint16_t num_channels) {
+	int ignore = start->decimate_factor > 1 || start->trigger_mode != TRIGGER_NONE;
+	int i;
+
+	s->num_channels = num_channels;
+	s->all = (1 << num_channels) - 1;
+	s->sparse = 0;
+	for (i = 0; i < 8; i++) {
+		s->divisor[i] = !ignore && i < num_channels && start->channel_divisor[i] > 1 ? start->channel_divisor[i] : 1;
+		s->countdown[i] = 0;
+		if (s->divisor[i] > 1) s->sparse = 1;
+	}
+}
+
+/* number of channels due on every reading, i.e. the fewest values a sparse record has */
+static inline uint16_t schedule_min_values(schedule_t const *s) {
+	uint16_t count = 0;
+	int i;
+
+	for (i = 0; i < s->num_channels; i++) {
+		if (s->divisor[i] == 1) count += 1;
+	}
+	return count;
+}
+
+/* mask of channels due on the next reading (bit i - channels[i]), and moves on to the one after */
+static inline uint16_t schedule_next(schedule_t *s) {
+	uint16_t due = 0;
+	int i;
+
+	if (!s->sparse) return s->all;
+	for (i = 0; i < s->num_channels; i++) {
+		if (s->countdown[i] == 0) {
+			due |= 1 << i;
+			s->countdown[i] = s->divisor[i];
+		}
+		s->countdown[i] -= 1;
+	}
+	return due;
+}
+
+#endif
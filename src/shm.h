@@ -0,0 +1,38 @@
+#ifndef __SHM_H
+#define __SHM_H
+
+/*
+ * Shared memory transport (TRANSPORT_SHM). Shared by firmware, emulator, and driver.
+ *
+ * PRU ring buffers (see src/ring.h) live in PRU shared RAM, laid out as shm_t.
+ * With TRANSPORT_SHM, PRU does not send them over rpmsg: it publishes a filled
+ * buffer by incrementing head, and host reads it in place and releases it by
+ * incrementing tail. Buffer of message i (counting from 0) is slots[i % depth].
+ * rpmsg carries only the commands (START, STOP).
+ *
+ * Host maps the 12KB shared RAM from /dev/mem at SHM_PHYS_ADDR. A regular file
+ * holding shm_t (at offset 0) works the same way, this is how the emulator
+ * provides it.
+ *
+ * On START, PRU resets the header and then sets id to shm_id of the command, so
+ * host knows when the ring is ready.
+ */
+typedef struct {
+	uint32_t id;          // shm_id of the START command that set up the ring
+	uint32_t depth;       // number of slots in use
+	uint32_t slot_size;   // bytes per slot
+	uint32_t head;        // messages published, written by PRU
+	uint32_t tail;        // messages released, written by host
+	uint32_t reserved[3];
+} shm_header_t;
+
+typedef struct {
+	shm_header_t header;
+	uint8_t slots[RING_MAX_DEPTH][WIRE_MAX_SIZE];
+} shm_t;
+
+/* PRU-ICSS shared RAM, as seen by the host (PRU sees it at 0x00010000) */
+#define SHM_PHYS_ADDR 0x4a310000
+#define SHM_PHYS_SIZE 0x3000
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __SUMMARY_H
+#define __SUMMARY_H
+
+/*
+ * Summary mode (summary_window of command_start_t). Shared by firmware, emulator,
+ * and driver.
+ *
+ * Instead of sending readings, PRU keeps min, max, sum, and sum of squares of each
+ * channel over window readings (after decimation, if any), and sends one record per
+ * window. The ADC runs as fast as configured, but traffic and host work drop by
+ * the window. Buffers hold num records after the usual header (num, num_dropped):
+ *
+ *   cycles (uint64) - PRU cycles since the previous record, i.e. the timestamps of
+ *                     the readings of the window added up
+ *   then per channel: min, max (uint16), sum (uint32), sumsq (uint64)
+ *
+ * 64-bit words are two uint32 (low, high), little-endian, and not aligned. A record
+ * takes 8 + 16N bytes: 20 records fit a buffer with one channel, 3 with eight.
+ * num_dropped counts records (whole windows) lost for lack of a ring buffer.
+ *
+ * sum of 12-bit values fits 32 bits for up to SUMMARY_MAX_WINDOW readings; sumsq
+ * needs 64. Mean is sum / window, RMS is sqrt(sumsq / window), in ADC counts.
+ */
+#define SUMMARY_MAX_WINDOW (1ul << 20)
+#define SUMMARY_CYCLES_SIZE 8
+#define SUMMARY_CHANNEL_SIZE 16
+
+typedef struct {
+	uint32_t window;       // readings per record, 0 - no summaries
+	uint32_t count;        // readings of the current window so far
+	uint16_t num_channels;
+	uint64_t cycles;
+	uint16_t min[8];
+	uint16_t max[8];
+	uint32_t sum[8];
+	uint64_t sumsq[8];
+} summary_t;
+
+/* window is clamped to SUMMARY_MAX_WINDOW */
+static inline void summary_open(summary_t *s, uint32_t window, uint16_t num_channels) {
+	s->window = window < SUMMARY_MAX_WINDOW ? window : SUMMARY_MAX_WINDOW;
+	s->count = 0;
+	s->num_channels = num_channels;
+	s->cycles = 0;
+}
+
+/* bytes of a record */
+static inline uint16_t summary_record_size(uint16_t num_channels) {
+	return SUMMARY_CYCLES_SIZE + SUMMARY_CHANNEL_SIZE * num_channels;
+}
+
+/* records that fit a buffer */
+static inline uint16_t summary_capacity(uint16_t num_channels) {
+	return (WIRE_MAX_SIZE - WIRE_HEADER_SIZE) / summary_record_size(num_channels);
+}
+
+/* size of a buffer with num records, in bytes */
+static inline uint16_t summary_size(uint16_t num_channels, uint16_t num) {
+	return WIRE_HEADER_SIZE + num * summary_record_size(num_channels);
+}
+
+/*
+ * Feeds one reading (cycles since the previous one, num_channels values). Returns 1
+ * when it completes a window; its totals stay there for summary_put() until the
+ * next reading starts a new one.
+ */
+static inline int summary_push(summary_t *s, uint32_t cycles, uint16_t const *values) {
+	int j;
+
+	if (s->count == 0) {
+		s->cycles = 0;
+		for (j = 0; j < s->num_channels; j++) {
+			s->min[j] = values[j];
+			s->max[j] = values[j];
+			s->sum[j] = 0;
+			s->sumsq[j] = 0;
+		}
+	}
+	s->cycles += cycles;
+	for (j = 0; j < s->num_channels; j++) {
+		uint32_t x = values[j];
+		if (x < s->min[j]) s->min[j] = x;
+		if (x > s->max[j]) s->max[j] = x;
+		s->sum[j] += x;
+		s->sumsq[j] += x * x;
+	}
+	if (++s->count < s->window) return 0;
+	s->count = 0;
+	return 1;
+}
+
+/* writes the record of the window just completed */
+static inline void summary_put(uint8_t *record, summary_t const *s) {
+	uint32_t words[2];
+	int j;
+
+	words[0] = (uint32_t) s->cycles;
+	words[1] = (uint32_t) (s->cycles >> 32);
+	memcpy(record, words, sizeof(words));
+	record += SUMMARY_CYCLES_SIZE;
+	for (j = 0; j < s->num_channels; j++) {
+		memcpy(record, &s->min[j], sizeof(uint16_t));
+		memcpy(record + 2, &s->max[j], sizeof(uint16_t));
+		memcpy(record + 4, &s->sum[j], sizeof(uint32_t));
+		words[0] = (uint32_t) s->sumsq[j];
+		words[1] = (uint32_t) (s->sumsq[j] >> 32);
+		memcpy(record + 8, words, sizeof(words));
+		record += SUMMARY_CHANNEL_SIZE;
+	}
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+/*
+ * Firmware telemetry, the reply to COMMAND_STATUS. Shared by firmware, emulator,
+ * and driver.
+ *
+ * PRU keeps counters and cycle stats from START on, and sends status_t over rpmsg
+ * when asked, whatever the data transport. The reply travels among data buffers:
+ * its first word is STATUS_MARKER where a buffer has its num, a value no buffer
+ * can have (1023 records, with 63 ring buffers in use). It is not a ring buffer,
+ * and is not acknowledged. PRU retries the reply until rpmsg takes it.
+ *
+ * Cycle stats are in PRU cycles (5ns):
+ *   loop    - one pass of the main loop while capturing: commands, retry of queued
+ *             buffers, ADC poll, and for passes that get a reading, the target_delay
+ *             wait and capture
+ *   capture - decimation and capture() of one reading: filling the buffer, and
+ *             sending it when full
+ *   io_send - one io_send() that succeeded
+ *   latency - from the first reading of a buffer coming out of adc_read() until the
+ *             buffer is sent, i.e. the longest any reading of it waited
+ *   jitter  - sample_rate only: how late each ADC trigger came after its deadline
+ *             (see src/pacer.h)
+ */
+#define STATUS_MARKER 0xffff
+#define STATUS_VERSION 2
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t reserved;
+	uint64_t total;
+} cycle_stat_t;
+
+typedef struct {
+	uint16_t marker;          // STATUS_MARKER
+	uint16_t version;         // STATUS_VERSION
+	uint32_t readings;        // ADC readings, before decimation
+	uint32_t buffers;         // buffers sent
+	uint32_t send_failures;   // io_send() refused a buffer, it stays queued and is retried
+	uint32_t dropped;         // readings dropped for lack of a free ring buffer
+	uint32_t missed;          // sample_rate: deadlines skipped, the ADC was busy or PRU late
+	cycle_stat_t loop;
+	cycle_stat_t capture;
+	cycle_stat_t io_send;
+	cycle_stat_t latency;
+	cycle_stat_t jitter;
+} status_t;
+
+typedef struct {
+	status_t status;
+	uint16_t pending;                      // reply asked for, but not sent yet
+	uint32_t clock;                        // PRU cycles since START, as of the last reading
+	uint32_t first_time[RING_MAX_DEPTH];   // clock of the first reading of each ring buffer
+} telemetry_t;
+
+/* counters start over, a pending reply stays pending */
+static inline void telemetry_open(telemetry_t *t) {
+	memset(&t->status, 0, sizeof(t->status));
+	t->status.marker = STATUS_MARKER;
+	t->status.version = STATUS_VERSION;
+	t->clock = 0;
+}
+
+static inline void cycle_stat_add(cycle_stat_t *s, uint32_t cycles) {
+	if (s->count == 0 || cycles < s->min) s->min = cycles;
+	if (cycles > s->max) s->max = cycles;
+	s->count += 1;
+	s->total += cycles;
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef __TRIGGER_H
+#define __TRIGGER_H
+
+/*
+ * Trigger mode (TRIGGER_LEVEL, TRIGGER_EDGE). Shared by firmware and emulator.
+ *
+ * Readings are kept in a circular history instead of being sent. When a watched
+ * channel meets its threshold, the last pre readings of the history are sent,
+ * followed by the reading that fired and the post readings after it (a window).
+ * Trigger firing again inside the window extends it by post readings. After the
+ * window, history starts over, so readings are never sent twice.
+ *
+ *   TRIGGER_LEVEL - fires on every reading at or above (rising) or at or below
+ *                   (falling) the threshold
+ *   TRIGGER_EDGE  - fires when a reading crosses the threshold: previous one was
+ *                   below it and this one is at or above (rising), or the reverse
+ *
+ * Readings are numbered from 0 at START (after decimation), and every buffer of
+ * a trigger capture carries the index of its first reading (see WIRE_INDEX_SIZE),
+ * so host knows where each window is. A buffer never spans two windows.
+ *
+ * History takes TRIGGER_HISTORY_WORDS 16-bit words, a reading takes 2 + N of them
+ * (timestamp and values), so pre can be up to 1365 readings with one channel and
+ * 409 with eight.
+ */
+#define TRIGGER_HISTORY_WORDS 4096
+
+typedef struct {
+	uint16_t mode;
+	uint16_t num_channels;
+	uint16_t channels;       // bit i - i-th captured channel is watched
+	uint16_t rising;         // bit i - i-th captured channel fires on rising values, falling otherwise
+	uint16_t threshold[8];
+	uint16_t previous[8];    // TRIGGER_EDGE: values of the previous reading
+	uint16_t has_previous;
+	uint16_t pre;            // readings before the one that fired
+	uint16_t post;           // readings after it
+	uint16_t remaining;      // readings left in the current window, 0 - waiting for trigger
+	uint16_t history_head;   // next reading goes there
+	uint16_t history_count;
+	uint16_t history_size;   // capacity, in readings
+	uint16_t *history;
+} trigger_t;
+
+static inline uint16_t trigger_max_pre(uint16_t num_channels) {
+	return TRIGGER_HISTORY_WORDS / (2 + num_channels);
+}
+
+static inline void trigger_open(trigger_t *t, command_start_t const *start, uint16_t num_channels, uint16_t *history) {
+	int i;
+
+	t->mode = start->trigger_mode;
+	t->num_channels = num_channels;
+	t->channels = start->trigger_channels;
+	t->rising = start->trigger_rising;
+	for (i = 0; i < 8; i++) {
+		t->threshold[i] = start->trigger_threshold[i];
+	}
+	t->has_previous = 0;
+	t->history_size = trigger_max_pre(num_channels);
+	t->pre = start->pre_trigger < t->history_size ? start->pre_trigger : t->history_size;
+	t->post = start->post_trigger;
+	t->remaining = 0;
+	t->history_head = 0;
+	t->history_count = 0;
+	t->history = history;
+}
+
+/* checks whether the reading fires the trigger */
+static inline int trigger_fires(trigger_t *t, uint16_t const *values) {
+	int fires = 0;
+	int i;
+
+	for (i = 0; i < t->num_channels; i++) {
+		uint16_t threshold = t->threshold[i];
+		int rising = (t->rising >> i) & 1;
+		if (!((t->channels >> i) & 1)) continue;
+		if (t->mode == TRIGGER_LEVEL || t->has_previous) {
+			int now = rising ? values[i] >= threshold : values[i] <= threshold;
+			int before = t->mode == TRIGGER_LEVEL ? 0
+					: rising ? t->previous[i] >= threshold : t->previous[i] <= threshold;
+			if (now && !before) fires = 1;
+		}
+		t->previous[i] = values[i];
+	}
+	t->has_previous = 1;
+	return fires;
+}
+
+/* stores the reading in history, overwriting the oldest one when full */
+static inline void trigger_remember(trigger_t *t, uint32_t cycles, uint16_t const *values) {
+	uint16_t *p = t->history + t->history_head * (2 + t->num_channels);
+	int i;
+
+	p[0] = cycles & 0xffff;
+	p[1] = cycles >> 16;
+	for (i = 0; i < t->num_channels; i++) {
+		p[2 + i] = values[i];
+	}
+	t->history_head = t->history_head + 1 == t->history_size ? 0 : t->history_head + 1;
+	if (t->history_count < t->history_size) t->history_count += 1;
+}
+
+/* number of history readings that go before the reading that fired */
+static inline uint16_t trigger_history_length(trigger_t const *t) {
+	return t->history_count < t->pre ? t->history_count : t->pre;
+}
+
+/* i-th of the trigger_history_length() readings, oldest first */
+static inline void trigger_recall(trigger_t const *t, uint16_t i, uint32_t *cycles, uint16_t *values) {
+	uint16_t n = trigger_history_length(t);
+	int32_t k = (int32_t) t->history_head - n + i;
+	uint16_t const *p;
+	int j;
+
+	if (k < 0) k += t->history_size;
+	p = t->history + k * (2 + t->num_channels);
+	*cycles = (uint32_t) p[1] << 16 | p[0];
+	for (j = 0; j < t->num_channels; j++) {
+		values[j] = p[2 + j];
+	}
+}
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * Portable unpack kernels and runtime kernel selection. See unpack.h
+ */
+#include <string.h>
+#include "unpack.h"
+#include "common.h"
+#include "wire.h"
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* records are processed in blocks of this size, to give compiler 8 lanes to vectorize */
+#define BLOCK 8
+
+static inline __attribute__((always_inline)) void unpack_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, float *values, float scale) {
+	uint16_t tmp[BLOCK * 8];
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		for (int k = 0; k < BLOCK; k++) {
+			memcpy(&timestamps[i + k], src, sizeof(uint32_t));
+			memcpy(&tmp[k * n], src + 2, n * sizeof(uint16_t));
+			src += 2 + n;
+		}
+		for (int k = 0; k < BLOCK * n; k++) {
+			values[k] = tmp[k] * scale;
+		}
+		values += BLOCK * n;
+	}
+
+	for (; i < num_records; i++) {
+		memcpy(&timestamps[i], src, sizeof(uint32_t));
+		for (int j = 0; j < n; j++) {
+			values[j] = src[2 + j] * scale;
+		}
+		src += 2 + n;
+		values += n;
+	}
+}
+
+static inline __attribute__((always_inline)) void unpack_raw_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, uint16_t *values) {
+	for (int i = 0; i < num_records; i++) {
+		memcpy(&timestamps[i], src, sizeof(uint32_t));
+		memcpy(values, src + 2, n * sizeof(uint16_t));
+		src += 2 + n;
+		values += n;
+	}
+}
+
+static inline __attribute__((always_inline)) void unpack_planar_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, float *const *channels, float scale) {
+	uint16_t tmp[8][BLOCK];
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		for (int k = 0; k < BLOCK; k++) {
+			memcpy(&timestamps[i + k], src, sizeof(uint32_t));
+			for (int j = 0; j < n; j++) {
+				tmp[j][k] = src[2 + j];
+			}
+			src += 2 + n;
+		}
+		for (int j = 0; j < n; j++) {
+			for (int k = 0; k < BLOCK; k++) {
+				channels[j][i + k] = tmp[j][k] * scale;
+			}
+		}
+	}
+
+	for (; i < num_records; i++) {
+		memcpy(&timestamps[i], src, sizeof(uint32_t));
+		for (int j = 0; j < n; j++) {
+			channels[j][i] = src[2 + j] * scale;
+		}
+		src += 2 + n;
+	}
+}
+
+static inline __attribute__((always_inline)) void unpack_raw_planar_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, uint16_t *const *channels) {
+	for (int i = 0; i < num_records; i++) {
+		memcpy(&timestamps[i], src, sizeof(uint32_t));
+		for (int j = 0; j < n; j++) {
+			channels[j][i] = src[2 + j];
+		}
+		src += 2 + n;
+	}
+}
+
+/* a lookup is a load like the multiply's operand, so these cost what unpack_n does */
+static inline __attribute__((always_inline)) void unpack_lut_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, float *values, float const *lut) {
+	for (int i = 0; i < num_records; i++) {
+		memcpy(&timestamps[i], src, sizeof(uint32_t));
+		for (int j = 0; j < n; j++) {
+			values[j] = lut[j * UNPACK_LUT_SIZE + (src[2 + j] & (UNPACK_LUT_SIZE - 1))];
+		}
+		src += 2 + n;
+		values += n;
+	}
+}
+
+static inline __attribute__((always_inline)) void unpack_lut_planar_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, float *const *channels, float const *lut) {
+	for (int i = 0; i < num_records; i++) {
+		memcpy(&timestamps[i], src, sizeof(uint32_t));
+		for (int j = 0; j < n; j++) {
+			channels[j][i] = lut[j * UNPACK_LUT_SIZE + (src[2 + j] & (UNPACK_LUT_SIZE - 1))];
+		}
+		src += 2 + n;
+	}
+}
+
+#define DEFINE_UNPACK(N) \
+	static void unpack_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, float *values, float scale) { \
+		unpack_n(N, src, num_records, timestamps, values, scale); \
+	} \
+	static void unpack_raw_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, uint16_t *values) { \
+		unpack_raw_n(N, src, num_records, timestamps, values); \
+	} \
+	static void unpack_planar_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, float *const *channels, float scale) { \
+		unpack_planar_n(N, src, num_records, timestamps, channels, scale); \
+	} \
+	static void unpack_raw_planar_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, uint16_t *const *channels) { \
+		unpack_raw_planar_n(N, src, num_records, timestamps, channels); \
+	} \
+	static void unpack_lut_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, float *values, float const *lut) { \
+		unpack_lut_n(N, src, num_records, timestamps, values, lut); \
+	} \
+	static void unpack_lut_planar_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, float *const *channels, float const *lut) { \
+		unpack_lut_planar_n(N, src, num_records, timestamps, channels, lut); \
+	}
+
+DEFINE_UNPACK(1)
+DEFINE_UNPACK(2)
+DEFINE_UNPACK(3)
+DEFINE_UNPACK(4)
+DEFINE_UNPACK(5)
+DEFINE_UNPACK(6)
+DEFINE_UNPACK(7)
+DEFINE_UNPACK(8)
+
+unpack_fn const unpack_portable[9] = {
+	NULL, unpack_1, unpack_2, unpack_3, unpack_4, unpack_5, unpack_6, unpack_7, unpack_8,
+};
+
+unpack_raw_fn const unpack_raw_portable[9] = {
+	NULL, unpack_raw_1, unpack_raw_2, unpack_raw_3, unpack_raw_4,
+	unpack_raw_5, unpack_raw_6, unpack_raw_7, unpack_raw_8,
+};
+
+unpack_planar_fn const unpack_planar_portable[9] = {
+	NULL, unpack_planar_1, unpack_planar_2, unpack_planar_3, unpack_planar_4,
+	unpack_planar_5, unpack_planar_6, unpack_planar_7, unpack_planar_8,
+};
+
+unpack_raw_planar_fn const unpack_raw_planar_portable[9] = {
+	NULL, unpack_raw_planar_1, unpack_raw_planar_2, unpack_raw_planar_3, unpack_raw_planar_4,
+	unpack_raw_planar_5, unpack_raw_planar_6, unpack_raw_planar_7, unpack_raw_planar_8,
+};
+
+unpack_lut_fn const unpack_lut_portable[9] = {
+	NULL, unpack_lut_1, unpack_lut_2, unpack_lut_3, unpack_lut_4,
+	unpack_lut_5, unpack_lut_6, unpack_lut_7, unpack_lut_8,
+};
+
+unpack_lut_planar_fn const unpack_lut_planar_portable[9] = {
+	NULL, unpack_lut_planar_1, unpack_lut_planar_2, unpack_lut_planar_3, unpack_lut_planar_4,
+	unpack_lut_planar_5, unpack_lut_planar_6, unpack_lut_planar_7, unpack_lut_planar_8,
+};
+
+static int have_neon(void) {
+#if defined(__aarch64__)
+	return 1;
+#elif defined(__arm__)
+	return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+	return 0;
+#endif
+}
+
+unpack_fn unpack_select(int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return NULL;
+	if (have_neon() && unpack_neon[num_channels] != NULL) {
+		return unpack_neon[num_channels];
+	}
+	return unpack_portable[num_channels];
+}
+
+unpack_raw_fn unpack_raw_select(int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return NULL;
+	if (have_neon() && unpack_raw_neon[num_channels] != NULL) {
+		return unpack_raw_neon[num_channels];
+	}
+	return unpack_raw_portable[num_channels];
+}
+
+unpack_planar_fn unpack_planar_select(int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return NULL;
+	if (have_neon() && unpack_planar_neon[num_channels] != NULL) {
+		return unpack_planar_neon[num_channels];
+	}
+	return unpack_planar_portable[num_channels];
+}
+
+/* there are no NEON raw planar kernels: it is a plain copy, portable code does fine */
+unpack_raw_planar_fn unpack_raw_planar_select(int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return NULL;
+	return unpack_raw_planar_portable[num_channels];
+}
+
+/* no NEON lookup kernels either: NEON has no gather, lanes would be loaded one by one */
+unpack_lut_fn unpack_lut_select(int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return NULL;
+	return unpack_lut_portable[num_channels];
+}
+
+unpack_lut_planar_fn unpack_lut_planar_select(int num_channels) {
+	if (num_channels < 1 || num_channels > 8) return NULL;
+	return unpack_lut_planar_portable[num_channels];
+}
+
+/* FORMAT_PACKED_FIXED has no deltas, these are used instead */
+static int8_t const zero_deltas[WIRE_MAX_RECORDS];
+
+static inline __attribute__((always_inline)) void unpack_wire_n(int n, uint8_t const *p,
+		int num, int8_t const *deltas, uint32_t ts, uint16_t *dst) {
+	/* value k is in bytes 3k/2 and 3k/2 + 1: low 12 bits if k is even, high 12 bits if odd */
+	for (int i = 0; i < num; i++) {
+		uint32_t t = ts + deltas[i];
+		memcpy(dst, &t, sizeof(t));
+		for (int j = 0; j < n; j++) {
+			int k = i * n + j;
+			uint8_t const *q = p + ((3 * k) >> 1);
+			dst[2 + j] = (k & 1) ? (q[0] >> 4) | (q[1] << 4) : q[0] | ((q[1] & 0xf) << 8);
+		}
+		dst += 2 + n;
+	}
+}
+
+int unpack_wire(uint8_t const *src, uint32_t format, int num_channels, uint16_t *dst) {
+	uint8_t const *packed = src + WIRE_HEADER_SIZE + WIRE_BASE_SIZE;
+	int8_t const *deltas = zero_deltas;
+	uint16_t num, base[2];
+	uint32_t ts;
+
+	memcpy(&num, src, sizeof(num));
+	num = BUFFER_NUM(num);
+	memcpy(base, src + WIRE_HEADER_SIZE, sizeof(base));
+	ts = (uint32_t) base[1] << 16 | base[0];
+	if (format == FORMAT_PACKED) {
+		deltas = (int8_t const *) (packed + (3 * num_channels * num + 1) / 2);
+	}
+
+	switch (num_channels) {
+	case 1: unpack_wire_n(1, packed, num, deltas, ts, dst); break;
+	case 2: unpack_wire_n(2, packed, num, deltas, ts, dst); break;
+	case 3: unpack_wire_n(3, packed, num, deltas, ts, dst); break;
+	case 4: unpack_wire_n(4, packed, num, deltas, ts, dst); break;
+	case 5: unpack_wire_n(5, packed, num, deltas, ts, dst); break;
+	case 6: unpack_wire_n(6, packed, num, deltas, ts, dst); break;
+	case 7: unpack_wire_n(7, packed, num, deltas, ts, dst); break;
+	case 8: unpack_wire_n(8, packed, num, deltas, ts, dst); break;
+	}
+	return num;
+}
+
+int unpack_sparse(uint8_t const *src, uint32_t format, int num_channels, uint16_t *held, uint16_t *dst) {
+	uint8_t const *p = src + WIRE_HEADER_SIZE + WIRE_COUNT_SIZE;
+	uint16_t num, num_values, mask;
+	int k = 0;
+
+	memcpy(&num, src, sizeof(num));
+	num = BUFFER_NUM(num);
+	memcpy(&num_values, src + WIRE_HEADER_SIZE, sizeof(num_values));
+
+	if (format == FORMAT_PLAIN) {
+		for (int i = 0; i < num; i++) {
+			memcpy(dst, p, sizeof(uint32_t));
+			memcpy(&mask, p + 4, sizeof(mask));
+			p += 6;
+			for (int j = 0; j < num_channels; j++) {
+				if ((mask >> j) & 1) {
+					if (k++ == num_values) return -1;
+					memcpy(&held[j], p, sizeof(uint16_t));
+					p += 2;
+				}
+				dst[2 + j] = held[j];
+			}
+			dst += 2 + num_channels;
+		}
+	} else {
+		uint8_t const *packed = p + WIRE_BASE_SIZE;
+		uint8_t const *masks = packed + (3 * num_values + 1) / 2;
+		int8_t const *deltas = format == FORMAT_PACKED ? (int8_t const *) masks + num : zero_deltas;
+		uint16_t base[2];
+		uint32_t ts;
+
+		memcpy(base, p, sizeof(base));
+		ts = (uint32_t) base[1] << 16 | base[0];
+		for (int i = 0; i < num; i++) {
+			uint32_t t = ts + deltas[i];
+			memcpy(dst, &t, sizeof(t));
+			for (int j = 0; j < num_channels; j++) {
+				if ((masks[i] >> j) & 1) {
+					uint8_t const *q;
+					if (k == num_values) return -1;
+					q = packed + ((3 * k) >> 1);
+					held[j] = (k & 1) ? (q[0] >> 4) | (q[1] << 4) : q[0] | ((q[1] & 0xf) << 8);
+					k += 1;
+				}
+				dst[2 + j] = held[j];
+			}
+			dst += 2 + num_channels;
+		}
+	}
+	return k == num_values ? num : -1;
+}
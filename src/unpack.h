@@ -0,0 +1,86 @@
+#ifndef __UNPACK_H
+#define __UNPACK_H
+
+#include <stdint.h>
+
+/*
+ * Kernels that split records of the PRU buffer into timestamps and values.
+ *
+ * Each record is [ts32, v0, ..., vN-1] (in 16-bit words, ts32 is two words,
+ * little-endian), records are packed back to back. There is one kernel per
+ * channel count (1-8), so that record layout is known at compile time.
+ *
+ *   unpack_fn     - timestamps, and values converted to float (value * scale)
+ *   unpack_raw_fn - timestamps, and values copied as-is
+ *
+ * Values are written in the same order as they are in the buffer, i.e.
+ * [v0 of record 0, v1 of record 0, ..., v0 of record 1, ...]
+ *
+ * Planar kernels write values of channel j into channels[j] instead:
+ *
+ *   unpack_planar_fn     - timestamps, and values converted to float
+ *   unpack_raw_planar_fn - timestamps, and values copied as-is
+ *
+ * Calibrated kernels convert through per-channel tables instead of one scale:
+ * value v of channel j becomes lut[j * UNPACK_LUT_SIZE + v], 12 bits of v being
+ * used.
+ *
+ *   unpack_lut_fn        - timestamps, and values looked up, in buffer order
+ *   unpack_lut_planar_fn - same, values of channel j go to channels[j]
+ */
+#define UNPACK_LUT_SIZE 4096
+
+typedef void (*unpack_fn)(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *values, float scale);
+typedef void (*unpack_raw_fn)(uint16_t const *src, int num_records,
+		uint32_t *timestamps, uint16_t *values);
+typedef void (*unpack_planar_fn)(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *const *channels, float scale);
+typedef void (*unpack_raw_planar_fn)(uint16_t const *src, int num_records,
+		uint32_t *timestamps, uint16_t *const *channels);
+typedef void (*unpack_lut_fn)(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *values, float const *lut);
+typedef void (*unpack_lut_planar_fn)(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *const *channels, float const *lut);
+
+/*
+ * Returns the best kernel for this CPU (NEON if available, portable otherwise).
+ * num_channels must be 1..8
+ */
+extern unpack_fn unpack_select(int num_channels);
+extern unpack_raw_fn unpack_raw_select(int num_channels);
+extern unpack_planar_fn unpack_planar_select(int num_channels);
+extern unpack_raw_planar_fn unpack_raw_planar_select(int num_channels);
+extern unpack_lut_fn unpack_lut_select(int num_channels);
+extern unpack_lut_planar_fn unpack_lut_planar_select(int num_channels);
+
+/* portable kernels, index is num_channels */
+extern unpack_fn const unpack_portable[9];
+extern unpack_raw_fn const unpack_raw_portable[9];
+extern unpack_planar_fn const unpack_planar_portable[9];
+extern unpack_raw_planar_fn const unpack_raw_planar_portable[9];
+extern unpack_lut_fn const unpack_lut_portable[9];
+extern unpack_lut_planar_fn const unpack_lut_planar_portable[9];
+
+/*
+ * Converts records of a packed buffer (FORMAT_PACKED or FORMAT_PACKED_FIXED, see
+ * src/wire.h) into plain records [ts32, v0, ..., vN-1] at dst, so that the kernels
+ * above can take them from there. src points to the buffer header. Returns number
+ * of records.
+ */
+extern int unpack_wire(uint8_t const *src, uint32_t format, int num_channels, uint16_t *dst);
+
+/*
+ * Same for a sparse buffer (see src/wire.h), whose records hold values of some
+ * channels only. Channels missing from a record repeat their last value, kept in
+ * held (num_channels values, updated). Returns number of records, or -1 if the
+ * masks do not add up to num_values of the buffer.
+ */
+extern int unpack_sparse(uint8_t const *src, uint32_t format, int num_channels, uint16_t *held, uint16_t *dst);
+
+/* NEON kernels, NULL entries when not built for ARM (see src/unpack_neon.c) */
+extern unpack_fn const unpack_neon[9];
+extern unpack_raw_fn const unpack_raw_neon[9];
+extern unpack_planar_fn const unpack_planar_neon[9];
+
+#endif
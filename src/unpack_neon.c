@@ -0,0 +1,198 @@
+/*
+ * NEON unpack kernels. See unpack.h
+ *
+ * This file is compiled with -mfpu=neon on 32-bit ARM (see Makefile), kernels
+ * are only called if CPU reports NEON support (see unpack_select). On other
+ * architectures the tables are empty and portable kernels are used.
+ *
+ * 1 and 2 channels: records are 3 and 4 words long, so vld3/vld4 deinterleave
+ * 8 records at once. 3-8 channels: values of 8 records are gathered into a
+ * contiguous block which is then converted 8 lanes at a time.
+ */
+#include <string.h>
+#include "unpack.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+#define BLOCK 8
+
+static inline void store_scaled(float *dst, uint16x8_t v, float scale) {
+	float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+	float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+	vst1q_f32(dst, vmulq_n_f32(lo, scale));
+	vst1q_f32(dst + 4, vmulq_n_f32(hi, scale));
+}
+
+/* low and high halves of 8 timestamps, stored as 8 little-endian uint32 */
+static inline void store_timestamps(uint32_t *dst, uint16x8_t lo, uint16x8_t hi) {
+	uint16x8x2_t t;
+	t.val[0] = lo;
+	t.val[1] = hi;
+	vst2q_u16((uint16_t *) dst, t);
+}
+
+static void unpack_neon_1(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *values, float scale) {
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		uint16x8x3_t r = vld3q_u16(src);
+		store_timestamps(timestamps + i, r.val[0], r.val[1]);
+		store_scaled(values + i, r.val[2], scale);
+		src += BLOCK * 3;
+	}
+	unpack_portable[1](src, num_records - i, timestamps + i, values + i, scale);
+}
+
+static void unpack_neon_2(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *values, float scale) {
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		uint16x8x4_t r = vld4q_u16(src);
+		uint16x8x2_t v = vzipq_u16(r.val[2], r.val[3]);
+		store_timestamps(timestamps + i, r.val[0], r.val[1]);
+		store_scaled(values + 2 * i, v.val[0], scale);
+		store_scaled(values + 2 * i + 8, v.val[1], scale);
+		src += BLOCK * 4;
+	}
+	unpack_portable[2](src, num_records - i, timestamps + i, values + 2 * i, scale);
+}
+
+static inline __attribute__((always_inline)) void unpack_neon_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, float *values, float scale) {
+	uint16_t tmp[BLOCK * 8];
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		for (int k = 0; k < BLOCK; k++) {
+			memcpy(&timestamps[i + k], src, sizeof(uint32_t));
+			memcpy(&tmp[k * n], src + 2, n * sizeof(uint16_t));
+			src += 2 + n;
+		}
+		for (int k = 0; k < n; k++) {
+			store_scaled(values + k * BLOCK, vld1q_u16(tmp + k * BLOCK), scale);
+		}
+		values += BLOCK * n;
+	}
+	unpack_portable[n](src, num_records - i, timestamps + i, values, scale);
+}
+
+static void unpack_raw_neon_1(uint16_t const *src, int num_records,
+		uint32_t *timestamps, uint16_t *values) {
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		uint16x8x3_t r = vld3q_u16(src);
+		store_timestamps(timestamps + i, r.val[0], r.val[1]);
+		vst1q_u16(values + i, r.val[2]);
+		src += BLOCK * 3;
+	}
+	unpack_raw_portable[1](src, num_records - i, timestamps + i, values + i);
+}
+
+static void unpack_raw_neon_2(uint16_t const *src, int num_records,
+		uint32_t *timestamps, uint16_t *values) {
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		uint16x8x4_t r = vld4q_u16(src);
+		uint16x8x2_t v;
+		v.val[0] = r.val[2];
+		v.val[1] = r.val[3];
+		store_timestamps(timestamps + i, r.val[0], r.val[1]);
+		vst2q_u16(values + 2 * i, v);
+		src += BLOCK * 4;
+	}
+	unpack_raw_portable[2](src, num_records - i, timestamps + i, values + 2 * i);
+}
+
+/* with one channel planar is the same as interleaved */
+static void unpack_planar_neon_1(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *const *channels, float scale) {
+	unpack_neon_1(src, num_records, timestamps, channels[0], scale);
+}
+
+static void unpack_planar_neon_2(uint16_t const *src, int num_records,
+		uint32_t *timestamps, float *const *channels, float scale) {
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		uint16x8x4_t r = vld4q_u16(src);
+		store_timestamps(timestamps + i, r.val[0], r.val[1]);
+		store_scaled(channels[0] + i, r.val[2], scale);
+		store_scaled(channels[1] + i, r.val[3], scale);
+		src += BLOCK * 4;
+	}
+	if (i < num_records) {
+		float *const rest[2] = { channels[0] + i, channels[1] + i };
+		unpack_planar_portable[2](src, num_records - i, timestamps + i, rest, scale);
+	}
+}
+
+static inline __attribute__((always_inline)) void unpack_planar_neon_n(int n, uint16_t const *src,
+		int num_records, uint32_t *timestamps, float *const *channels, float scale) {
+	uint16_t tmp[8][BLOCK];
+	float *rest[8];
+	int i = 0;
+
+	for (; i + BLOCK <= num_records; i += BLOCK) {
+		for (int k = 0; k < BLOCK; k++) {
+			memcpy(&timestamps[i + k], src, sizeof(uint32_t));
+			for (int j = 0; j < n; j++) {
+				tmp[j][k] = src[2 + j];
+			}
+			src += 2 + n;
+		}
+		for (int j = 0; j < n; j++) {
+			store_scaled(channels[j] + i, vld1q_u16(tmp[j]), scale);
+		}
+	}
+	if (i < num_records) {
+		for (int j = 0; j < n; j++) {
+			rest[j] = channels[j] + i;
+		}
+		unpack_planar_portable[n](src, num_records - i, timestamps + i, rest, scale);
+	}
+}
+
+#define DEFINE_UNPACK_NEON(N) \
+	static void unpack_neon_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, float *values, float scale) { \
+		unpack_neon_n(N, src, num_records, timestamps, values, scale); \
+	} \
+	static void unpack_planar_neon_##N(uint16_t const *src, int num_records, \
+			uint32_t *timestamps, float *const *channels, float scale) { \
+		unpack_planar_neon_n(N, src, num_records, timestamps, channels, scale); \
+	}
+
+DEFINE_UNPACK_NEON(3)
+DEFINE_UNPACK_NEON(4)
+DEFINE_UNPACK_NEON(5)
+DEFINE_UNPACK_NEON(6)
+DEFINE_UNPACK_NEON(7)
+DEFINE_UNPACK_NEON(8)
+
+unpack_fn const unpack_neon[9] = {
+	NULL, unpack_neon_1, unpack_neon_2, unpack_neon_3, unpack_neon_4,
+	unpack_neon_5, unpack_neon_6, unpack_neon_7, unpack_neon_8,
+};
+
+unpack_planar_fn const unpack_planar_neon[9] = {
+	NULL, unpack_planar_neon_1, unpack_planar_neon_2, unpack_planar_neon_3, unpack_planar_neon_4,
+	unpack_planar_neon_5, unpack_planar_neon_6, unpack_planar_neon_7, unpack_planar_neon_8,
+};
+
+/* for 3+ channels raw copy is just memcpy, portable kernels do that well */
+unpack_raw_fn const unpack_raw_neon[9] = {
+	NULL, unpack_raw_neon_1, unpack_raw_neon_2,
+};
+
+#else
+
+unpack_fn const unpack_neon[9];
+unpack_raw_fn const unpack_raw_neon[9];
+unpack_planar_fn const unpack_planar_neon[9];
+
+#endif
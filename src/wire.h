@@ -0,0 +1,146 @@
+#ifndef __WIRE_H
+#define __WIRE_H
+
+/*
+ * Layout of data buffers (buffer_t) for each format of command_start_t.
+ * Shared by firmware, emulator, and driver.
+ *
+ * Every buffer starts with num and num_dropped (two uint16). Then:
+ *
+ *   FORMAT_PLAIN        - num records of [ts32, v0, ..., vN-1], all uint16 words
+ *                         (ts32 takes two words, little-endian)
+ *   FORMAT_PACKED       - base (uint32, timestamp of the first record), then values
+ *                         of all records packed at 12 bits, then num int8 deltas:
+ *                         timestamp of record i is base + delta[i]
+ *   FORMAT_PACKED_FIXED - base, then packed values. There are no deltas: timestamp of
+ *                         every record is within ts_jitter of base and is reported as base
+ *
+ * Packed values form a stream where value k (k = record * N + channel) takes
+ * bits 12k..12k+11, little-endian. Sender flushes a packed buffer early when the
+ * next timestamp does not fit (see wire_delta_fits), so num varies.
+ *
+ * Plain buffers hold (496 - 4) / (4 + 2N) records, packed 975 / (3N + 2),
+ * packed fixed 975 / 3N, e.g. 82 / 195 / 325 records with one channel and
+ * 24 / 37 / 40 with eight.
+ */
+#define WIRE_MAX_SIZE (512 - 16)
+#define WIRE_HEADER_SIZE 4
+#define WIRE_BASE_SIZE 4
+
+/*
+ * Buffers of trigger captures (see src/trigger.h) have a trailer right after the
+ * wire_size() bytes above: index of the first record since START, uint64 as two
+ * uint32 (low, high), little-endian.
+ */
+#define WIRE_INDEX_SIZE 8
+
+/*
+ * Sparse buffers, when channels have different rates (see src/schedule.h). A record
+ * holds values of due channels only, and a mask of them: bit j - channels[j]. The
+ * header is followed by num_values (uint16), the number of values in all records.
+ * Then:
+ *
+ *   FORMAT_PLAIN        - num records of [ts32, mask, values of due channels], all uint16 words
+ *   FORMAT_PACKED       - base, packed values, num uint8 masks, num int8 deltas
+ *   FORMAT_PACKED_FIXED - base, packed values, num uint8 masks
+ *
+ * Values are packed the same way as above, k counting values actually present.
+ * Sender fills a sparse buffer while the next record fits even if all channels are
+ * due, so num varies.
+ */
+#define WIRE_COUNT_SIZE 2
+
+/*
+ * Buffers of summary mode hold per-window statistics instead of readings, whatever
+ * the format, see src/summary.h.
+ */
+
+/* largest possible capacity, for sizing the firmware's delta array */
+#define WIRE_MAX_RECORDS 325
+
+/* number of records that fit into size bytes */
+static inline uint16_t wire_capacity_in(uint32_t format, uint16_t num_channels, uint16_t size) {
+	uint16_t payload = size - WIRE_HEADER_SIZE;
+	if (format == FORMAT_PACKED) {
+		/* header + base + ceil(3 * N * num / 2) + num <= WIRE_MAX_SIZE */
+		return (2 * (payload - WIRE_BASE_SIZE) - 1) / (3 * num_channels + 2);
+	} else if (format == FORMAT_PACKED_FIXED) {
+		return (2 * (payload - WIRE_BASE_SIZE) - 1) / (3 * num_channels);
+	}
+	return payload / (4 + 2 * num_channels);
+}
+
+static inline uint16_t wire_capacity(uint32_t format, uint16_t num_channels) {
+	return wire_capacity_in(format, num_channels, WIRE_MAX_SIZE);
+}
+
+/* trigger captures: capacity leaves room for the index trailer */
+static inline uint16_t wire_indexed_capacity(uint32_t format, uint16_t num_channels) {
+	return wire_capacity_in(format, num_channels, WIRE_MAX_SIZE - WIRE_INDEX_SIZE);
+}
+
+/* size of a buffer with num records, in bytes */
+static inline uint16_t wire_size(uint32_t format, uint16_t num_channels, uint16_t num) {
+	uint16_t packed = (3 * num_channels * num + 1) / 2;
+	if (format == FORMAT_PACKED) {
+		return WIRE_HEADER_SIZE + WIRE_BASE_SIZE + packed + num;
+	} else if (format == FORMAT_PACKED_FIXED) {
+		return WIRE_HEADER_SIZE + WIRE_BASE_SIZE + packed;
+	}
+	return WIRE_HEADER_SIZE + num * (4 + 2 * num_channels);
+}
+
+/* size of a sparse buffer with num records and num_values values in them, in bytes */
+static inline uint16_t wire_sparse_size(uint32_t format, uint16_t num, uint16_t num_values) {
+	uint16_t packed = (3 * num_values + 1) / 2;
+	if (format == FORMAT_PACKED) {
+		return WIRE_HEADER_SIZE + WIRE_COUNT_SIZE + WIRE_BASE_SIZE + packed + 2 * num;
+	} else if (format == FORMAT_PACKED_FIXED) {
+		return WIRE_HEADER_SIZE + WIRE_COUNT_SIZE + WIRE_BASE_SIZE + packed + num;
+	}
+	return WIRE_HEADER_SIZE + WIRE_COUNT_SIZE + 6 * num + 2 * num_values;
+}
+
+/* size of a complete sparse buffer, from its header and num_values */
+static inline uint16_t wire_sparse_size_of(uint32_t format, uint8_t const *buffer) {
+	uint16_t num = buffer[0] | (buffer[1] << 8);
+	uint16_t num_values = buffer[WIRE_HEADER_SIZE] | (buffer[WIRE_HEADER_SIZE + 1] << 8);
+	return wire_sparse_size(format, BUFFER_NUM(num), num_values);
+}
+
+/* largest number of sparse records in a buffer, if each holds min_values values */
+static inline uint16_t wire_sparse_capacity(uint32_t format, uint16_t min_values) {
+	uint16_t payload = WIRE_MAX_SIZE - WIRE_HEADER_SIZE - WIRE_COUNT_SIZE;
+	uint16_t capacity;
+	if (format == FORMAT_PACKED) {
+		/* ceil(3 * values / 2) + 2 * num <= payload - base */
+		capacity = (2 * (payload - WIRE_BASE_SIZE) - 1) / (3 * min_values + 4);
+	} else if (format == FORMAT_PACKED_FIXED) {
+		capacity = (2 * (payload - WIRE_BASE_SIZE) - 1) / (3 * min_values + 2);
+	} else {
+		capacity = payload / (6 + 2 * min_values);
+	}
+	return capacity < WIRE_MAX_RECORDS ? capacity : WIRE_MAX_RECORDS;
+}
+
+/* whether a timestamp that differs from base by delta can go to the same buffer */
+static inline int wire_delta_fits(uint32_t format, int32_t delta, uint32_t ts_jitter) {
+	if (format == FORMAT_PACKED) {
+		return delta >= -128 && delta <= 127;
+	}
+	return delta >= -(int32_t) ts_jitter && delta <= (int32_t) ts_jitter;
+}
+
+/* values are written in order, k = 0, 1, 2, ... */
+static inline void wire_put12(uint8_t *packed, uint16_t k, uint16_t value) {
+	uint8_t *p = packed + ((3 * k) >> 1);
+	if (k & 1) {
+		p[0] |= (value & 0xf) << 4;
+		p[1] = value >> 4;
+	} else {
+		p[0] = value & 0xff;
+		p[1] = (value >> 8) & 0xf;
+	}
+}
+
+#endif